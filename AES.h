@@ -14,10 +14,34 @@
 #ifndef AES_H_
 #define AES_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <memory>
+#include <type_traits>
+
+#include "AES_STATS.h"
+
+// AES-NI is reached through per-function target attributes, so the header
+// builds without -maes and the instructions are only used after a CPUID check.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_HAVE_AESNI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define AES_HAVE_AESNI 0
+#endif
+
+// The stream modes also take scatter/gather lists as POSIX struct iovec.
+#if defined(__unix__) || defined(__APPLE__)
+#define AES_HAVE_IOVEC 1
+#include <sys/uio.h>
+#else
+#define AES_HAVE_IOVEC 0
+#endif
 
 // AES S-Box for byte substitution in encryption and decryption
-const unsigned char S_BOX[16][16] = {
+constexpr unsigned char S_BOX[16][16] = {
     {0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
      0xfe, 0xd7, 0xab, 0x76},
     {0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf,
@@ -52,7 +76,7 @@ const unsigned char S_BOX[16][16] = {
      0xb0, 0x54, 0xbb, 0x16}};
 
 // AES Inverse S-Box for byte substitution in decryption
-const unsigned char INV_S_BOX[16][16] = {
+constexpr unsigned char INV_S_BOX[16][16] = {
     {0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e,
      0x81, 0xf3, 0xd7, 0xfb},
     {0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44,
@@ -99,6 +123,548 @@ const unsigned char INVERSE_CONSTANT_MATRIX[4][4] = {{0x0E, 0x0B, 0x0D, 0x09},
                                                      {0x0D, 0x09, 0x0E, 0x0B},
                                                      {0x0B, 0x0D, 0x09, 0x0E}};
 
+// S-boxes and round tables derived from the field arithmetic at compile
+// time. te[k][x] is the MixColumns column contributed by sbox[x] sitting in
+// row k, so SubBytes, ShiftRows and MixColumns on one column become four
+// lookups and three XORs. td holds the same for inv_sbox and the inverse
+// MixColumns matrix.
+struct AESTables {
+  unsigned char sbox[256];
+  unsigned char inv_sbox[256];
+  uint32_t te[4][256];
+  uint32_t td[4][256];
+
+  // Multiplication in GF(2^8) modulo x^8 + x^4 + x^3 + x + 1.
+  static constexpr unsigned char multiply(unsigned char a, unsigned char b) {
+    unsigned char product = 0;
+    while (b) {
+      if (b & 1) product ^= a;
+      a = (unsigned char)((a << 1) ^ ((a & 0x80) ? 0x1B : 0));
+      b >>= 1;
+    }
+    return product;
+  }
+
+  // SubBytes: the multiplicative inverse x^254 (0 maps to 0) followed by the
+  // affine transform of FIPS-197 section 5.1.1.
+  static constexpr unsigned char substitute(unsigned char x) {
+    unsigned char inverse = 1;
+    unsigned char power = x;
+    for (int exponent = 254; exponent != 0; exponent >>= 1) {
+      if (exponent & 1) inverse = multiply(inverse, power);
+      power = multiply(power, power);
+    }
+    unsigned int s = inverse;
+    s ^= (s << 1) ^ (s << 2) ^ (s << 3) ^ (s << 4);
+    return (unsigned char)(s ^ (s >> 8) ^ 0x63);
+  }
+
+  static constexpr uint32_t rotate_right(uint32_t value, int bits) {
+    return bits == 0 ? value : (value >> bits) | (value << (32 - bits));
+  }
+
+  static constexpr AESTables build() {
+    AESTables t{};
+    for (int x = 0; x < 256; x++) {
+      t.sbox[x] = substitute((unsigned char)x);
+      t.inv_sbox[t.sbox[x]] = (unsigned char)x;
+    }
+    for (int x = 0; x < 256; x++) {
+      unsigned char s = t.sbox[x];
+      unsigned char si = t.inv_sbox[x];
+      uint32_t e = (uint32_t)multiply(s, 0x02) << 24 | (uint32_t)s << 16 |
+                   (uint32_t)s << 8 | multiply(s, 0x03);
+      uint32_t d = (uint32_t)multiply(si, 0x0E) << 24 |
+                   (uint32_t)multiply(si, 0x09) << 16 |
+                   (uint32_t)multiply(si, 0x0D) << 8 | multiply(si, 0x0B);
+      for (int k = 0; k < 4; k++) {
+        t.te[k][x] = rotate_right(e, 8 * k);
+        t.td[k][x] = rotate_right(d, 8 * k);
+      }
+    }
+    return t;
+  }
+};
+
+constexpr AESTables AES_TABLES = AESTables::build();
+
+// Word type for the bitsliced engine. Each 64-bit lane carries four blocks,
+// so SSE2 builds process 8 blocks per pass and AVX2 builds (-mavx2) 16.
+#if defined(__GNUC__) && defined(__AVX2__)
+typedef uint64_t BitsliceWord __attribute__((vector_size(32)));
+#elif defined(__GNUC__) && defined(__SSE2__)
+typedef uint64_t BitsliceWord __attribute__((vector_size(16)));
+#else
+typedef uint64_t BitsliceWord;
+#endif
+
+// Constant-time multi-block AES engine. Blocks are transposed into eight bit
+// planes (the layout of BearSSL's aes_ct64), the S-box is evaluated as the
+// Boyar-Peralta Boolean circuit and ShiftRows/MixColumns become shifts and
+// rotations of the planes, so no memory access depends on the data.
+class BitslicedAES {
+ public:
+  static const int kLanes = sizeof(BitsliceWord) / sizeof(uint64_t);
+  static const int kParallelBlocks = 4 * kLanes;
+
+  // round_keys holds the (rounds + 1) * 16 bytes of an expanded key.
+  BitslicedAES(const unsigned char* round_keys, int rounds)
+      : m_rounds(rounds) {
+    for (int round = 0; round <= rounds; round++) {
+      uint32_t words[4];
+      for (int word = 0; word < 4; word++) {
+        words[word] = load_le32(round_keys + 16 * round + 4 * word);
+      }
+      uint64_t q[8];
+      interleave_in(words, q[0], q[4]);
+      for (int i = 1; i < 4; i++) {
+        q[i] = q[0];
+        q[i + 4] = q[4];
+      }
+      ortho(q);
+      memcpy(m_keys[round], q, sizeof(q));
+    }
+  }
+
+  void encrypt(const unsigned char* in, unsigned char* out,
+               size_t nblocks) const {
+    crypt(in, out, nblocks, false);
+  }
+
+  void decrypt(const unsigned char* in, unsigned char* out,
+               size_t nblocks) const {
+    crypt(in, out, nblocks, true);
+  }
+
+ private:
+  static uint32_t load_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+  }
+
+  static void store_le32(uint32_t value, unsigned char* p) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+  }
+
+  static void interleave_in(const uint32_t words[4], uint64_t& q0,
+                            uint64_t& q1) {
+    uint64_t x[4];
+    for (int i = 0; i < 4; i++) {
+      x[i] = words[i];
+      x[i] = (x[i] | (x[i] << 16)) & 0x0000FFFF0000FFFFULL;
+      x[i] = (x[i] | (x[i] << 8)) & 0x00FF00FF00FF00FFULL;
+    }
+    q0 = x[0] | (x[2] << 8);
+    q1 = x[1] | (x[3] << 8);
+  }
+
+  static void interleave_out(uint64_t q0, uint64_t q1, uint32_t words[4]) {
+    uint64_t x[4];
+    x[0] = q0 & 0x00FF00FF00FF00FFULL;
+    x[1] = q1 & 0x00FF00FF00FF00FFULL;
+    x[2] = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+    x[3] = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+    for (int i = 0; i < 4; i++) {
+      x[i] = (x[i] | (x[i] >> 8)) & 0x0000FFFF0000FFFFULL;
+      words[i] = (uint32_t)x[i] | (uint32_t)(x[i] >> 16);
+    }
+  }
+
+  template <typename W>
+  static void swap_bits(W& x, W& y, uint64_t low_mask, int shift) {
+    W a = x;
+    W b = y;
+    x = (a & low_mask) | ((b & low_mask) << shift);
+    y = ((a & ~low_mask) >> shift) | (b & ~low_mask);
+  }
+
+  // Transposes between interleaved blocks and bit planes; it is its own
+  // inverse.
+  template <typename W>
+  static void ortho(W q[8]) {
+    for (int i = 0; i < 8; i += 2) {
+      swap_bits(q[i], q[i + 1], 0x5555555555555555ULL, 1);
+    }
+    for (int i = 0; i < 8; i += 4) {
+      swap_bits(q[i], q[i + 2], 0x3333333333333333ULL, 2);
+      swap_bits(q[i + 1], q[i + 3], 0x3333333333333333ULL, 2);
+    }
+    for (int i = 0; i < 4; i++) {
+      swap_bits(q[i], q[i + 4], 0x0F0F0F0F0F0F0F0FULL, 4);
+    }
+  }
+
+  // S-box circuit of Boyar and Peralta: 113 XOR/AND/XNOR gates. q[0] holds
+  // the least significant bit of every byte.
+  static void sbox(BitsliceWord q[8]) {
+    BitsliceWord x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    BitsliceWord x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // Top linear transformation.
+    BitsliceWord y14 = x3 ^ x5;
+    BitsliceWord y13 = x0 ^ x6;
+    BitsliceWord y9 = x0 ^ x3;
+    BitsliceWord y8 = x0 ^ x5;
+    BitsliceWord t0 = x1 ^ x2;
+    BitsliceWord y1 = t0 ^ x7;
+    BitsliceWord y4 = y1 ^ x3;
+    BitsliceWord y12 = y13 ^ y14;
+    BitsliceWord y2 = y1 ^ x0;
+    BitsliceWord y5 = y1 ^ x6;
+    BitsliceWord y3 = y5 ^ y8;
+    BitsliceWord t1 = x4 ^ y12;
+    BitsliceWord y15 = t1 ^ x5;
+    BitsliceWord y20 = t1 ^ x1;
+    BitsliceWord y6 = y15 ^ x7;
+    BitsliceWord y10 = y15 ^ t0;
+    BitsliceWord y11 = y20 ^ y9;
+    BitsliceWord y7 = x7 ^ y11;
+    BitsliceWord y17 = y10 ^ y11;
+    BitsliceWord y19 = y10 ^ y8;
+    BitsliceWord y16 = t0 ^ y11;
+    BitsliceWord y21 = y13 ^ y16;
+    BitsliceWord y18 = x0 ^ y16;
+
+    // Non-linear section.
+    BitsliceWord t2 = y12 & y15;
+    BitsliceWord t3 = y3 & y6;
+    BitsliceWord t4 = t3 ^ t2;
+    BitsliceWord t5 = y4 & x7;
+    BitsliceWord t6 = t5 ^ t2;
+    BitsliceWord t7 = y13 & y16;
+    BitsliceWord t8 = y5 & y1;
+    BitsliceWord t9 = t8 ^ t7;
+    BitsliceWord t10 = y2 & y7;
+    BitsliceWord t11 = t10 ^ t7;
+    BitsliceWord t12 = y9 & y11;
+    BitsliceWord t13 = y14 & y17;
+    BitsliceWord t14 = t13 ^ t12;
+    BitsliceWord t15 = y8 & y10;
+    BitsliceWord t16 = t15 ^ t12;
+    BitsliceWord t17 = t4 ^ t14;
+    BitsliceWord t18 = t6 ^ t16;
+    BitsliceWord t19 = t9 ^ t14;
+    BitsliceWord t20 = t11 ^ t16;
+    BitsliceWord t21 = t17 ^ y20;
+    BitsliceWord t22 = t18 ^ y19;
+    BitsliceWord t23 = t19 ^ y21;
+    BitsliceWord t24 = t20 ^ y18;
+
+    BitsliceWord t25 = t21 ^ t22;
+    BitsliceWord t26 = t21 & t23;
+    BitsliceWord t27 = t24 ^ t26;
+    BitsliceWord t28 = t25 & t27;
+    BitsliceWord t29 = t28 ^ t22;
+    BitsliceWord t30 = t23 ^ t24;
+    BitsliceWord t31 = t22 ^ t26;
+    BitsliceWord t32 = t31 & t30;
+    BitsliceWord t33 = t32 ^ t24;
+    BitsliceWord t34 = t23 ^ t33;
+    BitsliceWord t35 = t27 ^ t33;
+    BitsliceWord t36 = t24 & t35;
+    BitsliceWord t37 = t36 ^ t34;
+    BitsliceWord t38 = t27 ^ t36;
+    BitsliceWord t39 = t29 & t38;
+    BitsliceWord t40 = t25 ^ t39;
+
+    BitsliceWord t41 = t40 ^ t37;
+    BitsliceWord t42 = t29 ^ t33;
+    BitsliceWord t43 = t29 ^ t40;
+    BitsliceWord t44 = t33 ^ t37;
+    BitsliceWord t45 = t42 ^ t41;
+    BitsliceWord z0 = t44 & y15;
+    BitsliceWord z1 = t37 & y6;
+    BitsliceWord z2 = t33 & x7;
+    BitsliceWord z3 = t43 & y16;
+    BitsliceWord z4 = t40 & y1;
+    BitsliceWord z5 = t29 & y7;
+    BitsliceWord z6 = t42 & y11;
+    BitsliceWord z7 = t45 & y17;
+    BitsliceWord z8 = t41 & y10;
+    BitsliceWord z9 = t44 & y12;
+    BitsliceWord z10 = t37 & y3;
+    BitsliceWord z11 = t33 & y4;
+    BitsliceWord z12 = t43 & y13;
+    BitsliceWord z13 = t40 & y5;
+    BitsliceWord z14 = t29 & y2;
+    BitsliceWord z15 = t42 & y9;
+    BitsliceWord z16 = t45 & y14;
+    BitsliceWord z17 = t41 & y8;
+
+    // Bottom linear transformation.
+    BitsliceWord t46 = z15 ^ z16;
+    BitsliceWord t47 = z10 ^ z11;
+    BitsliceWord t48 = z5 ^ z13;
+    BitsliceWord t49 = z9 ^ z10;
+    BitsliceWord t50 = z2 ^ z12;
+    BitsliceWord t51 = z2 ^ z5;
+    BitsliceWord t52 = z7 ^ z8;
+    BitsliceWord t53 = z0 ^ z3;
+    BitsliceWord t54 = z6 ^ z7;
+    BitsliceWord t55 = z16 ^ z17;
+    BitsliceWord t56 = z12 ^ t48;
+    BitsliceWord t57 = t50 ^ t53;
+    BitsliceWord t58 = z4 ^ t46;
+    BitsliceWord t59 = z3 ^ t54;
+    BitsliceWord t60 = t46 ^ t57;
+    BitsliceWord t61 = z14 ^ t57;
+    BitsliceWord t62 = t52 ^ t58;
+    BitsliceWord t63 = t49 ^ t58;
+    BitsliceWord t64 = z4 ^ t59;
+    BitsliceWord t65 = t61 ^ t62;
+    BitsliceWord t66 = z1 ^ t63;
+    BitsliceWord s0 = t59 ^ t63;
+    BitsliceWord s6 = t56 ^ ~t62;
+    BitsliceWord s7 = t48 ^ ~t60;
+    BitsliceWord t67 = t64 ^ t65;
+    BitsliceWord s3 = t53 ^ t66;
+    BitsliceWord s4 = t51 ^ t66;
+    BitsliceWord s5 = t47 ^ t65;
+    BitsliceWord s1 = t64 ^ ~s3;
+    BitsliceWord s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+  }
+
+  // Inverse of the S-box affine step (including the 0x63 constant).
+  static void inverse_affine(BitsliceWord q[8]) {
+    BitsliceWord x[8];
+    for (int i = 0; i < 8; i++) x[i] = q[i];
+    for (int i = 0; i < 8; i++) {
+      q[i] = x[(i + 7) % 8] ^ x[(i + 5) % 8] ^ x[(i + 2) % 8];
+    }
+    q[0] = ~q[0];
+    q[2] = ~q[2];
+  }
+
+  // InvSubBytes(y) = inverse_affine(SubBytes(inverse_affine(y))), since
+  // SubBytes is the field inversion followed by the affine step.
+  static void inv_sbox(BitsliceWord q[8]) {
+    inverse_affine(q);
+    sbox(q);
+    inverse_affine(q);
+  }
+
+  static void shift_rows(BitsliceWord q[8]) {
+    for (int i = 0; i < 8; i++) {
+      BitsliceWord x = q[i];
+      q[i] = (x & 0x000000000000FFFFULL) |
+             ((x & 0x00000000FFF00000ULL) >> 4) |
+             ((x & 0x00000000000F0000ULL) << 12) |
+             ((x & 0x0000FF0000000000ULL) >> 8) |
+             ((x & 0x000000FF00000000ULL) << 8) |
+             ((x & 0xF000000000000000ULL) >> 12) |
+             ((x & 0x0FFF000000000000ULL) << 4);
+    }
+  }
+
+  static void inv_shift_rows(BitsliceWord q[8]) {
+    for (int i = 0; i < 8; i++) {
+      BitsliceWord x = q[i];
+      q[i] = (x & 0x000000000000FFFFULL) |
+             ((x & 0x000000000FFF0000ULL) << 4) |
+             ((x & 0x00000000F0000000ULL) >> 12) |
+             ((x & 0x000000FF00000000ULL) << 8) |
+             ((x & 0x0000FF0000000000ULL) >> 8) |
+             ((x & 0x000F000000000000ULL) << 12) |
+             ((x & 0xFFF0000000000000ULL) >> 4);
+    }
+  }
+
+  static BitsliceWord rotr32(BitsliceWord x) { return (x << 32) | (x >> 32); }
+
+  static void mix_columns(BitsliceWord q[8]) {
+    BitsliceWord r[8];
+    for (int i = 0; i < 8; i++) r[i] = (q[i] >> 16) | (q[i] << 48);
+    BitsliceWord q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    BitsliceWord q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    q[0] = q7 ^ r[7] ^ r[0] ^ rotr32(q0 ^ r[0]);
+    q[1] = q0 ^ r[0] ^ q7 ^ r[7] ^ r[1] ^ rotr32(q1 ^ r[1]);
+    q[2] = q1 ^ r[1] ^ r[2] ^ rotr32(q2 ^ r[2]);
+    q[3] = q2 ^ r[2] ^ q7 ^ r[7] ^ r[3] ^ rotr32(q3 ^ r[3]);
+    q[4] = q3 ^ r[3] ^ q7 ^ r[7] ^ r[4] ^ rotr32(q4 ^ r[4]);
+    q[5] = q4 ^ r[4] ^ r[5] ^ rotr32(q5 ^ r[5]);
+    q[6] = q5 ^ r[5] ^ r[6] ^ rotr32(q6 ^ r[6]);
+    q[7] = q6 ^ r[6] ^ r[7] ^ rotr32(q7 ^ r[7]);
+  }
+
+  static void inv_mix_columns(BitsliceWord q[8]) {
+    BitsliceWord r[8];
+    for (int i = 0; i < 8; i++) r[i] = (q[i] >> 16) | (q[i] << 48);
+    BitsliceWord q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    BitsliceWord q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    BitsliceWord r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+    BitsliceWord r4 = r[4], r5 = r[5], r6 = r[6], r7 = r[7];
+    q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ rotr32(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+    q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^
+           rotr32(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+    q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^
+           rotr32(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+    q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5 ^
+           rotr32(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+    q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7 ^
+           rotr32(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+    q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7 ^
+           rotr32(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+    q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7 ^
+           rotr32(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+    q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^ rotr32(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+  }
+
+  void add_round_key(BitsliceWord q[8], int round) const {
+    for (int i = 0; i < 8; i++) q[i] ^= m_keys[round][i];
+  }
+
+  void crypt(const unsigned char* in, unsigned char* out, size_t nblocks,
+             bool inverse) const {
+    while (nblocks > 0) {
+      size_t count =
+          nblocks < (size_t)kParallelBlocks ? nblocks : kParallelBlocks;
+
+      // Block 4 * lane + i goes to planes i and i + 4 of that lane; unused
+      // slots of a partial batch are encrypted as zeros and discarded.
+      uint64_t lanes[8][kLanes];
+      for (int lane = 0; lane < kLanes; lane++) {
+        for (int i = 0; i < 4; i++) {
+          size_t block = 4 * lane + i;
+          uint32_t words[4] = {0, 0, 0, 0};
+          if (block < count) {
+            for (int word = 0; word < 4; word++) {
+              words[word] = load_le32(in + 16 * block + 4 * word);
+            }
+          }
+          interleave_in(words, lanes[i][lane], lanes[i + 4][lane]);
+        }
+      }
+      BitsliceWord q[8];
+      memcpy(q, lanes, sizeof(q));
+      ortho(q);
+
+      if (!inverse) {
+        add_round_key(q, 0);
+        for (int round = 1; round < m_rounds; round++) {
+          sbox(q);
+          shift_rows(q);
+          mix_columns(q);
+          add_round_key(q, round);
+        }
+        sbox(q);
+        shift_rows(q);
+        add_round_key(q, m_rounds);
+      } else {
+        add_round_key(q, m_rounds);
+        for (int round = m_rounds - 1; round > 0; round--) {
+          inv_shift_rows(q);
+          inv_sbox(q);
+          add_round_key(q, round);
+          inv_mix_columns(q);
+        }
+        inv_shift_rows(q);
+        inv_sbox(q);
+        add_round_key(q, 0);
+      }
+
+      ortho(q);
+      memcpy(lanes, q, sizeof(q));
+      for (int lane = 0; lane < kLanes; lane++) {
+        for (int i = 0; i < 4; i++) {
+          size_t block = 4 * lane + i;
+          if (block >= count) continue;
+          uint32_t words[4];
+          interleave_out(lanes[i][lane], lanes[i + 4][lane], words);
+          for (int word = 0; word < 4; word++) {
+            store_le32(words[word], out + 16 * block + 4 * word);
+          }
+        }
+      }
+
+      in += 16 * count;
+      out += 16 * count;
+      nblocks -= count;
+    }
+  }
+
+  int m_rounds;
+  uint64_t m_keys[15][8];
+};
+
+#if AES_HAVE_IOVEC
+// Walks an input and an output iovec list in step and yields the runs that
+// are contiguous in both, so that a scatter/gather call can hand each run
+// to the contiguous code path. Empty fragments are skipped.
+class AESIovecCursor {
+ public:
+  AESIovecCursor(const struct iovec* in, size_t in_count,
+                 const struct iovec* out, size_t out_count)
+      : m_in(in),
+        m_in_end(in + in_count),
+        m_out(out),
+        m_out_end(out + out_count),
+        m_in_offset(0),
+        m_out_offset(0) {}
+
+  // Points in and out at the next run and returns its length, or returns 0
+  // once either list is exhausted.
+  size_t next(const uint8_t** in, uint8_t** out) {
+    while (m_in != m_in_end && m_in_offset == m_in->iov_len) {
+      m_in++;
+      m_in_offset = 0;
+    }
+    while (m_out != m_out_end && m_out_offset == m_out->iov_len) {
+      m_out++;
+      m_out_offset = 0;
+    }
+    if (m_in == m_in_end || m_out == m_out_end) return 0;
+    size_t length = m_in->iov_len - m_in_offset;
+    if (m_out->iov_len - m_out_offset < length) {
+      length = m_out->iov_len - m_out_offset;
+    }
+    *in = (const uint8_t*)m_in->iov_base + m_in_offset;
+    *out = (uint8_t*)m_out->iov_base + m_out_offset;
+    m_in_offset += length;
+    m_out_offset += length;
+    return length;
+  }
+
+  // Total bytes of the shorter list.
+  static size_t total(const struct iovec* in, size_t in_count,
+                      const struct iovec* out, size_t out_count) {
+    size_t in_bytes = 0, out_bytes = 0;
+    for (size_t i = 0; i < in_count; i++) in_bytes += in[i].iov_len;
+    for (size_t i = 0; i < out_count; i++) out_bytes += out[i].iov_len;
+    return in_bytes < out_bytes ? in_bytes : out_bytes;
+  }
+
+ private:
+  const struct iovec* m_in;
+  const struct iovec* m_in_end;
+  const struct iovec* m_out;
+  const struct iovec* m_out_end;
+  size_t m_in_offset;
+  size_t m_out_offset;
+};
+#endif
+
+// Round engines an AES object can run on. The constructor picks kAESNI when
+// the CPU supports it and kTTable otherwise; kBitsliced is the constant-time
+// choice for hosts without AES-NI and is only selected on request.
+enum class AESBackend { kTTable, kAESNI, kBitsliced };
+
+template <int Nk>
+class AES;
+template <int Nk>
+class AESCompactCore;
+
 // AES Base class defining the core operations for AES encryption and decryption
 class AESBase {
  public:
@@ -106,20 +672,91 @@ class AESBase {
                        unsigned char cipher_text[4][4]) = 0;
   virtual void decrypt(const unsigned char cipher_text[4][4],
                        unsigned char plain_text[4][4]) = 0;
-  void xor_words(const unsigned char word1[4], const unsigned char word2[4],
-                 unsigned char result[4]) {
-    for (int i = 0; i < 4; i++) {
-      result[i] = word1[i] ^ word2[i];
+
+  // Encrypts nblocks consecutive 16-byte blocks laid out as in
+  // encrypt(). in and out may be the same buffer. The key size classes
+  // override these to interleave several blocks per round.
+  virtual void encrypt_blocks(const uint8_t* in, uint8_t* out,
+                              size_t nblocks) {
+    for (size_t i = 0; i < nblocks; i++) {
+      unsigned char block[4][4];
+      memcpy(block, in + 16 * i, 16);
+      encrypt(block, block);
+      memcpy(out + 16 * i, block, 16);
     }
   }
 
-  void xor_blocks(const unsigned char block1[4][4],
-                  const unsigned char block2[4][4],
-                  unsigned char result[4][4]) {
-    for (int word = 0; word < 4; word++) {
-      xor_words(block1[word], block2[word], result[word]);
+  virtual void decrypt_blocks(const uint8_t* in, uint8_t* out,
+                              size_t nblocks) {
+    for (size_t i = 0; i < nblocks; i++) {
+      unsigned char block[4][4];
+      memcpy(block, in + 16 * i, 16);
+      decrypt(block, block);
+      memcpy(out + 16 * i, block, 16);
     }
   }
+  // Single-block forms of encrypt_blocks/decrypt_blocks for flat buffers.
+  // in and out may be unaligned and may be the same buffer.
+  void encrypt_block(const uint8_t* in, uint8_t* out) {
+    encrypt_blocks(in, out, 1);
+  }
+
+  void decrypt_block(const uint8_t* in, uint8_t* out) {
+    decrypt_blocks(in, out, 1);
+  }
+
+  // out = a ^ b on 16 bytes at any alignment; out may alias a or b. SSE2
+  // builds use one 16-byte store, so an engine loading out right after does
+  // not stall on store forwarding.
+  static void xor_block(const uint8_t* a, const uint8_t* b, uint8_t* out) {
+#if defined(__GNUC__) && defined(__SSE2__)
+    typedef uint64_t Block __attribute__((vector_size(16)));
+    Block x, y;
+    memcpy(&x, a, 16);
+    memcpy(&y, b, 16);
+    x ^= y;
+    memcpy(out, &x, 16);
+#else
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, a, 8);
+    memcpy(&a1, a + 8, 8);
+    memcpy(&b0, b, 8);
+    memcpy(&b1, b + 8, 8);
+    a0 ^= b0;
+    a1 ^= b1;
+    memcpy(out, &a0, 8);
+    memcpy(out + 8, &a1, 8);
+#endif
+  }
+
+  // A memset the compiler cannot drop as a dead store, for key material.
+  // data may be null when length is 0, as for an empty vector.
+  static void wipe(void* data, size_t length) {
+    if (length == 0) return;
+#if defined(__GNUC__)
+    memset(data, 0, length);
+    __asm__ __volatile__("" : : "r"(data) : "memory");
+#else
+    volatile uint8_t* bytes = static_cast<volatile uint8_t*>(data);
+    for (size_t i = 0; i < length; i++) bytes[i] = 0;
+#endif
+  }
+
+  static void xor_words(const unsigned char word1[4],
+                        const unsigned char word2[4],
+                        unsigned char result[4]) {
+    uint32_t a, b;
+    memcpy(&a, word1, 4);
+    memcpy(&b, word2, 4);
+    a ^= b;
+    memcpy(result, &a, 4);
+  }
+
+  static void xor_blocks(const unsigned char block1[4][4],
+                         const unsigned char block2[4][4],
+                         unsigned char result[4][4]) {
+    xor_block(&block1[0][0], &block2[0][0], &result[0][0]);
+  }
 
   void substitute_bytes_for_block(unsigned char block[4][4]) {
     for (int word = 0; word < 4; word++) {
@@ -179,7 +816,7 @@ class AESBase {
     memcpy(block, new_block, 16);
   }
 
-  unsigned char multiply_using_gf(unsigned char a, unsigned char b) {
+  static unsigned char multiply_using_gf(unsigned char a, unsigned char b) {
     unsigned char product = 0;
     while (b) {
       if (b & 1) product ^= a;
@@ -222,207 +859,674 @@ class AESBase {
     }
   }
 
-  void g(const unsigned char word[4], int round, unsigned char result[4]) {
-    const unsigned char first_byte = word[0];
-    for (int i = 1; i < 4; i++) {
-      result[i - 1] = word[i];
+  virtual ~AESBase() = default;
+
+  static bool cpu_has_aesni() {
+#if AES_HAVE_AESNI
+    static const bool supported = [] {
+      unsigned int eax, ebx, ecx, edx;
+      return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) != 0;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+  }
+
+  // Key size in bits: 128, 192 or 256.
+  virtual int key_bits() const = 0;
+
+  AESBackend backend() const { return m_backend; }
+
+  // Switches the round engine. Returns false, leaving the backend unchanged,
+  // if the CPU cannot run the requested one.
+  bool set_backend(AESBackend backend) {
+    if (backend == AESBackend::kAESNI && !cpu_has_aesni()) return false;
+    if (backend == AESBackend::kBitsliced && !m_bitsliced) {
+      m_bitsliced = make_bitsliced();
+      if (!m_bitsliced) return false;
     }
-    result[3] = first_byte;
+    m_backend = backend;
+    return true;
+  }
 
-    substitute_bytes_for_word(result);
+ protected:
+  AESBase()
+      : m_backend(cpu_has_aesni() ? AESBackend::kAESNI : AESBackend::kTTable) {}
 
-    result[0] ^= ROUND_CONSTANT[round - 1];
+  // Builds the bitsliced engine from the key schedule; classes without one
+  // cannot switch to kBitsliced.
+  virtual std::shared_ptr<const BitslicedAES> make_bitsliced() const {
+    return nullptr;
   }
 
-  virtual ~AESBase() = default;
+  // Expands a key, counted as key setup when instrumentation is enabled.
+  template <int Nk>
+  static AES<Nk> expand_key(const unsigned char* key) {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kKeySetup, 4 * Nk);
+    return AES<Nk>(key);
+  }
+
+  // Runs nblocks consecutive 16-byte blocks through the active engine; in and
+  // out may point to the same buffer.
+  template <int Nk>
+  void backend_encrypt(const AES<Nk>& engine, const unsigned char* in,
+                       unsigned char* out, size_t nblocks) const {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kEncryptBlocks, 16 * nblocks);
+    AES_STATS_BACKEND(32 * Nk, m_backend, nblocks);
+#if AES_HAVE_AESNI
+    if (m_backend == AESBackend::kAESNI) {
+      engine.aesni_encrypt_blocks(in, out, nblocks);
+      return;
+    }
+#endif
+    if (m_backend == AESBackend::kBitsliced) {
+      m_bitsliced->encrypt(in, out, nblocks);
+      return;
+    }
+    engine.ttable_encrypt_blocks(in, out, nblocks);
+  }
+
+  template <int Nk>
+  void backend_decrypt(const AES<Nk>& engine, const unsigned char* in,
+                       unsigned char* out, size_t nblocks) const {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kDecryptBlocks, 16 * nblocks);
+    AES_STATS_BACKEND(32 * Nk, m_backend, nblocks);
+#if AES_HAVE_AESNI
+    if (m_backend == AESBackend::kAESNI) {
+      engine.aesni_decrypt_blocks(in, out, nblocks);
+      return;
+    }
+#endif
+    if (m_backend == AESBackend::kBitsliced) {
+      m_bitsliced->decrypt(in, out, nblocks);
+      return;
+    }
+    engine.ttable_decrypt_blocks(in, out, nblocks);
+  }
+
+  AESBackend m_backend;
+  // Built on the first switch to kBitsliced and shared read-only by copies.
+  std::shared_ptr<const BitslicedAES> m_bitsliced;
 };
 
-// AES implementation for 128-bit keys
-class AES128 : public AESBase {
- private:
-  void gen_key_schedule_128() {
-    for (int round = 1; round <= 10; round++) {
-      for (int word = 0; word < 4; word++) {
-        if (word == 0) {
-          unsigned char g_of_last_word[4];
-          g(m_round_keys[round - 1][3], round, g_of_last_word);
-          xor_words(g_of_last_word, m_round_keys[round - 1][0],
-                    m_round_keys[round][word]);
-        } else {
-          xor_words(m_round_keys[round - 1][word],
-                    m_round_keys[round][word - 1], m_round_keys[round][word]);
+// AES with the key size fixed at compile time; Nk is the key length in
+// 32-bit words (4, 6 or 8). The round count is a constant, every round is
+// unrolled and nothing is virtual, so a caller that knows its key size gets
+// the whole cipher inlined. Key expansion is constexpr, so a fixed key can be
+// expanded at compile time:
+//
+//   constexpr unsigned char KEY[16] = {...};
+//   constexpr AES<4> cipher(KEY);
+//
+// AES128, AES192 and AES256 wrap AES<4>, AES<6> and AES<8> behind AESBase.
+template <int Nk>
+class AES {
+  static_assert(Nk == 4 || Nk == 6 || Nk == 8, "Nk must be 4, 6 or 8");
+
+ public:
+  typedef unsigned char RoundKey[4][4];
+
+  static const int kKeyBytes = 4 * Nk;
+  static const int kRounds = Nk + 6;
+
+  // key holds kKeyBytes bytes. The decryption schedule is the equivalent
+  // inverse cipher one: round keys in reverse order with inverse MixColumns
+  // applied to all but the first and last.
+  constexpr explicit AES(const unsigned char* key)
+      : m_encrypt_keys(), m_decrypt_keys() {
+    uint32_t words[4 * (kRounds + 1)] = {};
+    for (int i = 0; i < Nk; i++) words[i] = load_word(key + 4 * i);
+    uint32_t round_constant = 0x01;
+    for (int i = Nk; i < 4 * (kRounds + 1); i++) {
+      uint32_t temp = words[i - 1];
+      if (i % Nk == 0) {
+        temp = substitute_word(temp << 8 | temp >> 24) ^ round_constant << 24;
+        round_constant = AESTables::multiply((unsigned char)round_constant, 2);
+      } else if (Nk > 6 && i % Nk == 4) {
+        temp = substitute_word(temp);
+      }
+      words[i] = words[i - Nk] ^ temp;
+    }
+
+    for (int round = 0; round <= kRounds; round++) {
+      for (int w = 0; w < 4; w++) {
+        uint32_t inverse = words[4 * (kRounds - round) + w];
+        if (round != 0 && round != kRounds) {
+          inverse = inverse_mix_column(inverse);
         }
+        store_word(words[4 * round + w], m_encrypt_keys[round][w]);
+        store_word(inverse, m_decrypt_keys[round][w]);
       }
     }
   }
 
- public:
-  AES128(const unsigned char key[4][4]) {
-    memcpy(m_round_keys[0], key, 16);
-    gen_key_schedule_128();
+  // kRounds + 1 round keys in the layout of the FIPS-197 key schedule.
+  constexpr const RoundKey* encrypt_keys() const { return m_encrypt_keys; }
+  // Round keys for the equivalent inverse cipher, in the order used.
+  constexpr const RoundKey* decrypt_keys() const { return m_decrypt_keys; }
+
+  // Processes nblocks consecutive 16-byte blocks with AES-NI when the CPU
+  // has it and the T-table engine otherwise. in and out may be unaligned and
+  // may be the same buffer.
+  void encrypt_blocks(const unsigned char* in, unsigned char* out,
+                      size_t nblocks) const {
+#if AES_HAVE_AESNI
+    if (AESBase::cpu_has_aesni()) {
+      aesni_encrypt_blocks(in, out, nblocks);
+      return;
+    }
+#endif
+    ttable_encrypt_blocks(in, out, nblocks);
+  }
+
+  void decrypt_blocks(const unsigned char* in, unsigned char* out,
+                      size_t nblocks) const {
+#if AES_HAVE_AESNI
+    if (AESBase::cpu_has_aesni()) {
+      aesni_decrypt_blocks(in, out, nblocks);
+      return;
+    }
+#endif
+    ttable_decrypt_blocks(in, out, nblocks);
+  }
+
+  void encrypt_block(const unsigned char* in, unsigned char* out) const {
+    encrypt_blocks(in, out, 1);
+  }
+
+  void decrypt_block(const unsigned char* in, unsigned char* out) const {
+    decrypt_blocks(in, out, 1);
+  }
+
+  // Independent blocks are interleaved, 4 per round on the T-table engine
+  // and 8 on AES-NI, so that their rounds overlap in the pipeline.
+  void ttable_encrypt_blocks(const unsigned char* in, unsigned char* out,
+                             size_t nblocks) const {
+    for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+      ttable_encrypt<4>(in, out);
+    }
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+      ttable_encrypt<1>(in, out);
+    }
+  }
+
+  void ttable_decrypt_blocks(const unsigned char* in, unsigned char* out,
+                             size_t nblocks) const {
+    for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+      ttable_decrypt<4>(in, out);
+    }
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+      ttable_decrypt<1>(in, out);
+    }
+  }
+
+#if AES_HAVE_AESNI
+  // Callers must check AESBase::cpu_has_aesni() first.
+  __attribute__((target("aes,sse2"))) void aesni_encrypt_blocks(
+      const unsigned char* in, unsigned char* out, size_t nblocks) const {
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+      aesni_encrypt<8>(in, out);
+    }
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+      aesni_encrypt<1>(in, out);
+    }
+  }
+
+  __attribute__((target("aes,sse2"))) void aesni_decrypt_blocks(
+      const unsigned char* in, unsigned char* out, size_t nblocks) const {
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+      aesni_decrypt<8>(in, out);
+    }
+    for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+      aesni_decrypt<1>(in, out);
+    }
+  }
+#endif
+
+ private:
+  // The compact contexts of AES_COMPACT.h share the word helpers below.
+  friend class AESCompactCore<Nk>;
+
+  template <int Round>
+  using RoundIndex = std::integral_constant<int, Round>;
+
+  static constexpr uint32_t load_word(const unsigned char* word) {
+    return (uint32_t)word[0] << 24 | (uint32_t)word[1] << 16 |
+           (uint32_t)word[2] << 8 | word[3];
+  }
+
+  static constexpr void store_word(uint32_t value, unsigned char* word) {
+    word[0] = (unsigned char)(value >> 24);
+    word[1] = (unsigned char)(value >> 16);
+    word[2] = (unsigned char)(value >> 8);
+    word[3] = (unsigned char)value;
+  }
+
+  static constexpr uint32_t substitute_word(uint32_t word) {
+    return (uint32_t)AES_TABLES.sbox[word >> 24] << 24 |
+           (uint32_t)AES_TABLES.sbox[(word >> 16) & 0xFF] << 16 |
+           (uint32_t)AES_TABLES.sbox[(word >> 8) & 0xFF] << 8 |
+           AES_TABLES.sbox[word & 0xFF];
+  }
+
+  // td[k][sbox[x]] is x times row k of the inverse MixColumns matrix.
+  static constexpr uint32_t inverse_mix_column(uint32_t word) {
+    return AES_TABLES.td[0][AES_TABLES.sbox[word >> 24]] ^
+           AES_TABLES.td[1][AES_TABLES.sbox[(word >> 16) & 0xFF]] ^
+           AES_TABLES.td[2][AES_TABLES.sbox[(word >> 8) & 0xFF]] ^
+           AES_TABLES.td[3][AES_TABLES.sbox[word & 0xFF]];
+  }
+
+  // Column w of the next state takes row k from column (w + k) % 4; the
+  // inverse cipher takes it from column (w - k) % 4. a..d are the columns
+  // supplying rows 0..3.
+  static uint32_t encrypt_column(uint32_t a, uint32_t b, uint32_t c,
+                                 uint32_t d) {
+    return AES_TABLES.te[0][a >> 24] ^ AES_TABLES.te[1][(b >> 16) & 0xFF] ^
+           AES_TABLES.te[2][(c >> 8) & 0xFF] ^ AES_TABLES.te[3][d & 0xFF];
+  }
+
+  static uint32_t decrypt_column(uint32_t a, uint32_t b, uint32_t c,
+                                 uint32_t d) {
+    return AES_TABLES.td[0][a >> 24] ^ AES_TABLES.td[1][(b >> 16) & 0xFF] ^
+           AES_TABLES.td[2][(c >> 8) & 0xFF] ^ AES_TABLES.td[3][d & 0xFF];
+  }
+
+  // The rounds recurse on a compile-time index so each one is emitted with
+  // its key offset folded in.
+  template <int Blocks>
+  void ttable_encrypt(const unsigned char* in, unsigned char* out) const {
+    uint32_t s[Blocks][4];
+    for (int i = 0; i < Blocks; i++) {
+      for (int w = 0; w < 4; w++) {
+        s[i][w] = load_word(in + 16 * i + 4 * w) ^
+                  load_word(m_encrypt_keys[0][w]);
+      }
+    }
+    ttable_encrypt_rounds(s, RoundIndex<1>());
+
+    const unsigned char* sbox = AES_TABLES.sbox;
+    for (int i = 0; i < Blocks; i++) {
+      for (int w = 0; w < 4; w++) {
+        store_word(((uint32_t)sbox[s[i][w] >> 24] << 24 |
+                    (uint32_t)sbox[(s[i][(w + 1) & 3] >> 16) & 0xFF] << 16 |
+                    (uint32_t)sbox[(s[i][(w + 2) & 3] >> 8) & 0xFF] << 8 |
+                    sbox[s[i][(w + 3) & 3] & 0xFF]) ^
+                       load_word(m_encrypt_keys[kRounds][w]),
+                   out + 16 * i + 4 * w);
+      }
+    }
+  }
+
+  template <int Blocks, int Round>
+  void ttable_encrypt_rounds(uint32_t (&s)[Blocks][4],
+                             RoundIndex<Round>) const {
+    const RoundKey& key = m_encrypt_keys[Round];
+    for (int i = 0; i < Blocks; i++) {
+      uint32_t s0 = s[i][0], s1 = s[i][1], s2 = s[i][2], s3 = s[i][3];
+      s[i][0] = encrypt_column(s0, s1, s2, s3) ^ load_word(key[0]);
+      s[i][1] = encrypt_column(s1, s2, s3, s0) ^ load_word(key[1]);
+      s[i][2] = encrypt_column(s2, s3, s0, s1) ^ load_word(key[2]);
+      s[i][3] = encrypt_column(s3, s0, s1, s2) ^ load_word(key[3]);
+    }
+    ttable_encrypt_rounds(s, RoundIndex<Round + 1>());
+  }
+
+  template <int Blocks>
+  void ttable_encrypt_rounds(uint32_t (&)[Blocks][4],
+                             RoundIndex<kRounds>) const {}
+
+  template <int Blocks>
+  void ttable_decrypt(const unsigned char* in, unsigned char* out) const {
+    uint32_t s[Blocks][4];
+    for (int i = 0; i < Blocks; i++) {
+      for (int w = 0; w < 4; w++) {
+        s[i][w] = load_word(in + 16 * i + 4 * w) ^
+                  load_word(m_decrypt_keys[0][w]);
+      }
+    }
+    ttable_decrypt_rounds(s, RoundIndex<1>());
+
+    const unsigned char* inv_sbox = AES_TABLES.inv_sbox;
+    for (int i = 0; i < Blocks; i++) {
+      for (int w = 0; w < 4; w++) {
+        store_word(((uint32_t)inv_sbox[s[i][w] >> 24] << 24 |
+                    (uint32_t)inv_sbox[(s[i][(w + 3) & 3] >> 16) & 0xFF]
+                        << 16 |
+                    (uint32_t)inv_sbox[(s[i][(w + 2) & 3] >> 8) & 0xFF] << 8 |
+                    inv_sbox[s[i][(w + 1) & 3] & 0xFF]) ^
+                       load_word(m_decrypt_keys[kRounds][w]),
+                   out + 16 * i + 4 * w);
+      }
+    }
+  }
+
+  template <int Blocks, int Round>
+  void ttable_decrypt_rounds(uint32_t (&s)[Blocks][4],
+                             RoundIndex<Round>) const {
+    const RoundKey& key = m_decrypt_keys[Round];
+    for (int i = 0; i < Blocks; i++) {
+      uint32_t s0 = s[i][0], s1 = s[i][1], s2 = s[i][2], s3 = s[i][3];
+      s[i][0] = decrypt_column(s0, s3, s2, s1) ^ load_word(key[0]);
+      s[i][1] = decrypt_column(s1, s0, s3, s2) ^ load_word(key[1]);
+      s[i][2] = decrypt_column(s2, s1, s0, s3) ^ load_word(key[2]);
+      s[i][3] = decrypt_column(s3, s2, s1, s0) ^ load_word(key[3]);
+    }
+    ttable_decrypt_rounds(s, RoundIndex<Round + 1>());
+  }
+
+  template <int Blocks>
+  void ttable_decrypt_rounds(uint32_t (&)[Blocks][4],
+                             RoundIndex<kRounds>) const {}
+
+#if AES_HAVE_AESNI
+  // The block loops are unrolled explicitly so that the blocks stay in
+  // registers across rounds instead of going through the stack.
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) void aesni_encrypt(
+      const unsigned char* in, unsigned char* out) const {
+    __m128i block[Blocks];
+    __m128i key = _mm_load_si128((const __m128i*)m_encrypt_keys[0]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i), key);
+    }
+    aesni_encrypt_rounds(block, RoundIndex<1>());
+    key = _mm_load_si128((const __m128i*)m_encrypt_keys[kRounds]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i, _mm_aesenclast_si128(block[i], key));
+    }
+  }
+
+  template <int Blocks, int Round>
+  __attribute__((target("aes,sse2"))) void aesni_encrypt_rounds(
+      __m128i (&block)[Blocks], RoundIndex<Round>) const {
+    __m128i key = _mm_load_si128((const __m128i*)m_encrypt_keys[Round]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_aesenc_si128(block[i], key);
+    }
+    aesni_encrypt_rounds(block, RoundIndex<Round + 1>());
+  }
+
+  template <int Blocks>
+  void aesni_encrypt_rounds(__m128i (&)[Blocks], RoundIndex<kRounds>) const {}
+
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) void aesni_decrypt(
+      const unsigned char* in, unsigned char* out) const {
+    __m128i block[Blocks];
+    __m128i key = _mm_load_si128((const __m128i*)m_decrypt_keys[0]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i), key);
+    }
+    aesni_decrypt_rounds(block, RoundIndex<1>());
+    key = _mm_load_si128((const __m128i*)m_decrypt_keys[kRounds]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i, _mm_aesdeclast_si128(block[i], key));
+    }
+  }
+
+  template <int Blocks, int Round>
+  __attribute__((target("aes,sse2"))) void aesni_decrypt_rounds(
+      __m128i (&block)[Blocks], RoundIndex<Round>) const {
+    __m128i key = _mm_load_si128((const __m128i*)m_decrypt_keys[Round]);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_aesdec_si128(block[i], key);
+    }
+    aesni_decrypt_rounds(block, RoundIndex<Round + 1>());
   }
 
+  template <int Blocks>
+  void aesni_decrypt_rounds(__m128i (&)[Blocks], RoundIndex<kRounds>) const {}
+#endif
+
+  alignas(16) RoundKey m_encrypt_keys[kRounds + 1];
+  alignas(16) RoundKey m_decrypt_keys[kRounds + 1];
+};
+
+template <int Nk>
+const int AES<Nk>::kKeyBytes;
+template <int Nk>
+const int AES<Nk>::kRounds;
+
+// AES implementation for 128-bit keys
+class AES128 : public AESBase {
+ public:
+  AES128(const unsigned char key[4][4])
+      : m_engine(expand_key<4>(&key[0][0])) {}
+
+  // Wraps an already expanded schedule, e.g. one from AESKeyCache.
+  explicit AES128(const AES<4>& engine) : m_engine(engine) {}
+
   void encrypt(const unsigned char plain_text[4][4],
                unsigned char cipher_text[4][4]) override {
-    xor_blocks(plain_text, m_round_keys[0], cipher_text);
+    backend_encrypt(m_engine, &plain_text[0][0], &cipher_text[0][0], 1);
+  }
+
+  void decrypt(const unsigned char cipher_text[4][4],
+               unsigned char plain_text[4][4]) override {
+    backend_decrypt(m_engine, &cipher_text[0][0], &plain_text[0][0], 1);
+  }
+
+  void encrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_encrypt(m_engine, in, out, nblocks);
+  }
+
+  void decrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_decrypt(m_engine, in, out, nblocks);
+  }
+
+  int key_bits() const override { return 128; }
+
+  const AES<4>& engine() const { return m_engine; }
+
+  // Byte-wise implementation kept as a reference for cross-checking the
+  // table-driven and AES-NI engines.
+  void encrypt_reference(const unsigned char plain_text[4][4],
+                         unsigned char cipher_text[4][4]) {
+    const AES<4>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(plain_text, round_keys[0], cipher_text);
 
     for (int round = 1; round <= 9; round++) {
       substitute_bytes_for_block(cipher_text);
       shift_rows(cipher_text);
       mix_column(cipher_text);
-      xor_blocks(cipher_text, m_round_keys[round], cipher_text);
+      xor_blocks(cipher_text, round_keys[round], cipher_text);
     }
 
     substitute_bytes_for_block(cipher_text);
     shift_rows(cipher_text);
-    xor_blocks(cipher_text, m_round_keys[10], cipher_text);
+    xor_blocks(cipher_text, round_keys[10], cipher_text);
   }
 
-  void decrypt(const unsigned char cipher_text[4][4],
-               unsigned char plain_text[4][4]) override {
-    xor_blocks(cipher_text, m_round_keys[10], plain_text);
+  void decrypt_reference(const unsigned char cipher_text[4][4],
+                         unsigned char plain_text[4][4]) {
+    const AES<4>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(cipher_text, round_keys[10], plain_text);
     inverse_substitute_bytes_for_block(plain_text);
     inverse_shift_rows(plain_text);
 
     for (int round = 9; round >= 1; round--) {
-      xor_blocks(plain_text, m_round_keys[round], plain_text);
+      xor_blocks(plain_text, round_keys[round], plain_text);
       inverse_mix_column(plain_text);
       inverse_substitute_bytes_for_block(plain_text);
       inverse_shift_rows(plain_text);
     }
-    xor_blocks(plain_text, m_round_keys[0], plain_text);
+    xor_blocks(plain_text, round_keys[0], plain_text);
   }
 
- public:
-  unsigned char m_round_keys[11][4][4];
+ protected:
+  std::shared_ptr<const BitslicedAES> make_bitsliced() const override {
+    return std::make_shared<const BitslicedAES>(
+        &m_engine.encrypt_keys()[0][0][0], AES<4>::kRounds);
+  }
+
+ private:
+  AES<4> m_engine;
 };
 
 // AES implementation for 192-bit keys
 class AES192 : public AESBase {
- private:
-  void gen_key_schedule_192() {
-    int round = 1;
-    for (int word = 6; word < 52; word++) {
-      if (word % 6 == 0) {
-        g(*(*m_round_keys + word - 1), round, *(*m_round_keys + word));
-        xor_words(*(*m_round_keys + word), *(*m_round_keys + word - 6),
-                  *(*m_round_keys + word));
-        round++;
-      } else {
-        xor_words(*(*m_round_keys + word - 1), *(*m_round_keys + word - 6),
-                  *(*m_round_keys + word));
-      }
-    }
-  }
-
  public:
-  AES192(const unsigned char key[6][4]) {
-    memcpy(m_round_keys[0], key, 24);
-    gen_key_schedule_192();
-  }
+  AES192(const unsigned char key[6][4])
+      : m_engine(expand_key<6>(&key[0][0])) {}
+
+  // Wraps an already expanded schedule, e.g. one from AESKeyCache.
+  explicit AES192(const AES<6>& engine) : m_engine(engine) {}
 
   void encrypt(const unsigned char plain_text[4][4],
                unsigned char cipher_text[4][4]) override {
-    xor_blocks(m_round_keys[0], plain_text, cipher_text);
-    for (int round = 1; round < 12; round++) {
+    backend_encrypt(m_engine, &plain_text[0][0], &cipher_text[0][0], 1);
+  }
+
+  void decrypt(const unsigned char cipher_text[4][4],
+               unsigned char plain_text[4][4]) override {
+    backend_decrypt(m_engine, &cipher_text[0][0], &plain_text[0][0], 1);
+  }
+
+  void encrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_encrypt(m_engine, in, out, nblocks);
+  }
+
+  void decrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_decrypt(m_engine, in, out, nblocks);
+  }
+
+  int key_bits() const override { return 192; }
+
+  const AES<6>& engine() const { return m_engine; }
+
+  // Byte-wise implementation kept as a reference for cross-checking the
+  // table-driven and AES-NI engines.
+  void encrypt_reference(const unsigned char plain_text[4][4],
+                         unsigned char cipher_text[4][4]) {
+    const AES<6>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(plain_text, round_keys[0], cipher_text);
+
+    for (int round = 1; round <= 11; round++) {
       substitute_bytes_for_block(cipher_text);
       shift_rows(cipher_text);
       mix_column(cipher_text);
-      xor_blocks(m_round_keys[round], cipher_text, cipher_text);
+      xor_blocks(cipher_text, round_keys[round], cipher_text);
     }
+
     substitute_bytes_for_block(cipher_text);
     shift_rows(cipher_text);
-    xor_blocks(cipher_text, m_round_keys[12], cipher_text);
+    xor_blocks(cipher_text, round_keys[12], cipher_text);
   }
 
-  void decrypt(const unsigned char cipher_text[4][4],
-               unsigned char plain_text[4][4]) override {
-    xor_blocks(cipher_text, m_round_keys[12], plain_text);
+  void decrypt_reference(const unsigned char cipher_text[4][4],
+                         unsigned char plain_text[4][4]) {
+    const AES<6>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(cipher_text, round_keys[12], plain_text);
     inverse_substitute_bytes_for_block(plain_text);
     inverse_shift_rows(plain_text);
+
     for (int round = 11; round >= 1; round--) {
-      xor_blocks(plain_text, m_round_keys[round], plain_text);
+      xor_blocks(plain_text, round_keys[round], plain_text);
       inverse_mix_column(plain_text);
       inverse_substitute_bytes_for_block(plain_text);
       inverse_shift_rows(plain_text);
     }
-    xor_blocks(plain_text, m_round_keys[0], plain_text);
+    xor_blocks(plain_text, round_keys[0], plain_text);
+  }
+
+ protected:
+  std::shared_ptr<const BitslicedAES> make_bitsliced() const override {
+    return std::make_shared<const BitslicedAES>(
+        &m_engine.encrypt_keys()[0][0][0], AES<6>::kRounds);
   }
 
  private:
-  unsigned char m_round_keys[13][4][4];
+  AES<6> m_engine;
 };
 
 // AES implementation for 256-bit keys
 class AES256 : public AESBase {
- private:
-  void gen_key_schedule_256() {
-    bool flag = true;
-    int round = 1;
-    for (int block = 2; block < 15; block++) {
-      for (int word = 0; word < 4; word++) {
-        if (word == 0) {
-          if (flag == true) {
-            unsigned char g_of_last_word[4];
-            g(m_round_keys[block - 1][3], round, g_of_last_word);
-            xor_words(g_of_last_word, m_round_keys[block - 2][0],
-                      m_round_keys[block][word]);
-            flag = false;
-            round++;
-          } else {
-            memcpy(m_round_keys[block][word], m_round_keys[block - 1][3], 4);
-            substitute_bytes_for_word(m_round_keys[block][word]);
-            xor_words(m_round_keys[block][word], m_round_keys[block - 2][0],
-                      m_round_keys[block][word]);
-            flag = true;
-          }
-        } else {
-          xor_words(m_round_keys[block - 2][word],
-                    m_round_keys[block][word - 1], m_round_keys[block][word]);
-        }
-      }
-    }
-  }
-
  public:
-  AES256(const unsigned char key[8][4]) {
-    memcpy(m_round_keys[0], key, 32);
-    gen_key_schedule_256();
-  }
+  AES256(const unsigned char key[8][4])
+      : m_engine(expand_key<8>(&key[0][0])) {}
+
+  // Wraps an already expanded schedule, e.g. one from AESKeyCache.
+  explicit AES256(const AES<8>& engine) : m_engine(engine) {}
 
   void encrypt(const unsigned char plain_text[4][4],
                unsigned char cipher_text[4][4]) override {
-    xor_blocks(plain_text, m_round_keys[0], cipher_text);
+    backend_encrypt(m_engine, &plain_text[0][0], &cipher_text[0][0], 1);
+  }
+
+  void decrypt(const unsigned char cipher_text[4][4],
+               unsigned char plain_text[4][4]) override {
+    backend_decrypt(m_engine, &cipher_text[0][0], &plain_text[0][0], 1);
+  }
+
+  void encrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_encrypt(m_engine, in, out, nblocks);
+  }
+
+  void decrypt_blocks(const uint8_t* in, uint8_t* out,
+                      size_t nblocks) override {
+    backend_decrypt(m_engine, in, out, nblocks);
+  }
+
+  int key_bits() const override { return 256; }
+
+  const AES<8>& engine() const { return m_engine; }
+
+  // Byte-wise implementation kept as a reference for cross-checking the
+  // table-driven and AES-NI engines.
+  void encrypt_reference(const unsigned char plain_text[4][4],
+                         unsigned char cipher_text[4][4]) {
+    const AES<8>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(plain_text, round_keys[0], cipher_text);
 
     for (int round = 1; round <= 13; round++) {
       substitute_bytes_for_block(cipher_text);
       shift_rows(cipher_text);
       mix_column(cipher_text);
-      xor_blocks(cipher_text, m_round_keys[round], cipher_text);
+      xor_blocks(cipher_text, round_keys[round], cipher_text);
     }
 
     substitute_bytes_for_block(cipher_text);
     shift_rows(cipher_text);
-    xor_blocks(cipher_text, m_round_keys[14], cipher_text);
+    xor_blocks(cipher_text, round_keys[14], cipher_text);
   }
 
-  void decrypt(const unsigned char cipher_text[4][4],
-               unsigned char plain_text[4][4]) override {
-    xor_blocks(cipher_text, m_round_keys[14], plain_text);
+  void decrypt_reference(const unsigned char cipher_text[4][4],
+                         unsigned char plain_text[4][4]) {
+    const AES<8>::RoundKey* round_keys = m_engine.encrypt_keys();
+    xor_blocks(cipher_text, round_keys[14], plain_text);
     inverse_substitute_bytes_for_block(plain_text);
     inverse_shift_rows(plain_text);
 
     for (int round = 13; round >= 1; round--) {
-      xor_blocks(plain_text, m_round_keys[round], plain_text);
+      xor_blocks(plain_text, round_keys[round], plain_text);
       inverse_mix_column(plain_text);
       inverse_substitute_bytes_for_block(plain_text);
       inverse_shift_rows(plain_text);
     }
-    xor_blocks(plain_text, m_round_keys[0], plain_text);
+    xor_blocks(plain_text, round_keys[0], plain_text);
   }
 
- public:
-  unsigned char m_round_keys[15][4][4];
+ protected:
+  std::shared_ptr<const BitslicedAES> make_bitsliced() const override {
+    return std::make_shared<const BitslicedAES>(
+        &m_engine.encrypt_keys()[0][0][0], AES<8>::kRounds);
+  }
+
+ private:
+  AES<8> m_engine;
 };
 
 #endif
@@ -0,0 +1,421 @@
+/*
+ * AES Asynchronous Requests
+ *
+ * Lets an event loop encrypt without blocking on large payloads and without
+ * a thread per request. AESAsync takes CTR and GCM requests with a
+ * completion callback and sorts them by size:
+ *
+ *   - Requests of up to inline_bytes run on the loop's own thread, where a
+ *     handoff would cost more than the work. They are queued until poll(),
+ *     which the loop calls once per iteration, and then go through the
+ *     cipher together: the counter blocks of consecutive queued requests
+ *     are encrypted in one encrypt_blocks call of up to kSegmentBytes,
+ *     after which each request only XORs (and for GCM hashes) its share.
+ *     Many small concurrent requests thus cost about as much as one large
+ *     one.
+ *   - Larger requests are handed to a dispatcher thread, which runs them
+ *     one after another: CTR spread over the shared thread pool, GCM on
+ *     the dispatcher itself, as GHASH is one serial chain.
+ *
+ * Every callback runs inside poll(), on the loop's thread, so callbacks
+ * need no locking and may submit further requests. The dispatcher only
+ * calls the wakeup function, if one is set, when a large request finishes,
+ * e.g. to write to an eventfd the loop is waiting on. Buffers must stay
+ * valid until the callback has run. An AESAsync belongs to one thread.
+ *
+ * Built as C++20 with coroutine support, encrypt_async(request) and
+ * decrypt_async(request) without a callback return an awaitable, so a
+ * coroutine can write ok = co_await async.encrypt_async(request).
+ */
+
+#ifndef AES_ASYNC_H_
+#define AES_ASYNC_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "AES.h"
+#include "AES_CTR.h"
+#include "AES_GCM.h"
+#include "AES_POOL.h"
+
+#if !defined(AES_HAVE_COROUTINES)
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#define AES_HAVE_COROUTINES 1
+#else
+#define AES_HAVE_COROUTINES 0
+#endif
+#endif
+
+#if AES_HAVE_COROUTINES
+#include <coroutine>
+#endif
+
+enum class AESAsyncMode { kCTR, kGCM };
+
+struct AESAsyncRequest {
+  AESAsyncMode mode = AESAsyncMode::kCTR;
+  // The 16-byte initial counter block for CTR, the 12-byte IV for GCM.
+  const uint8_t* iv = nullptr;
+  const uint8_t* in = nullptr;
+  uint8_t* out = nullptr;
+  size_t length = 0;
+  // GCM only. The tag is written by encryption and checked by decryption;
+  // tag_length must be 4, 8 or 12 to 16.
+  const uint8_t* aad = nullptr;
+  size_t aad_length = 0;
+  uint8_t* tag = nullptr;
+  size_t tag_length = 16;
+};
+
+// How requests were served. batches counts poll() passes over inline
+// requests.
+struct AESAsyncStats {
+  uint64_t inline_requests = 0;
+  uint64_t batches = 0;
+  uint64_t offloaded_requests = 0;
+};
+
+class AESAsync {
+ public:
+  // Called with false when a GCM tag does not match or tag_length is not a
+  // valid GCM tag length, otherwise true.
+  typedef std::function<void(bool ok)> Callback;
+
+  // Keystream per encrypt_blocks call over inline requests: enough blocks
+  // for every lane of the engines, few enough to stay in L1 with the data.
+  static const size_t kSegmentBytes = 4096;
+  static const size_t kMaxInlineBytes = AESThreadPool::kChunkBytes;
+  static const size_t kDefaultInlineBytes = 16 * 1024;
+
+  // The cipher is borrowed, not copied, and must outlive this object.
+  // inline_bytes is capped at kMaxInlineBytes. Large CTR requests use up to
+  // threads threads of the pool; 0 means all of them.
+  explicit AESAsync(AESBase& cipher,
+                    size_t inline_bytes = kDefaultInlineBytes,
+                    unsigned int threads = 0)
+      : m_cipher(cipher),
+        m_inline_bytes(inline_bytes < kMaxInlineBytes ? inline_bytes
+                                                      : kMaxInlineBytes),
+        m_threads(threads),
+        m_pool(nullptr),
+        m_gcm(cipher),
+        m_dispatch_gcm(cipher),
+        m_keystream(kSegmentBytes > m_inline_bytes + 32 ? kSegmentBytes
+                                                        : m_inline_bytes + 32),
+        m_polling(false),
+        m_outstanding(0),
+        m_stopping(false) {}
+
+  AESAsync(const AESAsync&) = delete;
+  AESAsync& operator=(const AESAsync&) = delete;
+
+  // Runs every request still pending and calls back, as drain() does.
+  ~AESAsync() {
+    drain();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_ready.notify_one();
+    if (m_dispatcher.joinable()) m_dispatcher.join();
+  }
+
+  // The pool is borrowed and must outlive this object. Set it before the
+  // first request.
+  void set_pool(AESThreadPool& pool) { m_pool = &pool; }
+
+  // Called on the dispatcher thread whenever a large request has finished
+  // and poll() has a callback to run. Set it before the first request.
+  void set_wakeup(std::function<void()> wakeup) {
+    m_wakeup = std::move(wakeup);
+  }
+
+  // Encrypts the request; a later poll() calls done. For CTR, encryption
+  // and decryption are the same operation.
+  void encrypt_async(const AESAsyncRequest& request, Callback done) {
+    submit(request, true, std::move(done));
+  }
+
+  // Decrypts the request; for GCM, done learns whether the tag matched, and
+  // on a mismatch out must be discarded.
+  void decrypt_async(const AESAsyncRequest& request, Callback done) {
+    submit(request, false, std::move(done));
+  }
+
+  // Runs the queued inline requests and calls the callbacks of those and of
+  // every large request that has finished. Requests that the callbacks
+  // submit wait for the next poll(). Returns the number of callbacks
+  // called; from inside a callback it does nothing.
+  size_t poll() {
+    if (m_polling) return 0;
+    m_polling = true;
+    size_t called = run_batch();
+    std::deque<Job> finished;
+    if (m_outstanding > 0) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      finished.swap(m_finished);
+    }
+    m_outstanding -= finished.size();
+    for (Job& job : finished) job.done(job.ok);
+    m_batch.clear();
+    m_batch.swap(m_deferred);
+    m_polling = false;
+    return called + finished.size();
+  }
+
+  // Polls until no request is pending, including any that callbacks submit
+  // meanwhile, waiting for large requests as needed. Like poll(), it does
+  // nothing from inside a callback.
+  void drain() {
+    while (pending() > 0 && !m_polling) {
+      if (m_batch.empty()) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return !m_finished.empty(); });
+      }
+      poll();
+    }
+  }
+
+  // Requests whose callbacks have not been called yet.
+  size_t pending() const {
+    return m_batch.size() + m_deferred.size() + m_outstanding;
+  }
+
+  const AESAsyncStats& stats() const { return m_stats; }
+
+#if AES_HAVE_COROUTINES
+  // co_await yields the callback's ok; the coroutine resumes in poll().
+  class Awaiter {
+   public:
+    Awaiter(AESAsync& async, const AESAsyncRequest& request, bool encrypting)
+        : m_async(async),
+          m_request(request),
+          m_encrypting(encrypting),
+          m_ok(false) {}
+
+    bool await_ready() const { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      m_async.submit(m_request, m_encrypting, [this, handle](bool ok) {
+        m_ok = ok;
+        handle.resume();
+      });
+    }
+
+    bool await_resume() const { return m_ok; }
+
+   private:
+    AESAsync& m_async;
+    AESAsyncRequest m_request;
+    bool m_encrypting;
+    bool m_ok;
+  };
+
+  Awaiter encrypt_async(const AESAsyncRequest& request) {
+    return Awaiter(*this, request, true);
+  }
+
+  Awaiter decrypt_async(const AESAsyncRequest& request) {
+    return Awaiter(*this, request, false);
+  }
+#endif
+
+ private:
+  struct Job {
+    Job(const AESAsyncRequest& request, bool encrypting, Callback&& done)
+        : request(request),
+          encrypting(encrypting),
+          done(std::move(done)),
+          ok(true) {}
+
+    AESAsyncRequest request;
+    bool encrypting;
+    Callback done;
+    bool ok;
+  };
+
+  // Runs the queued inline requests and calls them back, segment by
+  // segment while their jobs are still in cache. Consecutive requests share
+  // encrypt_blocks calls; one longer than a segment has one to itself.
+  size_t run_batch() {
+    size_t count = m_batch.size();
+    if (count == 0) return 0;
+    m_stats.batches++;
+    size_t used = 0;
+    for (size_t first = 0; first < count;) {
+      size_t end = first;
+      size_t bytes = 0;
+      do {
+        bytes += counter_blocks(m_batch[end].request,
+                                m_keystream.data() + bytes);
+        end++;
+      } while (end < count &&
+               bytes + keystream_bytes(m_batch[end].request) <=
+                   kSegmentBytes);
+      m_cipher.encrypt_blocks(m_keystream.data(), m_keystream.data(),
+                              bytes / 16);
+      run_segment(first, end);
+      if (bytes > used) used = bytes;
+      for (; first < end; first++) m_batch[first].done(m_batch[first].ok);
+    }
+    AESBase::wipe(m_keystream.data(), used);
+    return count;
+  }
+
+  // XORs (and hashes) the requests from first to end against the keystream
+  // of the current segment.
+  void run_segment(size_t first, size_t end) {
+    const uint8_t* keystream = m_keystream.data();
+    for (size_t i = first; i < end; i++) {
+      Job& job = m_batch[i];
+      const AESAsyncRequest& request = job.request;
+      if (request.mode == AESAsyncMode::kCTR) {
+        AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCTR,
+                        request.length);
+        AESCTR::xor_bytes(request.in, keystream, request.out,
+                          request.length);
+      } else if (job.encrypting) {
+        job.ok = m_gcm.encrypt_precomputed(
+            keystream, keystream + 16, request.aad, request.aad_length,
+            request.in, request.out, request.length, request.tag,
+            request.tag_length);
+      } else {
+        job.ok = m_gcm.decrypt_precomputed(
+            keystream, keystream + 16, request.aad, request.aad_length,
+            request.in, request.out, request.length, request.tag,
+            request.tag_length);
+      }
+      keystream += keystream_bytes(request);
+    }
+  }
+
+  // Whole blocks of keystream for a request, after E(J0) for GCM.
+  static size_t keystream_bytes(const AESAsyncRequest& request) {
+    size_t bytes = (request.length + 15) / 16 * 16;
+    return request.mode == AESAsyncMode::kGCM ? 16 + bytes : bytes;
+  }
+
+  // Writes the counter blocks of a request and returns their size.
+  static size_t counter_blocks(const AESAsyncRequest& request, uint8_t* out) {
+    size_t bytes = keystream_bytes(request);
+    if (request.mode == AESAsyncMode::kCTR) {
+      AESCTR::counters(request.iv, out, bytes / 16);
+      return bytes;
+    }
+    // J0 = IV || 1, then the counters from inc32(J0) on.
+    for (size_t i = 0; i < bytes / 16; i++) {
+      uint32_t counter = (uint32_t)(i + 1);
+      memcpy(out + 16 * i, request.iv, 12);
+      out[16 * i + 12] = (uint8_t)(counter >> 24);
+      out[16 * i + 13] = (uint8_t)(counter >> 16);
+      out[16 * i + 14] = (uint8_t)(counter >> 8);
+      out[16 * i + 15] = (uint8_t)counter;
+    }
+    return bytes;
+  }
+
+  void submit(const AESAsyncRequest& request, bool encrypting,
+              Callback done) {
+    if (request.length <= m_inline_bytes) {
+      m_stats.inline_requests++;
+      // m_batch is being run and called back while polling.
+      (m_polling ? m_deferred : m_batch)
+          .emplace_back(request, encrypting, std::move(done));
+      return;
+    }
+
+    Job job(request, encrypting, std::move(done));
+    m_stats.offloaded_requests++;
+    m_outstanding++;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_dispatcher.joinable()) {
+        m_dispatcher = std::thread([this] { dispatch(); });
+      }
+      m_queue.push_back(std::move(job));
+    }
+    m_ready.notify_one();
+  }
+
+  // The dispatcher thread: runs large requests until stopped with none
+  // left, and hands them back to poll().
+  void dispatch() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      m_ready.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+      if (m_queue.empty()) return;
+      Job job = std::move(m_queue.front());
+      m_queue.pop_front();
+      lock.unlock();
+      run_large(job);
+      lock.lock();
+      m_finished.push_back(std::move(job));
+      m_done.notify_one();
+      if (m_wakeup) {
+        lock.unlock();
+        m_wakeup();
+        lock.lock();
+      }
+    }
+  }
+
+  void run_large(Job& job) {
+    const AESAsyncRequest& request = job.request;
+    if (request.mode == AESAsyncMode::kCTR) {
+      AESThreadPool& pool = m_pool ? *m_pool : AESThreadPool::shared();
+      AESCTR ctr(m_cipher, request.iv,
+                 m_threads ? m_threads : pool.workers() + 1);
+      ctr.set_pool(pool);
+      ctr.process(request.in, request.out, request.length);
+    } else if (job.encrypting) {
+      job.ok = m_dispatch_gcm.encrypt(request.iv, 12, request.aad,
+                                      request.aad_length, request.in,
+                                      request.out, request.length,
+                                      request.tag, request.tag_length);
+    } else {
+      job.ok = m_dispatch_gcm.decrypt(request.iv, 12, request.aad,
+                                      request.aad_length, request.in,
+                                      request.out, request.length,
+                                      request.tag, request.tag_length);
+    }
+  }
+
+  AESBase& m_cipher;
+  const size_t m_inline_bytes;
+  const unsigned int m_threads;
+  AESThreadPool* m_pool;
+  // Inline GCM requests use m_gcm; the dispatcher has its own.
+  AESGCM m_gcm;
+  AESGCM m_dispatch_gcm;
+  AESAsyncStats m_stats;
+
+  std::function<void()> m_wakeup;
+
+  // Inline requests, owned by the submitting thread. The keystream buffer
+  // holds a segment, or the longest inline request.
+  std::vector<Job> m_batch;
+  std::vector<Job> m_deferred;
+  std::vector<uint8_t> m_keystream;
+  bool m_polling;
+  // Large requests submitted and not yet called back.
+  size_t m_outstanding;
+
+  // Large requests, shared with the dispatcher.
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_done;
+  std::deque<Job> m_queue;
+  std::deque<Job> m_finished;
+  bool m_stopping;
+  std::thread m_dispatcher;
+};
+
+#endif
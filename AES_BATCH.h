@@ -0,0 +1,225 @@
+/*
+ * AES Key-Agile Batches
+ *
+ * Encrypts or decrypts many single blocks, each under its own key, as in key
+ * wrapping or per-object keys. There, building a cipher object and running
+ * key expansion for every block costs far more than the block itself.
+ *
+ * With AES-NI the keys are expanded kLanes at a time without building any
+ * schedule objects. Each 128-bit schedule word holds the same FIPS-197 key
+ * word of four different keys, one per 32-bit lane, so one pass of the key
+ * expansion recurrence expands four keys. SubWord runs on all four lanes in
+ * one AESENCLAST after a byte shuffle that undoes its ShiftRows. A round's
+ * four round keys are then a 4x4 transpose of four schedule words, and the
+ * kLanes blocks go through that round together, so the block rounds overlap
+ * in the pipeline just as in encrypt_blocks().
+ *
+ * Without AES-NI each pair expands an AES<Nk> on the stack and runs the
+ * T-table engine. Neither path allocates.
+ */
+
+#ifndef AES_BATCH_H_
+#define AES_BATCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "AES.h"
+
+template <int Nk>
+class AESKeyBatch {
+ public:
+  static const int kKeyBytes = AES<Nk>::kKeyBytes;
+  // Pairs processed together: two groups of four keys, one per lane.
+  static const size_t kLanes = 8;
+
+  struct Pair {
+    // kKeyBytes bytes.
+    const unsigned char* key;
+    const uint8_t* in;
+    // Receives the 16-byte result; may be the same as in.
+    uint8_t* out;
+  };
+
+  // Encrypts each pair's block under its own key.
+  static void encrypt(const Pair* pairs, size_t count) {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kEncryptBlocks, 16 * count);
+    crypt<false>(pairs, count);
+  }
+
+  // Decrypts each pair's block under its own key.
+  static void decrypt(const Pair* pairs, size_t count) {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kDecryptBlocks, 16 * count);
+    crypt<true>(pairs, count);
+  }
+
+ private:
+  static const int kRounds = AES<Nk>::kRounds;
+  static const int kWords = 4 * (kRounds + 1);
+
+  template <bool Decrypt>
+  static void crypt(const Pair* pairs, size_t count) {
+#if AES_HAVE_AESNI
+    if (supported()) {
+      AES_STATS_BACKEND(32 * Nk, AESBackend::kAESNI, count);
+      size_t done = 0;
+      for (; done + kLanes <= count; done += kLanes) {
+        aesni_crypt<Decrypt>(pairs + done);
+      }
+      if (done < count) {
+        // Fill the missing lanes with the first key and scratch blocks.
+        Pair tail[kLanes];
+        uint8_t scratch[16 * kLanes] = {0};
+        for (size_t i = 0; i < kLanes; i++) {
+          tail[i] = done + i < count
+                        ? pairs[done + i]
+                        : Pair{pairs[done].key, scratch + 16 * i,
+                               scratch + 16 * i};
+        }
+        aesni_crypt<Decrypt>(tail);
+      }
+      return;
+    }
+#endif
+    AES_STATS_BACKEND(32 * Nk, AESBackend::kTTable, count);
+    for (size_t i = 0; i < count; i++) {
+      AES<Nk> engine(pairs[i].key);
+      if (Decrypt) {
+        engine.ttable_decrypt_blocks(pairs[i].in, pairs[i].out, 1);
+      } else {
+        engine.ttable_encrypt_blocks(pairs[i].in, pairs[i].out, 1);
+      }
+    }
+  }
+
+#if AES_HAVE_AESNI
+  // The lane shuffles need SSSE3, which every AES-NI CPU has; checked anyway.
+  static bool supported() {
+    static const bool ssse3 = [] {
+      unsigned int eax, ebx, ecx, edx;
+      return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3) != 0;
+    }();
+    return AESBase::cpu_has_aesni() && ssse3;
+  }
+
+  // Turns four vectors of one 32-bit word per lane into four vectors of one
+  // lane each, and back.
+  __attribute__((target("sse2"))) static void transpose(__m128i& a,
+                                                        __m128i& b,
+                                                        __m128i& c,
+                                                        __m128i& d) {
+    __m128i ab_low = _mm_unpacklo_epi32(a, b);
+    __m128i cd_low = _mm_unpacklo_epi32(c, d);
+    __m128i ab_high = _mm_unpackhi_epi32(a, b);
+    __m128i cd_high = _mm_unpackhi_epi32(c, d);
+    a = _mm_unpacklo_epi64(ab_low, cd_low);
+    b = _mm_unpackhi_epi64(ab_low, cd_low);
+    c = _mm_unpacklo_epi64(ab_high, cd_high);
+    d = _mm_unpackhi_epi64(ab_high, cd_high);
+  }
+
+  // Expands the keys of four pairs into kWords schedule words, lane i
+  // holding pairs[i]'s key.
+  __attribute__((target("aes,ssse3"))) static void expand(
+      const Pair* pairs, __m128i words[kWords]) {
+    __m128i k[4];
+    for (int i = 0; i < 4; i++) {
+      k[i] = _mm_loadu_si128((const __m128i*)pairs[i].key);
+    }
+    transpose(k[0], k[1], k[2], k[3]);
+    for (int i = 0; i < 4; i++) words[i] = k[i];
+    if (Nk > 4) {
+      for (int i = 0; i < 4; i++) {
+        k[i] = Nk == 6 ? _mm_loadl_epi64((const __m128i*)(pairs[i].key + 16))
+                       : _mm_loadu_si128((const __m128i*)(pairs[i].key + 16));
+      }
+      transpose(k[0], k[1], k[2], k[3]);
+      for (int i = 4; i < Nk; i++) words[i] = k[i - 4];
+    }
+
+    // AESENCLAST applies ShiftRows before SubBytes, so these shuffles
+    // pre-apply its inverse: RotWord then SubWord, or SubWord alone, in
+    // every lane.
+    const __m128i rot_sub =
+        _mm_setr_epi8(1, 14, 11, 4, 5, 2, 15, 8, 9, 6, 3, 12, 13, 10, 7, 0);
+    const __m128i sub =
+        _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3);
+#pragma GCC unroll 64
+    for (int i = Nk; i < kWords; i++) {
+      __m128i temp = words[i - 1];
+      if (i % Nk == 0) {
+        temp = _mm_aesenclast_si128(_mm_shuffle_epi8(temp, rot_sub),
+                                    _mm_set1_epi32(ROUND_CONSTANT[i / Nk - 1]));
+      } else if (Nk > 6 && i % Nk == 4) {
+        temp = _mm_aesenclast_si128(_mm_shuffle_epi8(temp, sub),
+                                    _mm_setzero_si128());
+      }
+      words[i] = _mm_xor_si128(words[i - Nk], temp);
+    }
+  }
+
+  // The round keys of one round for the four keys of a group.
+  __attribute__((target("sse2"))) static void round_keys(
+      const __m128i words[kWords], int round, __m128i keys[4]) {
+    for (int i = 0; i < 4; i++) keys[i] = words[4 * round + i];
+    transpose(keys[0], keys[1], keys[2], keys[3]);
+  }
+
+  template <bool Decrypt>
+  __attribute__((target("aes,ssse3"))) static void aesni_crypt(
+      const Pair* pairs) {
+    __m128i words[2][kWords];
+    expand(pairs, words[0]);
+    expand(pairs + 4, words[1]);
+
+    __m128i block[kLanes];
+    __m128i keys[kLanes];
+#pragma GCC unroll 16
+    for (size_t i = 0; i < kLanes; i++) {
+      block[i] = _mm_loadu_si128((const __m128i*)pairs[i].in);
+    }
+    // Decryption walks the schedule backwards with inverse MixColumns
+    // applied to the middle round keys: the equivalent inverse cipher.
+    const int first = Decrypt ? kRounds : 0;
+    const int step = Decrypt ? -1 : 1;
+    round_keys(words[0], first, keys);
+    round_keys(words[1], first, keys + 4);
+#pragma GCC unroll 16
+    for (size_t i = 0; i < kLanes; i++) {
+      block[i] = _mm_xor_si128(block[i], keys[i]);
+    }
+#pragma GCC unroll 16
+    for (int round = first + step; round != kRounds - first; round += step) {
+      round_keys(words[0], round, keys);
+      round_keys(words[1], round, keys + 4);
+      if (Decrypt) {
+#pragma GCC unroll 16
+        for (size_t i = 0; i < kLanes; i++) {
+          block[i] = _mm_aesdec_si128(block[i], _mm_aesimc_si128(keys[i]));
+        }
+      } else {
+#pragma GCC unroll 16
+        for (size_t i = 0; i < kLanes; i++) {
+          block[i] = _mm_aesenc_si128(block[i], keys[i]);
+        }
+      }
+    }
+    round_keys(words[0], kRounds - first, keys);
+    round_keys(words[1], kRounds - first, keys + 4);
+#pragma GCC unroll 16
+    for (size_t i = 0; i < kLanes; i++) {
+      block[i] = Decrypt ? _mm_aesdeclast_si128(block[i], keys[i])
+                         : _mm_aesenclast_si128(block[i], keys[i]);
+      _mm_storeu_si128((__m128i*)pairs[i].out, block[i]);
+    }
+  }
+#endif
+};
+
+template <int Nk>
+const int AESKeyBatch<Nk>::kKeyBytes;
+template <int Nk>
+const size_t AESKeyBatch<Nk>::kLanes;
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * AES Expanded-Key Cache
+ *
+ * Keeps the expanded schedules of recently used keys so that services which
+ * switch between thousands of keys do not re-run key expansion on every
+ * request. Entries are found by a seeded 64-bit fingerprint of the key and
+ * confirmed against the key itself, which the schedule already contains as
+ * its first round keys.
+ *
+ * The cache is split into independently locked shards chosen by the
+ * fingerprint. Lookups take a shard's lock in shared mode, so concurrent
+ * hits never wait on each other; only misses lock a shard exclusively, and
+ * key expansion itself runs outside any lock. Each shard evicts with CLOCK:
+ * a hit sets the entry's reference bit and the clock hand clears bits until
+ * it finds an entry that was not used since its last pass.
+ *
+ * Schedules live in one slab of cache-line aligned slots, each holding an
+ * AES<Nk> (encryption and decryption schedule together), and the per-shard
+ * index is an open-addressing table, so misses never allocate.
+ */
+
+#ifndef AES_CACHE_H_
+#define AES_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "AES.h"
+
+template <int Nk>
+class AESKeyCache {
+ public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t size;
+  };
+
+  // Holds at least capacity schedules, split evenly over shards shards.
+  explicit AESKeyCache(size_t capacity, size_t shards = 16) {
+    size_t shard_count = 1;
+    while (shard_count < shards && shard_count < capacity) shard_count <<= 1;
+    m_shard_bits = 0;
+    while ((size_t(1) << m_shard_bits) < shard_count) m_shard_bits++;
+    m_shard_capacity = (capacity + shard_count - 1) / shard_count;
+    if (m_shard_capacity == 0) m_shard_capacity = 1;
+
+    size_t slots = shard_count * m_shard_capacity;
+    m_slab.reset(new unsigned char[slots * sizeof(Slot) + kCacheLine]);
+    uintptr_t base = reinterpret_cast<uintptr_t>(m_slab.get());
+    Slot* aligned = reinterpret_cast<Slot*>((base + kCacheLine - 1) &
+                                            ~uintptr_t(kCacheLine - 1));
+    for (size_t i = 0; i < slots; i++) new (&aligned[i]) Slot();
+
+    size_t index_size = 1;
+    while (index_size < 2 * m_shard_capacity) index_size <<= 1;
+    std::vector<Shard> shard_list(shard_count);
+    m_shards.swap(shard_list);
+    for (size_t i = 0; i < shard_count; i++) {
+      m_shards[i].slots = aligned + i * m_shard_capacity;
+      m_shards[i].index.assign(index_size, IndexEntry{0, kEmpty});
+    }
+
+    std::random_device random;
+    m_seed = (uint64_t)random() << 32 | random();
+  }
+
+  AESKeyCache(const AESKeyCache&) = delete;
+  AESKeyCache& operator=(const AESKeyCache&) = delete;
+
+  // Returns fn(const AES<Nk>&) called with the schedule for key
+  // (AES<Nk>::kKeyBytes bytes), expanding and inserting it on a miss. The
+  // reference is only valid during the call, which holds the shard's lock in
+  // shared mode, so fn should not block; get() returns a copy instead.
+  template <typename F>
+  auto with_key(const unsigned char* key, F&& fn)
+      -> decltype(fn(std::declval<const AES<Nk>&>())) {
+    uint64_t fingerprint = fingerprint_of(key);
+    Shard& shard = shard_for(fingerprint);
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+      Slot* slot = find(shard, fingerprint, key);
+      if (slot != nullptr) {
+        if (!slot->referenced.load(std::memory_order_relaxed)) {
+          slot->referenced.store(true, std::memory_order_relaxed);
+        }
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        return fn(slot->engine());
+      }
+    }
+
+    const AES<Nk> engine(key);
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+      if (find(shard, fingerprint, key) == nullptr) {
+        insert(shard, fingerprint, engine);
+      }
+    }
+    return fn(engine);
+  }
+
+  AES<Nk> get(const unsigned char* key) {
+    return with_key(key, [](const AES<Nk>& engine) { return engine; });
+  }
+
+  void encrypt_blocks(const unsigned char* key, const uint8_t* in,
+                      uint8_t* out, size_t nblocks) {
+    with_key(key, [&](const AES<Nk>& engine) {
+      engine.encrypt_blocks(in, out, nblocks);
+    });
+  }
+
+  void decrypt_blocks(const unsigned char* key, const uint8_t* in,
+                      uint8_t* out, size_t nblocks) {
+    with_key(key, [&](const AES<Nk>& engine) {
+      engine.decrypt_blocks(in, out, nblocks);
+    });
+  }
+
+  Stats stats() const {
+    Stats stats = {0, 0, 0, 0};
+    for (const Shard& shard : m_shards) {
+      stats.hits += shard.hits.load(std::memory_order_relaxed);
+      stats.misses += shard.misses.load(std::memory_order_relaxed);
+      stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+      std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+      stats.size += shard.used;
+    }
+    return stats;
+  }
+
+  size_t capacity() const { return m_shards.size() * m_shard_capacity; }
+
+ private:
+  static const size_t kCacheLine = 64;
+  static const uint32_t kEmpty = 0xFFFFFFFF;
+
+  struct alignas(64) Slot {
+    uint64_t fingerprint = 0;
+    std::atomic<bool> referenced{false};
+    alignas(16) unsigned char storage[sizeof(AES<Nk>)];
+
+    const AES<Nk>& engine() const {
+      return *reinterpret_cast<const AES<Nk>*>(storage);
+    }
+  };
+
+  struct IndexEntry {
+    uint64_t fingerprint;
+    uint32_t slot;
+  };
+
+  struct Shard {
+    mutable std::shared_timed_mutex mutex;
+    Slot* slots = nullptr;
+    // Open addressing with linear probing; slot is kEmpty for a free entry.
+    std::vector<IndexEntry> index;
+    size_t used = 0;
+    size_t hand = 0;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+    // Keeps neighbouring shards' locks and counters on separate lines.
+    unsigned char padding[kCacheLine];
+  };
+
+  uint64_t fingerprint_of(const unsigned char* key) const {
+    uint64_t hash = m_seed;
+    for (int i = 0; i < AES<Nk>::kKeyBytes; i += 8) {
+      uint64_t word;
+      memcpy(&word, key + i, 8);
+      hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+      hash ^= hash >> 32;
+    }
+    return hash;
+  }
+
+  Shard& shard_for(uint64_t fingerprint) {
+    if (m_shard_bits == 0) return m_shards[0];
+    return m_shards[fingerprint >> (64 - m_shard_bits)];
+  }
+
+  // The first kKeyBytes bytes of the encryption schedule are the key. The
+  // comparison does not stop at the first differing byte.
+  static bool same_key(const AES<Nk>& engine, const unsigned char* key) {
+    const unsigned char* stored = &engine.encrypt_keys()[0][0][0];
+    unsigned char difference = 0;
+    for (int i = 0; i < AES<Nk>::kKeyBytes; i++) {
+      difference |= stored[i] ^ key[i];
+    }
+    return difference == 0;
+  }
+
+  static Slot* find(Shard& shard, uint64_t fingerprint,
+                    const unsigned char* key) {
+    size_t mask = shard.index.size() - 1;
+    for (size_t i = fingerprint & mask;; i = (i + 1) & mask) {
+      const IndexEntry& entry = shard.index[i];
+      if (entry.slot == kEmpty) return nullptr;
+      if (entry.fingerprint == fingerprint &&
+          same_key(shard.slots[entry.slot].engine(), key)) {
+        return &shard.slots[entry.slot];
+      }
+    }
+  }
+
+  // Called with the shard locked exclusively.
+  void insert(Shard& shard, uint64_t fingerprint, const AES<Nk>& engine) {
+    size_t slot;
+    if (shard.used < m_shard_capacity) {
+      slot = shard.used++;
+    } else {
+      while (shard.slots[shard.hand].referenced.load(
+          std::memory_order_relaxed)) {
+        shard.slots[shard.hand].referenced.store(false,
+                                                 std::memory_order_relaxed);
+        shard.hand = (shard.hand + 1) % m_shard_capacity;
+      }
+      slot = shard.hand;
+      shard.hand = (shard.hand + 1) % m_shard_capacity;
+      unindex(shard, shard.slots[slot].fingerprint, (uint32_t)slot);
+      shard.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Slot& target = shard.slots[slot];
+    new (target.storage) AES<Nk>(engine);
+    target.fingerprint = fingerprint;
+    target.referenced.store(false, std::memory_order_relaxed);
+
+    size_t mask = shard.index.size() - 1;
+    size_t i = fingerprint & mask;
+    while (shard.index[i].slot != kEmpty) i = (i + 1) & mask;
+    shard.index[i] = IndexEntry{fingerprint, (uint32_t)slot};
+  }
+
+  // Removes slot from the index, shifting later entries of the probe run
+  // back so that lookups never need tombstones.
+  static void unindex(Shard& shard, uint64_t fingerprint, uint32_t slot) {
+    size_t mask = shard.index.size() - 1;
+    size_t hole = fingerprint & mask;
+    while (shard.index[hole].slot != slot) hole = (hole + 1) & mask;
+    for (size_t i = (hole + 1) & mask; shard.index[i].slot != kEmpty;
+         i = (i + 1) & mask) {
+      size_t home = shard.index[i].fingerprint & mask;
+      // Entry i may move into the hole unless its home lies cyclically in
+      // (hole, i].
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        shard.index[hole] = shard.index[i];
+        hole = i;
+      }
+    }
+    shard.index[hole].slot = kEmpty;
+  }
+
+  std::vector<Shard> m_shards;
+  int m_shard_bits;
+  size_t m_shard_capacity;
+  std::unique_ptr<unsigned char[]> m_slab;
+  uint64_t m_seed;
+};
+
+template <int Nk>
+const size_t AESKeyCache<Nk>::kCacheLine;
+template <int Nk>
+const uint32_t AESKeyCache<Nk>::kEmpty;
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * AES Cipher Block Chaining (CBC) Mode
+ *
+ * CBC as specified in NIST SP 800-38A, with PKCS#7 padding for whole
+ * messages, on top of any AESBase cipher.
+ *
+ * Decryption has no chain dependency: every block is D(C[i]) ^ C[i-1], so
+ * ciphertext is decrypted through decrypt_blocks in chunks and large inputs
+ * are spread over a work-stealing thread pool. Encryption of one message is
+ * inherently serial; encrypt_messages() instead advances up to kLanes
+ * independent messages in lockstep so each encrypt_blocks call has several
+ * blocks to interleave, and hands groups of messages to the pool.
+ */
+
+#ifndef AES_CBC_H_
+#define AES_CBC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "AES.h"
+#include "AES_POOL.h"
+
+class AESCBC {
+ public:
+  // Blocks decrypted per decrypt_blocks call.
+  static const size_t kChunkBlocks = 64;
+  // Messages encrypted side by side by encrypt_messages().
+  static const size_t kLanes = 8;
+
+  struct Message {
+    const uint8_t* iv;
+    const uint8_t* in;
+    size_t length;
+    // Must have room for padded_length(length) bytes.
+    uint8_t* out;
+  };
+
+  // The cipher is borrowed, not copied, and must outlive this object. With
+  // threads > 1, large calls run on up to that many threads of the shared
+  // pool (or the one given to set_pool()).
+  explicit AESCBC(AESBase& cipher, unsigned int threads = 1)
+      : m_cipher(cipher), m_threads(threads ? threads : 1), m_pool(nullptr) {}
+
+  void set_threads(unsigned int threads) { m_threads = threads ? threads : 1; }
+
+  // The pool is borrowed and must outlive this object.
+  void set_pool(AESThreadPool& pool) { m_pool = &pool; }
+
+  // Ciphertext length for a message of length bytes: PKCS#7 always adds
+  // between 1 and 16 bytes.
+  static size_t padded_length(size_t length) { return (length / 16 + 1) * 16; }
+
+  // Chains whole blocks without padding. iv is updated to the last
+  // ciphertext block so a long message can be processed in pieces.
+  void encrypt_blocks(uint8_t iv[16], const uint8_t* in, uint8_t* out,
+                      size_t nblocks) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCBCEncrypt,
+                    16 * nblocks);
+    encrypt_chain(m_cipher, iv, in, out, nblocks);
+  }
+
+  void decrypt_blocks(uint8_t iv[16], const uint8_t* in, uint8_t* out,
+                      size_t nblocks) {
+    if (nblocks == 0) return;
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCBCDecrypt,
+                    16 * nblocks);
+    uint8_t last[16];
+    memcpy(last, in + 16 * (nblocks - 1), 16);
+
+    const size_t per_chunk = AESThreadPool::kChunkBytes / 16;
+    if (m_threads == 1 || nblocks <= per_chunk) {
+      decrypt_range(m_cipher, iv, in, out, nblocks);
+    } else {
+      // Each chunk needs the ciphertext block before it, which may be
+      // overwritten by its neighbour when decrypting in place, so the
+      // boundaries are copied before any chunk starts.
+      size_t chunks = (nblocks + per_chunk - 1) / per_chunk;
+      std::vector<uint8_t> previous(16 * chunks);
+      memcpy(previous.data(), iv, 16);
+      for (size_t i = 1; i < chunks; i++) {
+        memcpy(previous.data() + 16 * i, in + 16 * (i * per_chunk - 1), 16);
+      }
+      AESBase& cipher = m_cipher;
+      const uint8_t* chains = previous.data();
+      pool().run(chunks, m_threads,
+                 [&cipher, chains, in, out, nblocks, per_chunk](size_t i) {
+                   size_t start = i * per_chunk;
+                   size_t count = nblocks - start < per_chunk
+                                      ? nblocks - start
+                                      : per_chunk;
+                   decrypt_range(cipher, chains + 16 * i, in + 16 * start,
+                                 out + 16 * start, count);
+                 });
+    }
+    memcpy(iv, last, 16);
+  }
+
+  // Encrypts length bytes with PKCS#7 padding and returns the ciphertext
+  // length, padded_length(length).
+  size_t encrypt(const uint8_t iv[16], const uint8_t* in, size_t length,
+                 uint8_t* out) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCBCEncrypt,
+                    padded_length(length));
+    uint8_t chain[16];
+    memcpy(chain, iv, 16);
+    size_t nblocks = length / 16;
+    encrypt_chain(m_cipher, chain, in, out, nblocks);
+    uint8_t last[16];
+    pad_block(in + 16 * nblocks, length % 16, last);
+    encrypt_chain(m_cipher, chain, last, out + 16 * nblocks, 1);
+    return 16 * (nblocks + 1);
+  }
+
+  // Decrypts and strips PKCS#7 padding. Returns false if length is not a
+  // positive multiple of 16 or the padding is malformed; the padding check
+  // does not branch on its contents. in and out may be the same buffer.
+  bool decrypt(const uint8_t iv[16], const uint8_t* in, size_t length,
+               uint8_t* out, size_t* plain_length) {
+    *plain_length = 0;
+    if (length == 0 || length % 16 != 0) return false;
+    uint8_t chain[16];
+    memcpy(chain, iv, 16);
+    decrypt_blocks(chain, in, out, length / 16);
+
+    const uint8_t* last = out + length - 16;
+    unsigned int pad = last[15];
+    unsigned int bad = ((pad - 1) | (16 - pad)) >> 8;
+    for (unsigned int i = 0; i < 16; i++) {
+      unsigned int in_padding = 0u - ((15 - i - pad) >> 31);
+      bad |= in_padding & (last[i] ^ pad);
+    }
+    if (bad != 0) return false;
+    *plain_length = length - pad;
+    return true;
+  }
+
+  // Encrypts independent messages with PKCS#7 padding. Up to kLanes of them
+  // advance one block per step, and a finished message hands its lane to the
+  // next waiting one. With threads > 1, groups of messages run on the pool.
+  void encrypt_messages(const Message* messages, size_t count) {
+#if AES_INSTRUMENT
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+      bytes += padded_length(messages[i].length);
+    }
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCBCEncrypt, bytes);
+#endif
+    if (m_threads == 1 || count <= kLanes) {
+      encrypt_lanes(m_cipher, messages, count);
+      return;
+    }
+    AESBase& cipher = m_cipher;
+    pool().run((count + kLanes - 1) / kLanes, m_threads,
+               [&cipher, messages, count](size_t i) {
+                 size_t start = i * kLanes;
+                 size_t group = count - start < kLanes ? count - start
+                                                       : kLanes;
+                 encrypt_lanes(cipher, messages + start, group);
+               });
+  }
+
+ private:
+  AESThreadPool& pool() {
+    return m_pool ? *m_pool : AESThreadPool::shared();
+  }
+
+  // Runs messages through kLanes lanes; see encrypt_messages().
+  static void encrypt_lanes(AESBase& cipher, const Message* messages,
+                            size_t count) {
+    struct Lane {
+      const Message* message;
+      size_t block;
+      size_t nblocks;
+      uint8_t chain[16];
+    };
+    Lane lanes[kLanes];
+    size_t active = 0;
+    size_t next = 0;
+    uint8_t blocks[kLanes * 16];
+
+    while (active > 0 || next < count) {
+      while (active < kLanes && next < count) {
+        Lane& lane = lanes[active++];
+        lane.message = &messages[next++];
+        lane.block = 0;
+        lane.nblocks = padded_length(lane.message->length) / 16;
+        memcpy(lane.chain, lane.message->iv, 16);
+      }
+
+      for (size_t i = 0; i < active; i++) {
+        Lane& lane = lanes[i];
+        const Message& message = *lane.message;
+        uint8_t* block = blocks + 16 * i;
+        if (lane.block + 1 < lane.nblocks) {
+          memcpy(block, message.in + 16 * lane.block, 16);
+        } else {
+          pad_block(message.in + 16 * lane.block, message.length % 16, block);
+        }
+        AESBase::xor_block(block, lane.chain, block);
+      }
+      cipher.encrypt_blocks(blocks, blocks, active);
+
+      for (size_t i = 0; i < active;) {
+        Lane& lane = lanes[i];
+        memcpy(lane.chain, blocks + 16 * i, 16);
+        memcpy(lane.message->out + 16 * lane.block, lane.chain, 16);
+        if (++lane.block < lane.nblocks) {
+          i++;
+          continue;
+        }
+        // Retire the lane by moving the last active one into its slot.
+        active--;
+        if (i != active) {
+          lane = lanes[active];
+          memcpy(blocks + 16 * i, blocks + 16 * active, 16);
+        }
+      }
+    }
+  }
+
+  static void encrypt_chain(AESBase& cipher, uint8_t iv[16],
+                            const uint8_t* in, uint8_t* out, size_t nblocks) {
+    for (size_t i = 0; i < nblocks; i++) {
+      AESBase::xor_block(in + 16 * i, iv, out + 16 * i);
+      cipher.encrypt_blocks(out + 16 * i, out + 16 * i, 1);
+      memcpy(iv, out + 16 * i, 16);
+    }
+  }
+
+  // Builds the final PKCS#7 block from the remaining tail bytes.
+  static void pad_block(const uint8_t* tail, size_t tail_length,
+                        uint8_t block[16]) {
+    if (tail_length > 0) memcpy(block, tail, tail_length);
+    memset(block + tail_length, (int)(16 - tail_length), 16 - tail_length);
+  }
+
+  // Decrypts a run of blocks whose predecessor ciphertext block is previous.
+  // Within each chunk the chaining XOR runs backwards so that in-place
+  // output never clobbers a ciphertext block that is still needed.
+  static void decrypt_range(AESBase& cipher, const uint8_t previous[16],
+                            const uint8_t* in, uint8_t* out, size_t nblocks) {
+    uint8_t chain[16];
+    memcpy(chain, previous, 16);
+    uint8_t plain[kChunkBlocks * 16];
+    while (nblocks > 0) {
+      size_t count = nblocks < kChunkBlocks ? nblocks : kChunkBlocks;
+      cipher.decrypt_blocks(in, plain, count);
+      uint8_t next_chain[16];
+      memcpy(next_chain, in + 16 * (count - 1), 16);
+      for (size_t i = count - 1; i > 0; i--) {
+        AESBase::xor_block(plain + 16 * i, in + 16 * (i - 1), out + 16 * i);
+      }
+      AESBase::xor_block(plain, chain, out);
+      memcpy(chain, next_chain, 16);
+      in += 16 * count;
+      out += 16 * count;
+      nblocks -= count;
+    }
+  }
+
+  AESBase& m_cipher;
+  unsigned int m_threads;
+  AESThreadPool* m_pool;
+};
+
+#endif
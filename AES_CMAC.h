@@ -0,0 +1,167 @@
+/*
+ * AES-CMAC
+ *
+ * The CMAC message authentication code (RFC 4493, NIST SP 800-38B) on top of
+ * any AESBase cipher. The subkeys K1 and K2 are derived once per key; the
+ * last block is XORed with K1 when it is complete and with K2 after 10*
+ * padding otherwise.
+ *
+ * CMAC is a CBC-MAC chain, so one message keeps only one block in the round
+ * pipeline at a time. mac_messages() advances up to kLanes independent
+ * messages in lockstep, one block each per encrypt_blocks call, and a
+ * finished message hands its lane to the next waiting one, so streams of
+ * small records run close to bulk ECB speed.
+ */
+
+#ifndef AES_CMAC_H_
+#define AES_CMAC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "AES.h"
+
+class AESCMAC {
+ public:
+  // Messages authenticated side by side by mac_messages().
+  static const size_t kLanes = 8;
+
+  struct Message {
+    const uint8_t* in;
+    size_t length;
+    // Receives the 16-byte tag.
+    uint8_t* tag;
+  };
+
+  // The cipher is borrowed, not copied, and must outlive this object.
+  explicit AESCMAC(AESBase& cipher) : m_cipher(cipher) {
+    uint8_t l[16] = {0};
+    m_cipher.encrypt_blocks(l, l, 1);
+    double_block(l, m_k1);
+    double_block(m_k1, m_k2);
+  }
+
+  // Writes the 16-byte tag of length bytes of in.
+  void mac(const uint8_t* in, size_t length, uint8_t tag[16]) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCMAC, length);
+    size_t nblocks = block_count(length);
+    uint8_t state[16] = {0};
+    for (size_t i = 0; i + 1 < nblocks; i++) {
+      AESBase::xor_block(state, in + 16 * i, state);
+      m_cipher.encrypt_blocks(state, state, 1);
+    }
+    uint8_t last[16];
+    last_block(in, length, last);
+    AESBase::xor_block(state, last, state);
+    m_cipher.encrypt_blocks(state, tag, 1);
+  }
+
+  // Compares the first tag_length (1 to 16) bytes of the tag in constant
+  // time.
+  bool verify(const uint8_t* in, size_t length, const uint8_t* tag,
+              size_t tag_length) {
+    uint8_t expected[16];
+    mac(in, length, expected);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < tag_length && i < 16; i++) {
+      diff |= expected[i] ^ tag[i];
+    }
+    return diff == 0 && tag_length > 0 && tag_length <= 16;
+  }
+
+  // Authenticates independent messages. Up to kLanes of them advance one
+  // block per step, and a finished message hands its lane to the next
+  // waiting one.
+  void mac_messages(const Message* messages, size_t count) {
+#if AES_INSTRUMENT
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) bytes += messages[i].length;
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCMAC, bytes);
+#endif
+    struct Lane {
+      const Message* message;
+      // Next whole block to absorb and how many remain before the last.
+      const uint8_t* next;
+      size_t remaining;
+      uint8_t last[16];
+    };
+    Lane lanes[kLanes];
+    size_t active = 0;
+    size_t next = 0;
+    // The chaining value of lane i lives in blocks[i] between steps.
+    uint8_t blocks[kLanes * 16];
+
+    while (active > 0 || next < count) {
+      while (active < kLanes && next < count) {
+        Lane& lane = lanes[active];
+        lane.message = &messages[next++];
+        lane.next = lane.message->in;
+        lane.remaining = block_count(lane.message->length) - 1;
+        last_block(lane.message->in, lane.message->length, lane.last);
+        memset(blocks + 16 * active, 0, 16);
+        active++;
+      }
+
+      for (size_t i = 0; i < active; i++) {
+        const Lane& lane = lanes[i];
+        const uint8_t* block = lane.remaining > 0 ? lane.next : lane.last;
+        AESBase::xor_block(blocks + 16 * i, block, blocks + 16 * i);
+      }
+      m_cipher.encrypt_blocks(blocks, blocks, active);
+
+      for (size_t i = 0; i < active;) {
+        Lane& lane = lanes[i];
+        if (lane.remaining > 0) {
+          lane.remaining--;
+          lane.next += 16;
+          i++;
+          continue;
+        }
+        memcpy(lane.message->tag, blocks + 16 * i, 16);
+        // Retire the lane by moving the last active one into its slot.
+        active--;
+        if (i != active) {
+          lane = lanes[active];
+          memcpy(blocks + 16 * i, blocks + 16 * active, 16);
+        }
+      }
+    }
+  }
+
+ private:
+  // Blocks in the chain; an empty message still has one (padded) block.
+  static size_t block_count(size_t length) {
+    return length == 0 ? 1 : (length + 15) / 16;
+  }
+
+  // Multiplies by x in GF(2^128) in the big-endian convention of CMAC.
+  static void double_block(const uint8_t in[16], uint8_t out[16]) {
+    uint8_t carry = in[0] >> 7;
+    for (int i = 0; i < 15; i++) {
+      out[i] = (uint8_t)(in[i] << 1 | in[i + 1] >> 7);
+    }
+    out[15] = (uint8_t)((in[15] << 1) ^ (0x87 & (0 - carry)));
+  }
+
+  // The final block of the chain: XORed with K1 if complete, otherwise
+  // padded with 0x80 0x00... and XORed with K2.
+  void last_block(const uint8_t* in, size_t length, uint8_t out[16]) const {
+    size_t start = 16 * (block_count(length) - 1);
+    size_t tail = length - start;
+    if (tail == 16) {
+      AESBase::xor_block(in + start, m_k1, out);
+      return;
+    }
+    memset(out, 0, 16);
+    if (tail > 0) memcpy(out, in + start, tail);
+    out[tail] = 0x80;
+    AESBase::xor_block(out, m_k2, out);
+  }
+
+  AESBase& m_cipher;
+  uint8_t m_k1[16];
+  uint8_t m_k2[16];
+};
+
+#endif
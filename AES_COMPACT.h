@@ -0,0 +1,565 @@
+/*
+ * AES Compact Contexts
+ *
+ * Key contexts that store no round keys, for programs holding very many
+ * live keys (one per session, say), where an AES<Nk> engine's two expanded
+ * schedules, up to 240 bytes each and 480 together, crowd the cache.
+ *
+ * AESCompactEncryptor keeps only the cipher key and derives the round keys
+ * during encryption, one round ahead of the blocks. AESCompactDecryptor keeps
+ * the last Nk words of the key schedule instead and runs the schedule
+ * backwards: each FIPS-197 step w[i] = w[i - Nk] ^ f(w[i - 1]) also gives
+ * w[i - Nk] from w[i] and w[i - 1]. Either way a context is kKeyBytes
+ * bytes, 16 to 32, and the schedule lives in a window of Nk words.
+ *
+ * The blocks of a group (up to 8 on AES-NI, 4 on the T-table engine) share
+ * one pass of the schedule, which runs alongside their rounds. The T-table
+ * engine repeats it per group at little cost. On AES-NI the schedule's
+ * serial chain outlasts the rounds, so calls longer than one group derive
+ * the round keys once into a schedule on the stack that lasts only for the
+ * call. Short calls on AES-NI are then several times slower than with a
+ * stored schedule, and long ones about as fast.
+ */
+
+#ifndef AES_COMPACT_H_
+#define AES_COMPACT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "AES.h"
+
+// The block code shared by the two contexts. words holds the Nk schedule
+// words a context stores.
+template <int Nk>
+class AESCompactCore {
+  typedef AES<Nk> Engine;
+
+ public:
+  static const int kRounds = AES<Nk>::kRounds;
+  static const int kWords = 4 * (kRounds + 1);
+
+  // The first Nk schedule words: the kKeyBytes bytes of key.
+  static void load_key(const unsigned char* key, uint32_t words[Nk]) {
+    for (int i = 0; i < Nk; i++) words[i] = Engine::load_word(key + 4 * i);
+  }
+
+  // Slides the window from the first Nk words to the last.
+  static void expand(uint32_t (&words)[Nk]) {
+    steps<Nk, kWords, 1>(words, std::true_type());
+  }
+
+  static void encrypt_blocks(const uint32_t words[Nk], const unsigned char* in,
+                             unsigned char* out, size_t nblocks) {
+#if AES_HAVE_AESNI
+    if (AESBase::cpu_has_aesni()) {
+      AES_STATS_BACKEND(32 * Nk, AESBackend::kAESNI, nblocks);
+      aesni_encrypt_blocks(words, in, out, nblocks);
+      return;
+    }
+#endif
+    AES_STATS_BACKEND(32 * Nk, AESBackend::kTTable, nblocks);
+    ttable_encrypt_blocks(words, in, out, nblocks);
+  }
+
+  static void decrypt_blocks(const uint32_t words[Nk], const unsigned char* in,
+                             unsigned char* out, size_t nblocks) {
+#if AES_HAVE_AESNI
+    if (AESBase::cpu_has_aesni()) {
+      AES_STATS_BACKEND(32 * Nk, AESBackend::kAESNI, nblocks);
+      aesni_decrypt_blocks(words, in, out, nblocks);
+      return;
+    }
+#endif
+    AES_STATS_BACKEND(32 * Nk, AESBackend::kTTable, nblocks);
+    ttable_decrypt_blocks(words, in, out, nblocks);
+  }
+
+  // Tails shorter than a group go in halving groups, so that a call never
+  // derives the schedule more than three times beyond its full groups.
+  static void ttable_encrypt_blocks(const uint32_t words[Nk],
+                                    const unsigned char* in,
+                                    unsigned char* out, size_t nblocks) {
+    for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+      ttable_encrypt<4>(words, in, out);
+    }
+    if (nblocks >= 2) {
+      ttable_encrypt<2>(words, in, out);
+      nblocks -= 2, in += 32, out += 32;
+    }
+    if (nblocks > 0) ttable_encrypt<1>(words, in, out);
+  }
+
+  static void ttable_decrypt_blocks(const uint32_t words[Nk],
+                                    const unsigned char* in,
+                                    unsigned char* out, size_t nblocks) {
+    for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+      ttable_decrypt<4>(words, in, out);
+    }
+    if (nblocks >= 2) {
+      ttable_decrypt<2>(words, in, out);
+      nblocks -= 2, in += 32, out += 32;
+    }
+    if (nblocks > 0) ttable_decrypt<1>(words, in, out);
+  }
+
+#if AES_HAVE_AESNI
+  // Callers must check AESBase::cpu_has_aesni() first. Up to one group the
+  // round keys come out of the window between rounds. Longer calls derive
+  // them once into a schedule on the stack, which lives only for the call.
+  __attribute__((target("aes,sse2"))) static void aesni_encrypt_blocks(
+      const uint32_t words[Nk], const unsigned char* in, unsigned char* out,
+      size_t nblocks) {
+    if (nblocks > 8) {
+      __m128i keys[kRounds + 1];
+      uint32_t w[Nk];
+      memcpy(w, words, sizeof(w));
+      encrypt_schedule(w, keys, RoundIndex<0>());
+      for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+        aesni_encrypt<8>(keys, in, out);
+      }
+      for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+        aesni_encrypt<1>(keys, in, out);
+      }
+      return;
+    }
+    if (nblocks == 8) {
+      aesni_encrypt<8>(words, in, out);
+      return;
+    }
+    if (nblocks >= 4) {
+      aesni_encrypt<4>(words, in, out);
+      nblocks -= 4, in += 64, out += 64;
+    }
+    if (nblocks >= 2) {
+      aesni_encrypt<2>(words, in, out);
+      nblocks -= 2, in += 32, out += 32;
+    }
+    if (nblocks > 0) aesni_encrypt<1>(words, in, out);
+  }
+
+  __attribute__((target("aes,sse2"))) static void aesni_decrypt_blocks(
+      const uint32_t words[Nk], const unsigned char* in, unsigned char* out,
+      size_t nblocks) {
+    if (nblocks > 8) {
+      __m128i keys[kRounds + 1];
+      uint32_t w[Nk];
+      memcpy(w, words, sizeof(w));
+      decrypt_schedule(w, keys, RoundIndex<kRounds>());
+      for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+        aesni_decrypt<8>(keys, in, out);
+      }
+      for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+        aesni_decrypt<1>(keys, in, out);
+      }
+      return;
+    }
+    if (nblocks == 8) {
+      aesni_decrypt<8>(words, in, out);
+      return;
+    }
+    if (nblocks >= 4) {
+      aesni_decrypt<4>(words, in, out);
+      nblocks -= 4, in += 64, out += 64;
+    }
+    if (nblocks >= 2) {
+      aesni_decrypt<2>(words, in, out);
+      nblocks -= 2, in += 32, out += 32;
+    }
+    if (nblocks > 0) aesni_decrypt<1>(words, in, out);
+  }
+#endif
+
+ private:
+  template <int Round>
+  using RoundIndex = std::integral_constant<int, Round>;
+
+  // Schedule word i lives in slot i % Nk, where it replaces word i - Nk. The
+  // same XOR turns word i - Nk into word i and word i back into i - Nk.
+  template <int i>
+  static void step(uint32_t (&w)[Nk]) {
+    uint32_t temp = w[(i - 1) % Nk];
+    if (i % Nk == 0) {
+      temp = Engine::substitute_word(temp << 8 | temp >> 24) ^
+             (uint32_t)ROUND_CONSTANT[i / Nk - 1] << 24;
+    } else if (Nk > 6 && i % Nk == 4) {
+      temp = Engine::substitute_word(temp);
+    }
+    w[i % Nk] ^= temp;
+  }
+
+  // Steps words First, First + Step, ... short of Last. The indices are
+  // compile-time constants so that each step is emitted with its slots and
+  // round constant folded in.
+  template <int First, int Last, int Step>
+  static void steps(uint32_t (&w)[Nk], std::true_type) {
+    step<First>(w);
+    steps<First + Step, Last, Step>(
+        w, std::integral_constant<bool, First + Step != Last>());
+  }
+
+  template <int First, int Last, int Step>
+  static void steps(uint32_t (&)[Nk], std::false_type) {}
+
+  // Word c of round key Round, which must be in the window.
+  template <int Round>
+  static uint32_t key_word(const uint32_t w[Nk], int c) {
+    return w[(4 * Round + c) % Nk];
+  }
+
+  // Moves the window forwards until it ends with round key Round. Rounds
+  // are visited in order, so the earlier words are already there.
+  template <int Round>
+  static void advance(uint32_t (&w)[Nk]) {
+    const int first = 4 * Round > Nk ? 4 * Round : Nk;
+    steps<first, 4 * Round + 4, 1>(
+        w, std::integral_constant<bool, (first < 4 * Round + 4)>());
+  }
+
+  // Moves the window backwards until it starts with round key Round, from
+  // where it was for round Round + 1.
+  template <int Round>
+  static void retreat(uint32_t (&w)[Nk]) {
+    const int first =
+        4 * Round + 3 + Nk < kWords ? 4 * Round + 3 + Nk : kWords - 1;
+    steps<first, 4 * Round + Nk - 1, -1>(
+        w, std::integral_constant<bool, (first > 4 * Round + Nk - 1)>());
+  }
+
+  // The T-table rounds mirror AES<Nk>'s, with the keys from the window.
+  template <int Blocks>
+  static void ttable_encrypt(const uint32_t words[Nk], const unsigned char* in,
+                             unsigned char* out) {
+    uint32_t w[Nk];
+    memcpy(w, words, sizeof(w));
+    uint32_t s[Blocks][4];
+    for (int i = 0; i < Blocks; i++) {
+      for (int c = 0; c < 4; c++) {
+        s[i][c] = Engine::load_word(in + 16 * i + 4 * c) ^ w[c];
+      }
+    }
+    ttable_encrypt_rounds(w, s, RoundIndex<1>());
+
+    advance<kRounds>(w);
+    const unsigned char* sbox = AES_TABLES.sbox;
+    for (int i = 0; i < Blocks; i++) {
+      for (int c = 0; c < 4; c++) {
+        Engine::store_word(
+            ((uint32_t)sbox[s[i][c] >> 24] << 24 |
+             (uint32_t)sbox[(s[i][(c + 1) & 3] >> 16) & 0xFF] << 16 |
+             (uint32_t)sbox[(s[i][(c + 2) & 3] >> 8) & 0xFF] << 8 |
+             sbox[s[i][(c + 3) & 3] & 0xFF]) ^
+                key_word<kRounds>(w, c),
+            out + 16 * i + 4 * c);
+      }
+    }
+  }
+
+  template <int Blocks, int Round>
+  static void ttable_encrypt_rounds(uint32_t (&w)[Nk],
+                                    uint32_t (&s)[Blocks][4],
+                                    RoundIndex<Round>) {
+    advance<Round>(w);
+    for (int i = 0; i < Blocks; i++) {
+      uint32_t s0 = s[i][0], s1 = s[i][1], s2 = s[i][2], s3 = s[i][3];
+      s[i][0] = Engine::encrypt_column(s0, s1, s2, s3) ^ key_word<Round>(w, 0);
+      s[i][1] = Engine::encrypt_column(s1, s2, s3, s0) ^ key_word<Round>(w, 1);
+      s[i][2] = Engine::encrypt_column(s2, s3, s0, s1) ^ key_word<Round>(w, 2);
+      s[i][3] = Engine::encrypt_column(s3, s0, s1, s2) ^ key_word<Round>(w, 3);
+    }
+    ttable_encrypt_rounds(w, s, RoundIndex<Round + 1>());
+  }
+
+  template <int Blocks>
+  static void ttable_encrypt_rounds(uint32_t (&)[Nk], uint32_t (&)[Blocks][4],
+                                    RoundIndex<kRounds>) {}
+
+  // The equivalent inverse cipher, with inverse MixColumns applied to the
+  // middle round keys as they come out of the window.
+  template <int Blocks>
+  static void ttable_decrypt(const uint32_t words[Nk], const unsigned char* in,
+                             unsigned char* out) {
+    uint32_t w[Nk];
+    memcpy(w, words, sizeof(w));
+    uint32_t s[Blocks][4];
+    for (int i = 0; i < Blocks; i++) {
+      for (int c = 0; c < 4; c++) {
+        s[i][c] = Engine::load_word(in + 16 * i + 4 * c) ^
+                  key_word<kRounds>(w, c);
+      }
+    }
+    ttable_decrypt_rounds(w, s, RoundIndex<kRounds - 1>());
+
+    retreat<0>(w);
+    const unsigned char* inv_sbox = AES_TABLES.inv_sbox;
+    for (int i = 0; i < Blocks; i++) {
+      for (int c = 0; c < 4; c++) {
+        Engine::store_word(
+            ((uint32_t)inv_sbox[s[i][c] >> 24] << 24 |
+             (uint32_t)inv_sbox[(s[i][(c + 3) & 3] >> 16) & 0xFF] << 16 |
+             (uint32_t)inv_sbox[(s[i][(c + 2) & 3] >> 8) & 0xFF] << 8 |
+             inv_sbox[s[i][(c + 1) & 3] & 0xFF]) ^
+                w[c],
+            out + 16 * i + 4 * c);
+      }
+    }
+  }
+
+  template <int Blocks, int Round>
+  static void ttable_decrypt_rounds(uint32_t (&w)[Nk],
+                                    uint32_t (&s)[Blocks][4],
+                                    RoundIndex<Round>) {
+    retreat<Round>(w);
+    uint32_t key[4];
+    for (int c = 0; c < 4; c++) {
+      key[c] = Engine::inverse_mix_column(key_word<Round>(w, c));
+    }
+    for (int i = 0; i < Blocks; i++) {
+      uint32_t s0 = s[i][0], s1 = s[i][1], s2 = s[i][2], s3 = s[i][3];
+      s[i][0] = Engine::decrypt_column(s0, s3, s2, s1) ^ key[0];
+      s[i][1] = Engine::decrypt_column(s1, s0, s3, s2) ^ key[1];
+      s[i][2] = Engine::decrypt_column(s2, s1, s0, s3) ^ key[2];
+      s[i][3] = Engine::decrypt_column(s3, s2, s1, s0) ^ key[3];
+    }
+    ttable_decrypt_rounds(w, s, RoundIndex<Round - 1>());
+  }
+
+  template <int Blocks>
+  static void ttable_decrypt_rounds(uint32_t (&)[Nk], uint32_t (&)[Blocks][4],
+                                    RoundIndex<0>) {}
+
+#if AES_HAVE_AESNI
+  // The window holds big-endian words; AES-NI wants the key bytes in order.
+  template <int Round>
+  __attribute__((target("aes,sse2"))) static __m128i round_key(
+      const uint32_t w[Nk]) {
+    return _mm_setr_epi32((int)__builtin_bswap32(key_word<Round>(w, 0)),
+                          (int)__builtin_bswap32(key_word<Round>(w, 1)),
+                          (int)__builtin_bswap32(key_word<Round>(w, 2)),
+                          (int)__builtin_bswap32(key_word<Round>(w, 3)));
+  }
+
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) static void aesni_encrypt(
+      const uint32_t words[Nk], const unsigned char* in, unsigned char* out) {
+    uint32_t w[Nk];
+    memcpy(w, words, sizeof(w));
+    __m128i block[Blocks];
+    __m128i key = round_key<0>(w);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i), key);
+    }
+    aesni_encrypt_rounds(w, block, RoundIndex<1>());
+    advance<kRounds>(w);
+    key = round_key<kRounds>(w);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i, _mm_aesenclast_si128(block[i], key));
+    }
+  }
+
+  template <int Blocks, int Round>
+  __attribute__((target("aes,sse2"))) static void aesni_encrypt_rounds(
+      uint32_t (&w)[Nk], __m128i (&block)[Blocks], RoundIndex<Round>) {
+    advance<Round>(w);
+    __m128i key = round_key<Round>(w);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_aesenc_si128(block[i], key);
+    }
+    aesni_encrypt_rounds(w, block, RoundIndex<Round + 1>());
+  }
+
+  template <int Blocks>
+  static void aesni_encrypt_rounds(uint32_t (&)[Nk], __m128i (&)[Blocks],
+                                   RoundIndex<kRounds>) {}
+
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) static void aesni_decrypt(
+      const uint32_t words[Nk], const unsigned char* in, unsigned char* out) {
+    uint32_t w[Nk];
+    memcpy(w, words, sizeof(w));
+    __m128i block[Blocks];
+    __m128i key = round_key<kRounds>(w);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i), key);
+    }
+    aesni_decrypt_rounds(w, block, RoundIndex<kRounds - 1>());
+    retreat<0>(w);
+    key = round_key<0>(w);
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i, _mm_aesdeclast_si128(block[i], key));
+    }
+  }
+
+  template <int Blocks, int Round>
+  __attribute__((target("aes,sse2"))) static void aesni_decrypt_rounds(
+      uint32_t (&w)[Nk], __m128i (&block)[Blocks], RoundIndex<Round>) {
+    retreat<Round>(w);
+    __m128i key = _mm_aesimc_si128(round_key<Round>(w));
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_aesdec_si128(block[i], key);
+    }
+    aesni_decrypt_rounds(w, block, RoundIndex<Round - 1>());
+  }
+
+  template <int Blocks>
+  static void aesni_decrypt_rounds(uint32_t (&)[Nk], __m128i (&)[Blocks],
+                                   RoundIndex<0>) {}
+
+  // Round keys in the order aesni_encrypt uses them.
+  template <int Round>
+  __attribute__((target("aes,sse2"))) static void encrypt_schedule(
+      uint32_t (&w)[Nk], __m128i keys[kRounds + 1], RoundIndex<Round>) {
+    advance<Round>(w);
+    keys[Round] = round_key<Round>(w);
+    encrypt_schedule(w, keys, RoundIndex<Round + 1>());
+  }
+
+  static void encrypt_schedule(uint32_t (&)[Nk], __m128i[kRounds + 1],
+                               RoundIndex<kRounds + 1>) {}
+
+  // The equivalent inverse cipher's round keys, indexed by round.
+  template <int Round>
+  __attribute__((target("aes,sse2"))) static void decrypt_schedule(
+      uint32_t (&w)[Nk], __m128i keys[kRounds + 1], RoundIndex<Round>) {
+    retreat<Round>(w);
+    keys[Round] = Round == 0 || Round == kRounds
+                      ? round_key<Round>(w)
+                      : _mm_aesimc_si128(round_key<Round>(w));
+    decrypt_schedule(w, keys, RoundIndex<Round - 1>());
+  }
+
+  static void decrypt_schedule(uint32_t (&)[Nk], __m128i[kRounds + 1],
+                               RoundIndex<-1>) {}
+
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) static void aesni_encrypt(
+      const __m128i keys[kRounds + 1], const unsigned char* in,
+      unsigned char* out) {
+    __m128i block[Blocks];
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] =
+          _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i), keys[0]);
+    }
+#pragma GCC unroll 16
+    for (int round = 1; round < kRounds; round++) {
+#pragma GCC unroll 16
+      for (int i = 0; i < Blocks; i++) {
+        block[i] = _mm_aesenc_si128(block[i], keys[round]);
+      }
+    }
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i,
+                       _mm_aesenclast_si128(block[i], keys[kRounds]));
+    }
+  }
+
+  template <int Blocks>
+  __attribute__((target("aes,sse2"))) static void aesni_decrypt(
+      const __m128i keys[kRounds + 1], const unsigned char* in,
+      unsigned char* out) {
+    __m128i block[Blocks];
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      block[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in + i),
+                               keys[kRounds]);
+    }
+#pragma GCC unroll 16
+    for (int round = kRounds - 1; round > 0; round--) {
+#pragma GCC unroll 16
+      for (int i = 0; i < Blocks; i++) {
+        block[i] = _mm_aesdec_si128(block[i], keys[round]);
+      }
+    }
+#pragma GCC unroll 16
+    for (int i = 0; i < Blocks; i++) {
+      _mm_storeu_si128((__m128i*)out + i,
+                       _mm_aesdeclast_si128(block[i], keys[0]));
+    }
+  }
+#endif
+};
+
+// Encrypts with round keys derived from the stored cipher key.
+template <int Nk>
+class AESCompactEncryptor {
+ public:
+  static const int kKeyBytes = AES<Nk>::kKeyBytes;
+
+  // key holds kKeyBytes bytes.
+  explicit AESCompactEncryptor(const unsigned char* key) {
+    AESCompactCore<Nk>::load_key(key, m_words);
+  }
+
+  // Processes nblocks consecutive 16-byte blocks; in and out may be the
+  // same buffer.
+  void encrypt_blocks(const unsigned char* in, unsigned char* out,
+                      size_t nblocks) const {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kEncryptBlocks, 16 * nblocks);
+    AESCompactCore<Nk>::encrypt_blocks(m_words, in, out, nblocks);
+  }
+
+  void encrypt_block(const unsigned char* in, unsigned char* out) const {
+    encrypt_blocks(in, out, 1);
+  }
+
+  void ttable_encrypt_blocks(const unsigned char* in, unsigned char* out,
+                             size_t nblocks) const {
+    AESCompactCore<Nk>::ttable_encrypt_blocks(m_words, in, out, nblocks);
+  }
+
+ private:
+  uint32_t m_words[Nk];
+};
+
+// Decrypts with round keys derived backwards from the last Nk words of the
+// key schedule, which the constructor computes once.
+template <int Nk>
+class AESCompactDecryptor {
+ public:
+  static const int kKeyBytes = AES<Nk>::kKeyBytes;
+
+  // key holds kKeyBytes bytes.
+  explicit AESCompactDecryptor(const unsigned char* key) {
+    AESCompactCore<Nk>::load_key(key, m_words);
+    AESCompactCore<Nk>::expand(m_words);
+  }
+
+  void decrypt_blocks(const unsigned char* in, unsigned char* out,
+                      size_t nblocks) const {
+    AES_STATS_SCOPE(32 * Nk, AESOperation::kDecryptBlocks, 16 * nblocks);
+    AESCompactCore<Nk>::decrypt_blocks(m_words, in, out, nblocks);
+  }
+
+  void decrypt_block(const unsigned char* in, unsigned char* out) const {
+    decrypt_blocks(in, out, 1);
+  }
+
+  void ttable_decrypt_blocks(const unsigned char* in, unsigned char* out,
+                             size_t nblocks) const {
+    AESCompactCore<Nk>::ttable_decrypt_blocks(m_words, in, out, nblocks);
+  }
+
+ private:
+  uint32_t m_words[Nk];
+};
+
+template <int Nk>
+const int AESCompactCore<Nk>::kRounds;
+template <int Nk>
+const int AESCompactCore<Nk>::kWords;
+template <int Nk>
+const int AESCompactEncryptor<Nk>::kKeyBytes;
+template <int Nk>
+const int AESCompactDecryptor<Nk>::kKeyBytes;
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * AES Seekable Container
+ *
+ * A chunked file format for large encrypted blobs that are read in small
+ * ranges. The plaintext is cut into chunks of a fixed size, and each chunk
+ * is encrypted on its own under an IV derived from the file's nonce and the
+ * chunk's index, so any chunk can be found and decrypted without touching
+ * the ones before it.
+ *
+ * Layout (integers big-endian):
+ *
+ *   header  magic "AESCHNK1", flags (u32), chunk size (u32), plaintext
+ *           length (u64), nonce (8 bytes): kHeaderBytes in all
+ *   chunk i ciphertext (chunk size bytes, the last one shorter), followed by
+ *           a 16-byte tag if the file is tagged
+ *
+ * The IV of chunk i is nonce || i (u32). Untagged files use CTR with the
+ * counter block nonce || i || 0, so even part of a chunk can be decrypted.
+ * Tagged files use GCM, and a chunk is always decrypted and checked as a
+ * whole. Its associated data is the header without the length, plus a byte
+ * marking the last chunk, so reordered or spliced chunks fail, and so does
+ * a file cut at a chunk boundary. An empty tagged file still has one empty
+ * last chunk. The reader checks the last chunk when it opens a tagged file,
+ * so the length it reports has been authenticated.
+ *
+ * The nonce is random per file, so one key should seal well under 2^32
+ * files.
+ */
+
+#ifndef AES_CONTAINER_H_
+#define AES_CONTAINER_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "AES.h"
+#include "AES_CTR.h"
+#include "AES_GCM.h"
+#include "AES_POOL.h"
+
+class AESContainer {
+ public:
+  static const size_t kHeaderBytes = 32;
+  static const size_t kTagBytes = 16;
+  static const size_t kDefaultChunkSize = 64 * 1024;
+  // Flag bit: every chunk carries a GCM tag.
+  static const uint32_t kTagged = 1;
+  // The chunk index is 32 bits of the IV.
+  static const uint64_t kMaxChunks = uint64_t(1) << 32;
+  // Keeps file_size() and every chunk offset far from wrapping and within
+  // off_t.
+  static const uint64_t kMaxLength = uint64_t(1) << 62;
+
+  struct Header {
+    uint32_t flags;
+    uint32_t chunk_size;
+    uint64_t length;
+    uint8_t nonce[8];
+  };
+
+  static void encode_header(const Header& header, uint8_t out[kHeaderBytes]) {
+    memcpy(out, "AESCHNK1", 8);
+    store_be(header.flags, out + 8, 4);
+    store_be(header.chunk_size, out + 12, 4);
+    store_be(header.length, out + 16, 8);
+    memcpy(out + 24, header.nonce, 8);
+  }
+
+  // Returns false if the bytes are not a container header this code reads.
+  static bool decode_header(const uint8_t in[kHeaderBytes], Header* header) {
+    if (memcmp(in, "AESCHNK1", 8) != 0) return false;
+    header->flags = (uint32_t)load_be(in + 8, 4);
+    header->chunk_size = (uint32_t)load_be(in + 12, 4);
+    header->length = load_be(in + 16, 8);
+    memcpy(header->nonce, in + 24, 8);
+    return (header->flags & ~kTagged) == 0 && header->chunk_size != 0 &&
+           header->length <= kMaxLength && chunk_count(*header) <= kMaxChunks;
+  }
+
+  static bool tagged(const Header& header) {
+    return (header.flags & kTagged) != 0;
+  }
+
+  // Chunks in the file; a tagged file has at least one.
+  static uint64_t chunk_count(const Header& header) {
+    uint64_t chunks = header.length / header.chunk_size +
+                      (header.length % header.chunk_size != 0);
+    return chunks == 0 && tagged(header) ? 1 : chunks;
+  }
+
+  // Plaintext bytes in chunk index.
+  static size_t chunk_length(const Header& header, uint64_t index) {
+    uint64_t start = index * header.chunk_size;
+    uint64_t left = header.length - start;
+    return (size_t)(left < header.chunk_size ? left : header.chunk_size);
+  }
+
+  // File offset of chunk index.
+  static uint64_t chunk_offset(const Header& header, uint64_t index) {
+    uint64_t record = header.chunk_size + (tagged(header) ? kTagBytes : 0);
+    return kHeaderBytes + index * record;
+  }
+
+  static uint64_t file_size(const Header& header) {
+    uint64_t size = kHeaderBytes + header.length;
+    return tagged(header) ? size + chunk_count(header) * kTagBytes : size;
+  }
+
+  // Encrypts chunk index (length bytes) into out, followed by its tag if
+  // the file is tagged. last marks the file's final chunk. Only the header's
+  // flags, chunk size and nonce are used, so a writer can seal chunks before
+  // it knows the length.
+  static void seal_chunk(AESBase& cipher, const Header& header,
+                         uint64_t index, bool last, const uint8_t* in,
+                         uint8_t* out, size_t length) {
+    uint8_t iv[16];
+    chunk_iv(header, index, iv);
+    if (tagged(header)) {
+      uint8_t aad[kAADBytes];
+      chunk_aad(header, last, aad);
+      AESGCM gcm(cipher);
+      gcm.encrypt(iv, 12, aad, kAADBytes, in, out, length, out + length,
+                  kTagBytes);
+      return;
+    }
+    AESCTR(cipher, iv).process(in, out, length);
+  }
+
+  // Decrypts chunk index from its record in the file. For an untagged file
+  // any length bytes from offset can be decrypted. For a tagged one it must
+  // be the whole chunk, and false means the tag did not match and out must
+  // be discarded.
+  static bool open_chunk(AESBase& cipher, const Header& header,
+                         uint64_t index, const uint8_t* record, size_t offset,
+                         uint8_t* out, size_t length) {
+    uint8_t iv[16];
+    chunk_iv(header, index, iv);
+    if (tagged(header)) {
+      uint8_t aad[kAADBytes];
+      chunk_aad(header, index + 1 == chunk_count(header), aad);
+      AESGCM gcm(cipher);
+      return gcm.decrypt(iv, 12, aad, kAADBytes, record, out, length,
+                         record + length, kTagBytes);
+    }
+    AESCTR::add_counter(iv, offset / 16);
+    AESCTR ctr(cipher, iv);
+    uint8_t skipped[16] = {0};
+    ctr.process(skipped, skipped, offset % 16);
+    ctr.process(record + offset, out, length);
+    return true;
+  }
+
+ private:
+  // Header minus the length, then the last-chunk byte.
+  static const size_t kAADBytes = kHeaderBytes - 8 + 1;
+
+  // nonce || index || 0: the GCM IV is its first 12 bytes, and the CTR
+  // counter block is all 16.
+  static void chunk_iv(const Header& header, uint64_t index, uint8_t iv[16]) {
+    memcpy(iv, header.nonce, 8);
+    store_be(index, iv + 8, 4);
+    memset(iv + 12, 0, 4);
+  }
+
+  static void chunk_aad(const Header& header, bool last,
+                        uint8_t aad[kAADBytes]) {
+    uint8_t encoded[kHeaderBytes];
+    encode_header(header, encoded);
+    memcpy(aad, encoded, 16);
+    memcpy(aad + 16, encoded + 24, 8);
+    aad[24] = last ? 1 : 0;
+  }
+
+  static uint64_t load_be(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = value << 8 | p[i];
+    return value;
+  }
+
+  static void store_be(uint64_t value, uint8_t* p, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+      p[i] = (uint8_t)value;
+      value >>= 8;
+    }
+  }
+};
+
+// Writes a container sequentially. A chunk is sealed once later data or
+// close() shows whether it is the last, and close() fills in the length in
+// the header.
+class AESContainerWriter {
+ public:
+  // The cipher is borrowed, not copied, and must outlive this object.
+  // chunk_size must be between 1 and 2^32 - 1 bytes; open() fails for any
+  // other size.
+  explicit AESContainerWriter(
+      AESBase& cipher, bool tagged = true,
+      size_t chunk_size = AESContainer::kDefaultChunkSize)
+      : m_cipher(cipher), m_fd(-1), m_index(0) {
+    m_header.flags = tagged ? AESContainer::kTagged : 0;
+    // A size that does not fit the header field is stored as 0 rather than
+    // truncated, so that open() rejects it.
+    m_header.chunk_size =
+        (uint64_t)chunk_size <= UINT32_MAX ? (uint32_t)chunk_size : 0;
+    m_header.length = 0;
+    memset(m_header.nonce, 0, sizeof(m_header.nonce));
+  }
+
+  AESContainerWriter(const AESContainerWriter&) = delete;
+  AESContainerWriter& operator=(const AESContainerWriter&) = delete;
+
+  ~AESContainerWriter() {
+    if (m_fd >= 0) ::close(m_fd);
+  }
+
+  // Creates or truncates path and picks a fresh random nonce.
+  bool open(const char* path) {
+    if (m_fd >= 0 || m_header.chunk_size == 0) return false;
+    m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) return false;
+    std::random_device random;
+    for (int i = 0; i < 8; i += 4) {
+      uint32_t value = random();
+      memcpy(m_header.nonce + i, &value, 4);
+    }
+    m_header.length = 0;
+    m_index = 0;
+    m_chunk.clear();
+    m_chunk.reserve(m_header.chunk_size);
+    m_record.resize(m_header.chunk_size + AESContainer::kTagBytes);
+    // Room for the header, written once the length is known.
+    uint8_t placeholder[AESContainer::kHeaderBytes] = {0};
+    return write_all(placeholder, sizeof(placeholder));
+  }
+
+  bool write(const uint8_t* data, size_t length) {
+    if (m_fd < 0) return false;
+    while (length > 0) {
+      // More data follows, so a full buffered chunk is not the last.
+      if (m_chunk.size() == m_header.chunk_size && !flush_chunk(false)) {
+        return false;
+      }
+      size_t count = m_header.chunk_size - m_chunk.size();
+      if (count > length) count = length;
+      m_chunk.insert(m_chunk.end(), data, data + count);
+      data += count;
+      length -= count;
+    }
+    return true;
+  }
+
+  // Seals the last chunk, writes the header and closes the file.
+  bool close() {
+    if (m_fd < 0) return false;
+    bool ok = true;
+    if (!m_chunk.empty() || AESContainer::tagged(m_header)) {
+      ok = flush_chunk(true);
+    }
+    if (ok) {
+      uint8_t header[AESContainer::kHeaderBytes];
+      AESContainer::encode_header(m_header, header);
+      ok = pwrite(m_fd, header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    }
+    if (::close(m_fd) != 0) ok = false;
+    m_fd = -1;
+    return ok;
+  }
+
+ private:
+  bool flush_chunk(bool last) {
+    if (m_index >= AESContainer::kMaxChunks) return false;
+    size_t length = m_chunk.size();
+    AESContainer::seal_chunk(m_cipher, m_header, m_index, last, m_chunk.data(),
+                             m_record.data(), length);
+    size_t record =
+        length + (AESContainer::tagged(m_header) ? AESContainer::kTagBytes : 0);
+    if (!write_all(m_record.data(), record)) return false;
+    m_header.length += length;
+    m_index++;
+    m_chunk.clear();
+    return true;
+  }
+
+  bool write_all(const uint8_t* data, size_t length) {
+    while (length > 0) {
+      ssize_t written = ::write(m_fd, data, length);
+      if (written < 0) return false;
+      data += written;
+      length -= (size_t)written;
+    }
+    return true;
+  }
+
+  AESBase& m_cipher;
+  AESContainer::Header m_header;
+  int m_fd;
+  uint64_t m_index;
+  std::vector<uint8_t> m_chunk;
+  std::vector<uint8_t> m_record;
+};
+
+// Reads byte ranges of a container through a read-only memory map. Only the
+// chunks overlapping a range are decrypted, on up to threads threads.
+// Concurrent read() calls on one reader are safe.
+class AESContainerReader {
+ public:
+  // The cipher is borrowed, not copied, and must outlive this object. With
+  // threads > 1, reads spanning several chunks run on up to that many
+  // threads of the shared pool (or the one given to set_pool()).
+  explicit AESContainerReader(AESBase& cipher, unsigned int threads = 1)
+      : m_cipher(cipher),
+        m_threads(threads ? threads : 1),
+        m_pool(nullptr),
+        m_map(nullptr),
+        m_map_length(0) {}
+
+  AESContainerReader(const AESContainerReader&) = delete;
+  AESContainerReader& operator=(const AESContainerReader&) = delete;
+
+  ~AESContainerReader() { close(); }
+
+  void set_threads(unsigned int threads) { m_threads = threads ? threads : 1; }
+
+  // The pool is borrowed and must outlive this object.
+  void set_pool(AESThreadPool& pool) { m_pool = &pool; }
+
+  // Maps path and checks its header and size, and for a tagged file its last
+  // chunk. Returns false if it cannot be read as a container under this key.
+  bool open(const char* path) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0 &&
+              (uint64_t)info.st_size >= AESContainer::kHeaderBytes;
+    if (ok) {
+      m_map_length = (size_t)info.st_size;
+      void* map = mmap(nullptr, m_map_length, PROT_READ, MAP_SHARED, fd, 0);
+      ok = map != MAP_FAILED;
+      if (ok) {
+        m_map = (const uint8_t*)map;
+        // Reads jump around; read-ahead would mostly fetch unused pages.
+        madvise(map, m_map_length, MADV_RANDOM);
+      }
+    }
+    ::close(fd);
+    ok = ok && AESContainer::decode_header(m_map, &m_header) &&
+         AESContainer::file_size(m_header) == m_map_length;
+    if (ok && AESContainer::tagged(m_header)) {
+      uint64_t last = AESContainer::chunk_count(m_header) - 1;
+      std::vector<uint8_t> scratch(AESContainer::chunk_length(m_header, last));
+      ok = AESContainer::open_chunk(
+          m_cipher, m_header, last,
+          m_map + AESContainer::chunk_offset(m_header, last), 0,
+          scratch.data(), scratch.size());
+    }
+    if (!ok) close();
+    return ok;
+  }
+
+  void close() {
+    if (m_map != nullptr) munmap((void*)m_map, m_map_length);
+    m_map = nullptr;
+    m_map_length = 0;
+  }
+
+  bool is_open() const { return m_map != nullptr; }
+
+  // Plaintext length.
+  uint64_t size() const { return is_open() ? m_header.length : 0; }
+
+  // Decrypts length bytes from offset into out. Returns false if the range
+  // is past the end or a chunk's tag does not match; out must then be
+  // discarded.
+  bool read(uint64_t offset, uint8_t* out, size_t length) {
+    if (!is_open() || offset > m_header.length ||
+        length > m_header.length - offset) {
+      return false;
+    }
+    if (length == 0) return true;
+    const uint64_t chunk_size = m_header.chunk_size;
+    const uint64_t first = offset / chunk_size;
+    const size_t chunks =
+        (size_t)((offset + length - 1) / chunk_size - first + 1);
+    std::atomic<bool> failed(false);
+    auto read_chunk = [&](size_t i) {
+      uint64_t index = first + i;
+      uint64_t start = index * chunk_size;
+      size_t chunk_length = AESContainer::chunk_length(m_header, index);
+      // The part of the chunk inside the range, and where it goes in out.
+      size_t begin = offset > start ? (size_t)(offset - start) : 0;
+      size_t end = offset + length < start + chunk_length
+                       ? (size_t)(offset + length - start)
+                       : chunk_length;
+      uint8_t* target = out + (start + begin - offset);
+      const uint8_t* record =
+          m_map + AESContainer::chunk_offset(m_header, index);
+      bool ok;
+      if (!AESContainer::tagged(m_header) ||
+          (begin == 0 && end == chunk_length)) {
+        ok = AESContainer::open_chunk(m_cipher, m_header, index, record, begin,
+                                      target, end - begin);
+      } else {
+        // A tag covers its whole chunk, so a partial chunk goes through a
+        // scratch buffer.
+        std::vector<uint8_t> scratch(chunk_length);
+        ok = AESContainer::open_chunk(m_cipher, m_header, index, record, 0,
+                                      scratch.data(), chunk_length);
+        memcpy(target, scratch.data() + begin, end - begin);
+      }
+      if (!ok) failed.store(true, std::memory_order_relaxed);
+    };
+    if (m_threads == 1 || chunks == 1) {
+      for (size_t i = 0; i < chunks; i++) read_chunk(i);
+    } else {
+      AESThreadPool& pool = m_pool ? *m_pool : AESThreadPool::shared();
+      pool.run(chunks, m_threads, read_chunk);
+    }
+    return !failed.load(std::memory_order_relaxed);
+  }
+
+ private:
+  AESBase& m_cipher;
+  unsigned int m_threads;
+  AESThreadPool* m_pool;
+  AESContainer::Header m_header;
+  const uint8_t* m_map;
+  size_t m_map_length;
+};
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * AES Counter (CTR) Mode
+ *
+ * Turns any AESBase cipher into a stream cipher. The 16-byte counter block is
+ * incremented as a 128-bit big-endian integer, as in NIST SP 800-38A, and the
+ * keystream position carries over between process() calls so a message can
+ * be fed in pieces of any size.
+ *
+ * Large calls are split into counter-aligned chunks that are encrypted on a
+ * work-stealing thread pool. Every chunk derives its starting counter from
+ * its block offset, so the output is identical for any thread count.
+ */
+
+#ifndef AES_CTR_H_
+#define AES_CTR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "AES.h"
+#include "AES_POOL.h"
+
+class AESCTR {
+ public:
+  // Keystream blocks generated per encrypt_blocks call.
+  static const size_t kChunkBlocks = 64;
+
+  // The cipher is borrowed, not copied, and must outlive this object. With
+  // threads > 1, large calls run on up to that many threads of the shared
+  // pool (or the one given to set_pool()).
+  AESCTR(AESBase& cipher, const uint8_t counter[16], unsigned int threads = 1)
+      : m_cipher(cipher),
+        m_threads(threads ? threads : 1),
+        m_pool(nullptr),
+        m_used(16) {
+    memcpy(m_counter, counter, 16);
+  }
+
+  void set_threads(unsigned int threads) { m_threads = threads ? threads : 1; }
+
+  // The pool is borrowed and must outlive this object.
+  void set_pool(AESThreadPool& pool) { m_pool = &pool; }
+
+  // Encrypts or decrypts length bytes; both directions are the same
+  // operation. in and out may be the same buffer.
+  void process(const uint8_t* in, uint8_t* out, size_t length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCTR, length);
+    crypt(in, out, length);
+  }
+
+#if AES_HAVE_IOVEC
+  // Scatter/gather form of process(): the bytes listed in in go to the ones
+  // listed in out, which may be split at other points (or be the same
+  // list). Returns the bytes processed: the smaller total.
+  //
+  // Runs contiguous in both lists are processed in place. Long runs take
+  // the multi-block (and threaded) path of process(). Short ones are
+  // batched, so that up to kChunkBlocks blocks of keystream for several
+  // of them come from one encrypt_blocks call, and blocks straddling
+  // fragment boundaries need no extra cipher calls.
+  size_t process(const struct iovec* in, size_t in_count,
+                 const struct iovec* out, size_t out_count) {
+#if AES_INSTRUMENT
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCTR,
+                    AESIovecCursor::total(in, in_count, out, out_count));
+#endif
+    const size_t kBatchBytes = 16 * kChunkBlocks;
+    AESIovecCursor cursor(in, in_count, out, out_count);
+    Run batch[kChunkBlocks];
+    size_t runs = 0, batch_bytes = 0, total = 0;
+    Run run;
+    while ((run.length = cursor.next(&run.in, &run.out)) != 0) {
+      total += run.length;
+      if (batch_bytes + run.length > kBatchBytes || runs == kChunkBlocks) {
+        crypt_runs(batch, runs, batch_bytes);
+        runs = batch_bytes = 0;
+      }
+      if (run.length >= kBatchBytes) {
+        crypt(run.in, run.out, run.length);
+        continue;
+      }
+      batch[runs++] = run;
+      batch_bytes += run.length;
+    }
+    crypt_runs(batch, runs, batch_bytes);
+    return total;
+  }
+#endif
+
+  // Adds n to a 128-bit big-endian counter, wrapping modulo 2^128.
+  static void add_counter(uint8_t counter[16], uint64_t n) {
+    uint64_t carry = n;
+    for (int i = 15; i >= 0 && carry != 0; i--) {
+      uint64_t sum = counter[i] + (carry & 0xFF);
+      counter[i] = (uint8_t)sum;
+      carry = (carry >> 8) + (sum >> 8);
+    }
+  }
+
+  // XORs a run of keystream into in; 8 bytes at a time where possible.
+  static void xor_bytes(const uint8_t* in, const uint8_t* keystream,
+                        uint8_t* out, size_t length) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+      uint64_t a, b;
+      memcpy(&a, in + i, 8);
+      memcpy(&b, keystream + i, 8);
+      a ^= b;
+      memcpy(out + i, &a, 8);
+    }
+    for (; i < length; i++) out[i] = in[i] ^ keystream[i];
+  }
+
+  // Writes nblocks counter blocks, the given counter and those following.
+  static void counters(const uint8_t counter[16], uint8_t* out,
+                       size_t nblocks) {
+    uint64_t hi = load_be64(counter);
+    uint64_t lo = load_be64(counter + 8);
+    counter_blocks(hi, lo, out, nblocks);
+  }
+
+  // Writes nblocks blocks of keystream starting at the given counter.
+  static void keystream(AESBase& cipher, const uint8_t counter[16],
+                        uint8_t* out, size_t nblocks) {
+    counters(counter, out, nblocks);
+    cipher.encrypt_blocks(out, out, nblocks);
+  }
+
+  // Encrypts nblocks whole blocks starting at the given counter, without
+  // touching any member state, so ranges can run concurrently.
+  static void crypt_range(AESBase& cipher, const uint8_t counter[16],
+                          const uint8_t* in, uint8_t* out, size_t nblocks) {
+    uint64_t hi = load_be64(counter);
+    uint64_t lo = load_be64(counter + 8);
+    uint8_t keystream[kChunkBlocks * 16];
+    while (nblocks > 0) {
+      size_t count = nblocks < kChunkBlocks ? nblocks : kChunkBlocks;
+      counter_blocks(hi, lo, keystream, count);
+      cipher.encrypt_blocks(keystream, keystream, count);
+      xor_bytes(in, keystream, out, 16 * count);
+      in += 16 * count;
+      out += 16 * count;
+      nblocks -= count;
+    }
+  }
+
+ private:
+  static uint64_t load_be64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 8 | p[i];
+    return value;
+  }
+
+  // Runs twice per counter block, so it has to be a single store: GCC does
+  // not merge the byte loop.
+  static void store_be64(uint64_t value, uint8_t* p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+    memcpy(p, &value, 8);
+#else
+    for (int i = 7; i >= 0; i--) {
+      p[i] = (uint8_t)value;
+      value >>= 8;
+    }
+#endif
+  }
+
+  // Writes count counter blocks from hi:lo on, advancing hi:lo past them.
+  static void counter_blocks(uint64_t& hi, uint64_t& lo, uint8_t* out,
+                             size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      store_be64(hi, out + 16 * i);
+      store_be64(lo, out + 16 * i + 8);
+      if (++lo == 0) hi++;
+    }
+  }
+
+  // process() without the instrumentation scope.
+  void crypt(const uint8_t* in, uint8_t* out, size_t length) {
+    while (length > 0 && m_used < 16) {
+      *out++ = *in++ ^ m_keystream[m_used++];
+      length--;
+    }
+
+    size_t nblocks = length / 16;
+    if (nblocks > 0) {
+      process_blocks(in, out, nblocks);
+      add_counter(m_counter, nblocks);
+      in += 16 * nblocks;
+      out += 16 * nblocks;
+      length -= 16 * nblocks;
+    }
+
+    if (length > 0) {
+      memcpy(m_keystream, m_counter, 16);
+      m_cipher.encrypt_blocks(m_keystream, m_keystream, 1);
+      add_counter(m_counter, 1);
+      m_used = 0;
+      while (length > 0) {
+        *out++ = *in++ ^ m_keystream[m_used++];
+        length--;
+      }
+    }
+  }
+
+#if AES_HAVE_IOVEC
+  struct Run {
+    const uint8_t* in;
+    uint8_t* out;
+    size_t length;
+  };
+
+  // Processes runs totalling bytes (at most 16 * kChunkBlocks) as one
+  // stretch of keystream: what is left of the current block, then the
+  // blocks that follow, all produced in one encrypt_blocks call. A partly
+  // used last block is kept for the next call, as in crypt().
+  void crypt_runs(const Run* runs, size_t count, size_t bytes) {
+    if (bytes == 0) return;
+    uint8_t keystream[16 * kChunkBlocks + 16];
+    size_t left = 16 - m_used;
+    memcpy(keystream, m_keystream + m_used, left);
+    size_t nblocks = bytes > left ? (bytes - left + 15) / 16 : 0;
+    for (size_t i = 0; i < nblocks; i++) {
+      memcpy(keystream + left + 16 * i, m_counter, 16);
+      add_counter(m_counter, 1);
+    }
+    m_cipher.encrypt_blocks(keystream + left, keystream + left, nblocks);
+    const uint8_t* stream = keystream;
+    for (size_t i = 0; i < count; i++) {
+      xor_bytes(runs[i].in, stream, runs[i].out, runs[i].length);
+      stream += runs[i].length;
+    }
+    // Keep the unused tail of the last block where crypt() expects it.
+    size_t unused = left + 16 * nblocks - bytes;
+    memcpy(m_keystream + 16 - unused, stream, unused);
+    m_used = 16 - unused;
+  }
+#endif
+
+  void process_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+    const size_t per_chunk = AESThreadPool::kChunkBytes / 16;
+    if (m_threads == 1 || nblocks <= per_chunk) {
+      crypt_range(m_cipher, m_counter, in, out, nblocks);
+      return;
+    }
+
+    AESBase& cipher = m_cipher;
+    const uint8_t* counter = m_counter;
+    AESThreadPool& pool = m_pool ? *m_pool : AESThreadPool::shared();
+    pool.run((nblocks + per_chunk - 1) / per_chunk, m_threads,
+             [&cipher, counter, in, out, nblocks, per_chunk](size_t i) {
+               size_t start = i * per_chunk;
+               size_t count = nblocks - start < per_chunk ? nblocks - start
+                                                          : per_chunk;
+               uint8_t chunk_counter[16];
+               memcpy(chunk_counter, counter, 16);
+               add_counter(chunk_counter, start);
+               crypt_range(cipher, chunk_counter, in + 16 * start,
+                           out + 16 * start, count);
+             });
+  }
+
+  AESBase& m_cipher;
+  unsigned int m_threads;
+  AESThreadPool* m_pool;
+  uint8_t m_counter[16];
+  uint8_t m_keystream[16];
+  size_t m_used;
+};
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * AES CTR_DRBG
+ *
+ * The CTR_DRBG deterministic random bit generator of NIST SP 800-90A with
+ * AES-256 and no derivation function: the state is a 256-bit key and a
+ * 128-bit counter V, seeded from 48 bytes of full-entropy input. Seeded with
+ * a fixed input it produces the same stream every time, which is what test
+ * data generation needs; seeded from the system it is a fast user-space
+ * source for nonces and padding.
+ *
+ * generate() is buffered: each refill is one SP 800-90A generate request of
+ * kBufferBytes (the largest a request may be), produced by encrypting the
+ * successive counter blocks in one encrypt_blocks call and followed by the
+ * usual state update. Small calls then only copy out of the buffer, and the
+ * bytes handed out are wiped from it. generate_request() instead runs whole
+ * requests with additional input, and with prediction resistance enabled
+ * every call reseeds from the entropy source and bypasses the buffer.
+ *
+ * Instances are not thread-safe; thread_instance() gives each thread its own
+ * system-seeded generator so that no locking is needed.
+ */
+
+#ifndef AES_DRBG_H_
+#define AES_DRBG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "AES.h"
+
+class AESCTRDRBG {
+ public:
+  // Entropy input and seed length: a 256-bit key plus one block.
+  static const size_t kSeedBytes = 48;
+  // Largest generate request, 2^19 bits; also the size of the buffer.
+  static const size_t kBufferBytes = 64 * 1024;
+  // Requests between reseeds allowed by SP 800-90A.
+  static const uint64_t kMaxReseedInterval = uint64_t(1) << 48;
+
+  // Fills out with length bytes of full-entropy input.
+  typedef void (*EntropySource)(uint8_t* out, size_t length);
+
+  // Seeds from the entropy source, by default the system's. Both
+  // constructors throw std::length_error for a personalization string
+  // longer than kSeedBytes, which SP 800-90A says to reject.
+  explicit AESCTRDRBG(const uint8_t* personalization = nullptr,
+                      size_t personalization_length = 0,
+                      EntropySource source = system_entropy)
+      : m_source(source), m_key(), m_engine(&m_key[0][0]) {
+    check_personalization(personalization_length);
+    uint8_t entropy[kSeedBytes];
+    m_source(entropy, kSeedBytes);
+    instantiate(entropy, personalization, personalization_length);
+    wipe(entropy, kSeedBytes);
+  }
+
+  // Seeds from the given entropy input; the output is fully determined by
+  // it and the personalization string (at most kSeedBytes bytes).
+  AESCTRDRBG(const uint8_t entropy[kSeedBytes],
+             const uint8_t* personalization, size_t personalization_length)
+      : m_source(system_entropy), m_key(), m_engine(&m_key[0][0]) {
+    check_personalization(personalization_length);
+    instantiate(entropy, personalization, personalization_length);
+  }
+
+  AESCTRDRBG(const AESCTRDRBG&) = delete;
+  AESCTRDRBG& operator=(const AESCTRDRBG&) = delete;
+
+  ~AESCTRDRBG() {
+    wipe(m_key, sizeof(m_key));
+    wipe(m_v, sizeof(m_v));
+    wipe(&m_engine, sizeof(m_engine));
+    wipe(m_buffer.data(), m_buffer.size());
+  }
+
+  // A generator for the calling thread, seeded from the system on first use.
+  static AESCTRDRBG& thread_instance() {
+    thread_local AESCTRDRBG instance;
+    return instance;
+  }
+
+  static void system_entropy(uint8_t* out, size_t length) {
+    std::random_device random;
+    for (size_t i = 0; i < length; i += 4) {
+      uint32_t value = random();
+      memcpy(out + i, &value, length - i < 4 ? length - i : 4);
+    }
+  }
+
+  void set_entropy_source(EntropySource source) { m_source = source; }
+
+  // With prediction resistance every generate call first reseeds from the
+  // entropy source.
+  void set_prediction_resistance(bool enabled) {
+    m_prediction_resistance = enabled;
+  }
+
+  // Requests after which the generator reseeds itself from the entropy
+  // source; at most kMaxReseedInterval.
+  void set_reseed_interval(uint64_t requests) {
+    m_reseed_interval =
+        requests < kMaxReseedInterval ? requests : kMaxReseedInterval;
+  }
+
+  // Reseeds with the given entropy input and optional additional input (at
+  // most kSeedBytes bytes), discarding buffered output. Returns false,
+  // leaving the state unchanged, for longer additional input.
+  bool reseed(const uint8_t entropy[kSeedBytes],
+              const uint8_t* additional = nullptr,
+              size_t additional_length = 0) {
+    if (additional_length > kSeedBytes) return false;
+    uint8_t seed[kSeedBytes];
+    memcpy(seed, entropy, kSeedBytes);
+    xor_padded(seed, additional, additional_length);
+    update(seed);
+    wipe(seed, kSeedBytes);
+    m_requests = 1;
+    discard_buffer();
+    return true;
+  }
+
+  // Reseeds from the entropy source.
+  void reseed() {
+    uint8_t entropy[kSeedBytes];
+    m_source(entropy, kSeedBytes);
+    reseed(entropy);
+    wipe(entropy, kSeedBytes);
+  }
+
+  // Writes length pseudorandom bytes, served from the buffer.
+  void generate(uint8_t* out, size_t length) {
+    if (m_prediction_resistance) {
+      generate_request(out, length, nullptr, 0);
+      return;
+    }
+    while (length > 0) {
+      if (m_position == m_buffer.size()) refill();
+      size_t count = m_buffer.size() - m_position;
+      if (count > length) count = length;
+      memcpy(out, m_buffer.data() + m_position, count);
+      wipe(m_buffer.data() + m_position, count);
+      m_position += count;
+      out += count;
+      length -= count;
+    }
+  }
+
+  // Writes length bytes as unbuffered SP 800-90A generate requests of at
+  // most kBufferBytes each, mixing in additional input (at most kSeedBytes
+  // bytes) before and after every request. Returns false, writing nothing,
+  // for longer additional input.
+  bool generate_request(uint8_t* out, size_t length, const uint8_t* additional,
+                        size_t additional_length) {
+    if (additional_length > kSeedBytes) return false;
+    discard_buffer();
+    do {
+      size_t count = length < kBufferBytes ? length : kBufferBytes;
+      request(out, count, additional, additional_length);
+      out += count;
+      length -= count;
+    } while (length > 0);
+    return true;
+  }
+
+  template <typename T>
+  T next() {
+    T value;
+    generate(reinterpret_cast<uint8_t*>(&value), sizeof(value));
+    return value;
+  }
+
+ private:
+  void instantiate(const uint8_t entropy[kSeedBytes],
+                   const uint8_t* personalization,
+                   size_t personalization_length) {
+    memset(m_key, 0, sizeof(m_key));
+    memset(m_v, 0, sizeof(m_v));
+    rekey();
+    m_buffer.assign(kBufferBytes, 0);
+    m_prediction_resistance = false;
+    m_reseed_interval = kMaxReseedInterval;
+    uint8_t seed[kSeedBytes];
+    memcpy(seed, entropy, kSeedBytes);
+    xor_padded(seed, personalization, personalization_length);
+    update(seed);
+    wipe(seed, kSeedBytes);
+    m_requests = 1;
+    m_position = m_buffer.size();
+  }
+
+  // One generate request of at most kBufferBytes.
+  void request(uint8_t* out, size_t length, const uint8_t* additional,
+               size_t additional_length) {
+    if (m_prediction_resistance || m_requests > m_reseed_interval) {
+      uint8_t entropy[kSeedBytes];
+      m_source(entropy, kSeedBytes);
+      reseed(entropy, additional, additional_length);
+      wipe(entropy, kSeedBytes);
+      additional_length = 0;
+    }
+    uint8_t provided[kSeedBytes] = {0};
+    if (additional_length > 0) {
+      xor_padded(provided, additional, additional_length);
+      update(provided);
+    }
+    keystream(out, length);
+    update(provided);
+    m_requests++;
+  }
+
+  void refill() {
+    request(m_buffer.data(), m_buffer.size(), nullptr, 0);
+    m_position = 0;
+  }
+
+  void discard_buffer() {
+    wipe(m_buffer.data() + m_position, m_buffer.size() - m_position);
+    m_position = m_buffer.size();
+  }
+
+  // Encrypts the counter blocks V+1, V+2, ... into out, leaving V at the
+  // last one used.
+  void keystream(uint8_t* out, size_t length) {
+    size_t nblocks = length / 16;
+    uint64_t hi = load_be64(m_v), lo = load_be64(m_v + 8);
+    for (size_t i = 0; i < nblocks; i++) {
+      if (++lo == 0) hi++;
+      store_be64(hi, out + 16 * i);
+      store_be64(lo, out + 16 * i + 8);
+    }
+    store_be64(hi, m_v);
+    store_be64(lo, m_v + 8);
+    m_engine.encrypt_blocks(out, out, nblocks);
+    if (length % 16 != 0) {
+      uint8_t block[16];
+      increment(m_v);
+      m_engine.encrypt_blocks(m_v, block, 1);
+      memcpy(out + 16 * nblocks, block, length % 16);
+      wipe(block, 16);
+    }
+  }
+
+  // CTR_DRBG_Update: derives a new key and V from the next kSeedBytes of
+  // keystream XORed with provided.
+  void update(const uint8_t provided[kSeedBytes]) {
+    uint8_t temp[kSeedBytes];
+    keystream(temp, kSeedBytes);
+    for (size_t i = 0; i < kSeedBytes; i++) temp[i] ^= provided[i];
+    memcpy(m_key, temp, sizeof(m_key));
+    memcpy(m_v, temp + sizeof(m_key), sizeof(m_v));
+    wipe(temp, kSeedBytes);
+    rekey();
+  }
+
+  // Expands m_key over the old schedule in place, wiping that first so no
+  // earlier round keys are left behind.
+  void rekey() {
+    wipe(&m_engine, sizeof(m_engine));
+    new (&m_engine) AES<8>(&m_key[0][0]);
+  }
+
+  static uint64_t load_be64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 8 | p[i];
+    return value;
+  }
+
+  // Runs once per counter block, so it has to be a single store: GCC does
+  // not merge the byte loop.
+  static void store_be64(uint64_t value, uint8_t* p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+    memcpy(p, &value, 8);
+#else
+    for (int i = 7; i >= 0; i--) {
+      p[i] = (uint8_t)value;
+      value >>= 8;
+    }
+#endif
+  }
+
+  static void increment(uint8_t v[16]) {
+    for (int i = 15; i >= 0 && ++v[i] == 0; i--) {
+    }
+  }
+
+  // length is at most kSeedBytes; the public entry points check it.
+  static void xor_padded(uint8_t seed[kSeedBytes], const uint8_t* data,
+                         size_t length) {
+    for (size_t i = 0; i < length; i++) seed[i] ^= data[i];
+  }
+
+  static void check_personalization(size_t length) {
+    if (length > kSeedBytes) {
+      throw std::length_error("AESCTRDRBG: personalization over 48 bytes");
+    }
+  }
+
+  static void wipe(void* data, size_t length) { AESBase::wipe(data, length); }
+
+  EntropySource m_source;
+  unsigned char m_key[8][4];
+  uint8_t m_v[16];
+  AES<8> m_engine;
+  std::vector<uint8_t> m_buffer;
+  size_t m_position;
+  uint64_t m_requests;
+  uint64_t m_reseed_interval;
+  bool m_prediction_resistance;
+};
+
+#endif
@@ -0,0 +1,568 @@
+/*
+ * AES Galois/Counter Mode (GCM)
+ *
+ * Authenticated encryption as specified in NIST SP 800-38D, on top of any
+ * AESBase cipher. GHASH uses 4-bit Shoup tables precomputed per key, or
+ * PCLMULQDQ when the CPU supports it (checked at runtime through CPUID).
+ *
+ * Data is processed in chunks of kChunkBlocks: the CTR keystream for a chunk
+ * is produced with encrypt_blocks and the ciphertext is hashed while it is
+ * still in L1, so encryption and authentication share one pass over the
+ * buffer. AAD and data can be supplied through any number of update calls of
+ * arbitrary sizes.
+ */
+
+#ifndef AES_GCM_H_
+#define AES_GCM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "AES.h"
+
+enum class GHASHBackend { kTable, kPCLMUL };
+
+class AESGCM {
+ public:
+  // Blocks of keystream generated and hashed per step.
+  static const size_t kChunkBlocks = 16;
+  // SP 800-38D limits: 2^39 - 256 bits of data, so that the 32-bit counter
+  // never wraps back to J0, and 2^64 - 1 bits of AAD.
+  static const uint64_t kMaxDataBytes = (uint64_t(1) << 36) - 32;
+  static const uint64_t kMaxAADBytes = (uint64_t(1) << 61) - 1;
+
+  // The cipher is borrowed, not copied, and must outlive this object.
+  explicit AESGCM(AESBase& cipher) : m_cipher(cipher) {
+    uint8_t h[16] = {0};
+    m_cipher.encrypt_blocks(h, h, 1);
+    init_table(h);
+    m_ghash_backend = GHASHBackend::kTable;
+#if AES_HAVE_AESNI
+    if (cpu_has_pclmul()) {
+      init_pclmul(h);
+      m_ghash_backend = GHASHBackend::kPCLMUL;
+    }
+#endif
+    // Callers start() every message; this only leaves the state defined.
+    uint8_t iv[12] = {0};
+    start(iv, 12);
+  }
+
+  static bool cpu_has_pclmul() {
+#if AES_HAVE_AESNI
+    static const bool supported = [] {
+      unsigned int eax, ebx, ecx, edx;
+      return __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+             (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSSE3) != 0;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+  }
+
+  GHASHBackend ghash_backend() const { return m_ghash_backend; }
+
+  // Returns false, leaving the backend unchanged, if the CPU lacks PCLMULQDQ.
+  bool set_ghash_backend(GHASHBackend backend) {
+    if (backend == GHASHBackend::kPCLMUL && !cpu_has_pclmul()) return false;
+    m_ghash_backend = backend;
+    return true;
+  }
+
+  // Begins a message. A 12-byte IV is used directly as the counter prefix;
+  // any other length is hashed as in SP 800-38D. Returns false for an empty
+  // IV, and the message then fails at finish() or verify().
+  bool start(const uint8_t* iv, size_t iv_length) {
+    reset();
+    if (iv_length == 0) {
+      m_failed = true;
+      return false;
+    }
+    if (iv_length == 12) {
+      memcpy(m_j0, iv, 12);
+      m_j0[12] = m_j0[13] = m_j0[14] = 0;
+      m_j0[15] = 1;
+    } else {
+      absorb(iv, iv_length);
+      pad();
+      uint8_t lengths[16] = {0};
+      store_be64((uint64_t)iv_length * 8, lengths + 8);
+      ghash_blocks(lengths, 1);
+      memcpy(m_j0, m_ghash, 16);
+      memset(m_ghash, 0, 16);
+    }
+    memcpy(m_counter, m_j0, 16);
+    increment(m_counter);
+    return true;
+  }
+
+  // Adds associated data. All AAD must come before the first data update:
+  // a later call, one past kMaxAADBytes, or one on a failed message returns
+  // false and fails the message.
+  bool update_aad(const uint8_t* aad, size_t length) {
+    if (m_failed || m_aad_closed || length > kMaxAADBytes - m_aad_length) {
+      m_failed = true;
+      return false;
+    }
+    absorb(aad, length);
+    m_aad_length += length;
+    return true;
+  }
+
+  // Return false, processing nothing and failing the message, once the data
+  // would exceed kMaxDataBytes or after any earlier call failed it.
+  bool encrypt_update(const uint8_t* in, uint8_t* out, size_t length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMEncrypt, length);
+    return crypt(in, out, length, true);
+  }
+
+  bool decrypt_update(const uint8_t* in, uint8_t* out, size_t length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMDecrypt, length);
+    return crypt(in, out, length, false);
+  }
+
+#if AES_HAVE_IOVEC
+  // Scatter/gather forms of the updates. The lists may be split at
+  // different points (or be the same list). A block straddling a fragment
+  // boundary carries over as between update calls, and every run that is
+  // contiguous in both lists is encrypted and hashed chunk by chunk. The
+  // data updates return the bytes processed: the smaller total, or less if
+  // the message went past kMaxDataBytes.
+  bool update_aad(const struct iovec* aad, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      if (!update_aad((const uint8_t*)aad[i].iov_base, aad[i].iov_len)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t encrypt_update(const struct iovec* in, size_t in_count,
+                        const struct iovec* out, size_t out_count) {
+#if AES_INSTRUMENT
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMEncrypt,
+                    AESIovecCursor::total(in, in_count, out, out_count));
+#endif
+    return crypt(in, in_count, out, out_count, true);
+  }
+
+  size_t decrypt_update(const struct iovec* in, size_t in_count,
+                        const struct iovec* out, size_t out_count) {
+#if AES_INSTRUMENT
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMDecrypt,
+                    AESIovecCursor::total(in, in_count, out, out_count));
+#endif
+    return crypt(in, in_count, out, out_count, false);
+  }
+#endif
+
+  // Tag lengths SP 800-38D allows: 12 to 16 bytes, or 4 and 8 for
+  // specialised uses.
+  static bool valid_tag_length(size_t tag_length) {
+    return (tag_length >= 12 && tag_length <= 16) || tag_length == 8 ||
+           tag_length == 4;
+  }
+
+  // Completes the message and writes the first tag_length bytes of the tag.
+  // Returns false, writing nothing, if tag_length is not a valid length or
+  // an earlier call failed the message.
+  bool finish(uint8_t* tag, size_t tag_length) {
+    uint8_t mask[16];
+    tag_mask(mask);
+    return finish(mask, tag, tag_length);
+  }
+
+  // Completes the message and compares the tag in constant time. A tag of
+  // an invalid length, or of a failed message, never matches.
+  bool verify(const uint8_t* tag, size_t tag_length) {
+    uint8_t mask[16];
+    tag_mask(mask);
+    return verify(mask, tag, tag_length);
+  }
+
+  // Returns false, as finish() does, for an invalid tag length, an empty IV
+  // or over-long input.
+  bool encrypt(const uint8_t* iv, size_t iv_length, const uint8_t* aad,
+               size_t aad_length, const uint8_t* in, uint8_t* out,
+               size_t length, uint8_t* tag, size_t tag_length) {
+    start(iv, iv_length);
+    update_aad(aad, aad_length);
+    encrypt_update(in, out, length);
+    return finish(tag, tag_length);
+  }
+
+  // Decrypts into out and returns whether the tag matched. On failure the
+  // caller must discard out.
+  bool decrypt(const uint8_t* iv, size_t iv_length, const uint8_t* aad,
+               size_t aad_length, const uint8_t* in, uint8_t* out,
+               size_t length, const uint8_t* tag, size_t tag_length) {
+    start(iv, iv_length);
+    update_aad(aad, aad_length);
+    decrypt_update(in, out, length);
+    return verify(tag, tag_length);
+  }
+
+  // encrypt() and decrypt() with the cipher work done beforehand, as by
+  // AESGCMSession: mask is E(J0) and keystream holds length bytes of
+  // keystream from counter block J0 + 1 on. Only GHASH runs here.
+  bool encrypt_precomputed(const uint8_t mask[16], const uint8_t* keystream,
+                           const uint8_t* aad, size_t aad_length,
+                           const uint8_t* in, uint8_t* out, size_t length,
+                           uint8_t* tag, size_t tag_length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMEncrypt, length);
+    reset();
+    if (update_aad(aad, aad_length)) {
+      crypt_precomputed(keystream, in, out, length, true);
+    }
+    return finish(mask, tag, tag_length);
+  }
+
+  bool decrypt_precomputed(const uint8_t mask[16], const uint8_t* keystream,
+                           const uint8_t* aad, size_t aad_length,
+                           const uint8_t* in, uint8_t* out, size_t length,
+                           const uint8_t* tag, size_t tag_length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kGCMDecrypt, length);
+    reset();
+    if (update_aad(aad, aad_length)) {
+      crypt_precomputed(keystream, in, out, length, false);
+    }
+    return verify(mask, tag, tag_length);
+  }
+
+ private:
+  // Clears the per-message state other than the IV.
+  void reset() {
+    memset(m_ghash, 0, 16);
+    m_ghash_used = 0;
+    m_keystream_used = 16;
+    m_aad_length = 0;
+    m_data_length = 0;
+    m_aad_closed = false;
+    m_failed = false;
+  }
+
+  // E(J0), which the GHASH result is XORed with to give the tag.
+  void tag_mask(uint8_t mask[16]) {
+    memcpy(mask, m_j0, 16);
+    m_cipher.encrypt_blocks(mask, mask, 1);
+  }
+
+  bool finish(const uint8_t mask[16], uint8_t* tag, size_t tag_length) {
+    if (m_failed || !valid_tag_length(tag_length)) return false;
+    uint8_t full_tag[16];
+    compute_tag(mask, full_tag);
+    memcpy(tag, full_tag, tag_length);
+    return true;
+  }
+
+  bool verify(const uint8_t mask[16], const uint8_t* tag, size_t tag_length) {
+    if (m_failed || !valid_tag_length(tag_length)) return false;
+    uint8_t full_tag[16];
+    compute_tag(mask, full_tag);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < tag_length; i++) diff |= full_tag[i] ^ tag[i];
+    return diff == 0;
+  }
+
+  static uint64_t load_be64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 8 | p[i];
+    return value;
+  }
+
+  static void store_be64(uint64_t value, uint8_t* p) {
+    for (int i = 7; i >= 0; i--) {
+      p[i] = (uint8_t)value;
+      value >>= 8;
+    }
+  }
+
+  // GCM's inc32: only the last 32 bits of the counter block wrap.
+  static void increment(uint8_t counter[16]) {
+    for (int i = 15; i >= 12; i--) {
+      if (++counter[i] != 0) break;
+    }
+  }
+
+  // Shoup's 4-bit tables: m_hl/m_hh[i] hold the low and high halves of i*H,
+  // with the bits of i read in GCM's reflected order.
+  void init_table(const uint8_t h[16]) {
+    uint64_t vh = load_be64(h);
+    uint64_t vl = load_be64(h + 8);
+    m_hl[0] = m_hh[0] = 0;
+    m_hl[8] = vl;
+    m_hh[8] = vh;
+    for (int i = 4; i > 0; i >>= 1) {
+      uint64_t reduce = (vl & 1) * 0xE100000000000000ULL;
+      vl = (vh << 63) | (vl >> 1);
+      vh = (vh >> 1) ^ reduce;
+      m_hl[i] = vl;
+      m_hh[i] = vh;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+      for (int j = 1; j < i; j++) {
+        m_hh[i + j] = m_hh[i] ^ m_hh[j];
+        m_hl[i + j] = m_hl[i] ^ m_hl[j];
+      }
+    }
+  }
+
+  // x = x * H using the 4-bit tables, one nibble at a time from the end.
+  void table_multiply(uint8_t x[16]) const {
+    static const uint64_t kLast4[16] = {
+        0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+        0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0};
+    int low = x[15] & 0x0F;
+    uint64_t zh = m_hh[low];
+    uint64_t zl = m_hl[low];
+    for (int i = 15; i >= 0; i--) {
+      low = x[i] & 0x0F;
+      int high = x[i] >> 4;
+      if (i != 15) {
+        int rem = zl & 0x0F;
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (kLast4[rem] << 48);
+        zh ^= m_hh[low];
+        zl ^= m_hl[low];
+      }
+      int rem = zl & 0x0F;
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ (kLast4[rem] << 48);
+      zh ^= m_hh[high];
+      zl ^= m_hl[high];
+    }
+    store_be64(zh, x);
+    store_be64(zl, x + 8);
+  }
+
+#if AES_HAVE_AESNI
+  __attribute__((target("pclmul,ssse3"))) static __m128i byte_swap(
+      __m128i x) {
+    return _mm_shuffle_epi8(
+        x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  }
+
+  __attribute__((target("pclmul,ssse3"))) void init_pclmul(
+      const uint8_t h[16]) {
+    m_pclmul_h = byte_swap(_mm_loadu_si128((const __m128i*)h));
+  }
+
+  // Carry-less multiply of byte-swapped operands followed by reduction
+  // modulo x^128 + x^7 + x^2 + x + 1, after Intel's GCM white paper.
+  __attribute__((target("pclmul,ssse3"))) static __m128i pclmul_multiply(
+      __m128i a, __m128i b) {
+    __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // Shift the 256-bit product left by one to undo the bit reflection.
+    __m128i lo_carry = _mm_srli_epi32(lo, 31);
+    __m128i hi_carry = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross = _mm_srli_si128(lo_carry, 12);
+    hi_carry = _mm_slli_si128(hi_carry, 4);
+    lo_carry = _mm_slli_si128(lo_carry, 4);
+    lo = _mm_or_si128(lo, lo_carry);
+    hi = _mm_or_si128(hi, hi_carry);
+    hi = _mm_or_si128(hi, cross);
+
+    // Reduce.
+    __m128i a1 = _mm_slli_epi32(lo, 31);
+    __m128i a2 = _mm_slli_epi32(lo, 30);
+    __m128i a3 = _mm_slli_epi32(lo, 25);
+    a1 = _mm_xor_si128(_mm_xor_si128(a1, a2), a3);
+    __m128i spill = _mm_srli_si128(a1, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a1, 12));
+    __m128i b1 = _mm_srli_epi32(lo, 1);
+    __m128i b2 = _mm_srli_epi32(lo, 2);
+    __m128i b3 = _mm_srli_epi32(lo, 7);
+    b1 = _mm_xor_si128(_mm_xor_si128(b1, b2), _mm_xor_si128(b3, spill));
+    lo = _mm_xor_si128(lo, b1);
+    return _mm_xor_si128(hi, lo);
+  }
+
+  __attribute__((target("pclmul,ssse3"))) void pclmul_ghash_blocks(
+      const uint8_t* data, size_t nblocks) {
+    __m128i x = byte_swap(_mm_loadu_si128((const __m128i*)m_ghash));
+    for (size_t i = 0; i < nblocks; i++) {
+      __m128i block = byte_swap(_mm_loadu_si128((const __m128i*)data + i));
+      x = pclmul_multiply(_mm_xor_si128(x, block), m_pclmul_h);
+    }
+    _mm_storeu_si128((__m128i*)m_ghash, byte_swap(x));
+  }
+#endif
+
+  void ghash_blocks(const uint8_t* data, size_t nblocks) {
+#if AES_HAVE_AESNI
+    if (m_ghash_backend == GHASHBackend::kPCLMUL) {
+      pclmul_ghash_blocks(data, nblocks);
+      return;
+    }
+#endif
+    for (size_t i = 0; i < nblocks; i++, data += 16) {
+      AESBase::xor_block(m_ghash, data, m_ghash);
+      table_multiply(m_ghash);
+    }
+  }
+
+  // Feeds bytes into GHASH, buffering a partial trailing block.
+  void absorb(const uint8_t* data, size_t length) {
+    if (m_ghash_used > 0) {
+      while (length > 0 && m_ghash_used < 16) {
+        m_ghash_buffer[m_ghash_used++] = *data++;
+        length--;
+      }
+      if (m_ghash_used < 16) return;
+      ghash_blocks(m_ghash_buffer, 1);
+      m_ghash_used = 0;
+    }
+    size_t nblocks = length / 16;
+    if (nblocks > 0) ghash_blocks(data, nblocks);
+    length -= 16 * nblocks;
+    if (length > 0) memcpy(m_ghash_buffer, data + 16 * nblocks, length);
+    m_ghash_used = length;
+  }
+
+  // Zero-pads and hashes a buffered partial block.
+  void pad() {
+    if (m_ghash_used == 0) return;
+    memset(m_ghash_buffer + m_ghash_used, 0, 16 - m_ghash_used);
+    ghash_blocks(m_ghash_buffer, 1);
+    m_ghash_used = 0;
+  }
+
+#if AES_HAVE_IOVEC
+  size_t crypt(const struct iovec* in, size_t in_count,
+               const struct iovec* out, size_t out_count, bool encrypting) {
+    AESIovecCursor cursor(in, in_count, out, out_count);
+    const uint8_t* from;
+    uint8_t* to;
+    size_t total = 0;
+    while (size_t length = cursor.next(&from, &to)) {
+      if (!crypt(from, to, length, encrypting)) break;
+      total += length;
+    }
+    return total;
+  }
+#endif
+
+  bool crypt(const uint8_t* in, uint8_t* out, size_t length, bool encrypting) {
+    if (m_failed || length > kMaxDataBytes - m_data_length) {
+      m_failed = true;
+      return false;
+    }
+    if (!m_aad_closed) {
+      pad();
+      m_aad_closed = true;
+    }
+    m_data_length += length;
+
+    // Finish the block started by a previous call.
+    while (length > 0 && m_keystream_used < 16) {
+      uint8_t c = encrypting ? *in ^ m_keystream[m_keystream_used] : *in;
+      *out++ = *in++ ^ m_keystream[m_keystream_used++];
+      absorb(&c, 1);
+      length--;
+    }
+
+    uint8_t keystream[kChunkBlocks * 16];
+    while (length >= 16) {
+      size_t count = length / 16 < kChunkBlocks ? length / 16 : kChunkBlocks;
+      for (size_t i = 0; i < count; i++) {
+        memcpy(keystream + 16 * i, m_counter, 16);
+        increment(m_counter);
+      }
+      m_cipher.encrypt_blocks(keystream, keystream, count);
+      // Hash ciphertext: the input when decrypting (before it may be
+      // overwritten in place), the output when encrypting.
+      if (!encrypting) ghash_blocks(in, count);
+      for (size_t i = 0; i < 16 * count; i++) out[i] = in[i] ^ keystream[i];
+      if (encrypting) ghash_blocks(out, count);
+      in += 16 * count;
+      out += 16 * count;
+      length -= 16 * count;
+    }
+
+    if (length > 0) {
+      memcpy(m_keystream, m_counter, 16);
+      m_cipher.encrypt_blocks(m_keystream, m_keystream, 1);
+      increment(m_counter);
+      m_keystream_used = 0;
+      while (length > 0) {
+        uint8_t c = encrypting ? *in ^ m_keystream[m_keystream_used] : *in;
+        *out++ = *in++ ^ m_keystream[m_keystream_used++];
+        absorb(&c, 1);
+        length--;
+      }
+    }
+    return true;
+  }
+
+  // crypt() for a whole message whose keystream is already computed.
+  void crypt_precomputed(const uint8_t* keystream, const uint8_t* in,
+                         uint8_t* out, size_t length, bool encrypting) {
+    if (length > kMaxDataBytes) {
+      m_failed = true;
+      return;
+    }
+    pad();
+    m_aad_closed = true;
+    m_data_length = length;
+    while (length >= 16) {
+      size_t count = length / 16 < kChunkBlocks ? length / 16 : kChunkBlocks;
+      if (!encrypting) ghash_blocks(in, count);
+      for (size_t i = 0; i < 16 * count; i++) out[i] = in[i] ^ keystream[i];
+      if (encrypting) ghash_blocks(out, count);
+      in += 16 * count;
+      out += 16 * count;
+      keystream += 16 * count;
+      length -= 16 * count;
+    }
+    if (length > 0) {
+      uint8_t last[16] = {0};
+      for (size_t i = 0; i < length; i++) {
+        uint8_t byte = in[i];  // in may be out
+        out[i] = byte ^ keystream[i];
+        last[i] = encrypting ? out[i] : byte;
+      }
+      ghash_blocks(last, 1);
+    }
+  }
+
+  void compute_tag(const uint8_t mask[16], uint8_t tag[16]) {
+    pad();
+    uint8_t lengths[16];
+    store_be64((uint64_t)m_aad_length * 8, lengths);
+    store_be64((uint64_t)m_data_length * 8, lengths + 8);
+    ghash_blocks(lengths, 1);
+    for (int i = 0; i < 16; i++) tag[i] = mask[i] ^ m_ghash[i];
+  }
+
+  AESBase& m_cipher;
+  GHASHBackend m_ghash_backend;
+  uint64_t m_hl[16];
+  uint64_t m_hh[16];
+#if AES_HAVE_AESNI
+  __m128i m_pclmul_h;
+#endif
+  uint8_t m_j0[16];
+  uint8_t m_counter[16];
+  uint8_t m_keystream[16];
+  size_t m_keystream_used;
+  uint8_t m_ghash[16];
+  uint8_t m_ghash_buffer[16];
+  size_t m_ghash_used;
+  uint64_t m_aad_length;
+  uint64_t m_data_length;
+  bool m_aad_closed;
+  // Set by a rejected IV, AAD or data update until the next message.
+  bool m_failed;
+};
+
+#endif
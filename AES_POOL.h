@@ -0,0 +1,287 @@
+/*
+ * AES Work-Stealing Thread Pool
+ *
+ * A fixed set of worker threads shared by every bulk cipher job, so that
+ * several jobs running at once divide the cores between them instead of each
+ * starting its own threads. A job is a count of independent chunks (about
+ * kChunkBytes of data each) and a function to run on one chunk.
+ *
+ * The chunks of a job are dealt out as contiguous slices, one per
+ * participant: the calling thread always takes the first and the rest are
+ * queued for idle workers. A participant works through its own slice from
+ * the front and, once it is empty, steals chunks from the back of the
+ * fullest remaining slice, so a participant that started late or ran slowly
+ * is relieved by the others. A slice that no worker picks up in time is
+ * simply stolen in full, and the caller never waits for an idle pool.
+ *
+ * Ciphers are shared by reference: encrypt_blocks/decrypt_blocks only read
+ * the expanded key schedule, so every participant uses the same copy.
+ */
+
+#ifndef AES_POOL_H_
+#define AES_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "AES.h"
+
+class AESThreadPool {
+ public:
+  // Data per chunk: small enough for a chunk's input, output and keystream
+  // to stay in L2 while it is processed.
+  static const size_t kChunkBytes = 64 * 1024;
+
+  // Starts workers threads (one less than the hardware concurrency by
+  // default, since callers work too). If cpus is not empty, worker i is
+  // pinned to cpus[i % cpus.size()] where the platform supports it.
+  explicit AESThreadPool(unsigned int workers = default_workers(),
+                         const std::vector<int>& cpus = std::vector<int>())
+      : m_stopping(false) {
+    for (unsigned int i = 0; i < workers; i++) {
+      m_workers.emplace_back([this] { work(); });
+      if (!cpus.empty()) pin(m_workers.back(), cpus[i % cpus.size()]);
+    }
+  }
+
+  AESThreadPool(const AESThreadPool&) = delete;
+  AESThreadPool& operator=(const AESThreadPool&) = delete;
+
+  ~AESThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_ready.notify_all();
+    for (std::thread& worker : m_workers) worker.join();
+  }
+
+  // The process-wide pool that the modes use unless given another one.
+  static AESThreadPool& shared() {
+    static AESThreadPool pool;
+    return pool;
+  }
+
+  static unsigned int default_workers() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+  }
+
+  unsigned int workers() const { return (unsigned int)m_workers.size(); }
+
+  // Calls fn(i) for every i in [0, chunks), on at most parallelism threads
+  // including the caller, and returns when all calls have finished.
+  // parallelism 0 means the caller plus every worker.
+  void run(size_t chunks, unsigned int parallelism,
+           const std::function<void(size_t)>& fn) {
+    size_t participants = m_workers.size() + 1;
+    if (parallelism != 0 && parallelism < participants) {
+      participants = parallelism;
+    }
+    if (participants > chunks) participants = chunks;
+    if (participants <= 1) {
+      for (size_t i = 0; i < chunks; i++) fn(i);
+      return;
+    }
+
+    Job job(fn, chunks, participants);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (size_t slice = 1; slice < participants; slice++) {
+        m_tasks.push_back(Task{&job, slice});
+      }
+    }
+    if (participants == 2) {
+      m_ready.notify_one();
+    } else {
+      m_ready.notify_all();
+    }
+
+    participate(job, 0);
+    {
+      std::unique_lock<std::mutex> lock(job.mutex);
+      job.finished.wait(lock, [&job] {
+        return job.done.load(std::memory_order_acquire) == job.chunks;
+      });
+    }
+
+    // Tasks still queued would point at job after it goes out of scope.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (std::deque<Task>::iterator it = m_tasks.begin();
+         it != m_tasks.end();) {
+      it = it->job == &job ? m_tasks.erase(it) : it + 1;
+    }
+    m_idle.wait(lock, [&job] { return job.running == 0; });
+  }
+
+  // ECB over a pool: every chunk of blocks is independent.
+  void encrypt_blocks(AESBase& cipher, const uint8_t* in, uint8_t* out,
+                      size_t nblocks, unsigned int parallelism = 0) {
+    const size_t per_chunk = kChunkBytes / 16;
+    run((nblocks + per_chunk - 1) / per_chunk, parallelism,
+        [&cipher, in, out, nblocks, per_chunk](size_t i) {
+          size_t start = i * per_chunk;
+          size_t count = nblocks - start < per_chunk ? nblocks - start
+                                                     : per_chunk;
+          cipher.encrypt_blocks(in + 16 * start, out + 16 * start, count);
+        });
+  }
+
+  void decrypt_blocks(AESBase& cipher, const uint8_t* in, uint8_t* out,
+                      size_t nblocks, unsigned int parallelism = 0) {
+    const size_t per_chunk = kChunkBytes / 16;
+    run((nblocks + per_chunk - 1) / per_chunk, parallelism,
+        [&cipher, in, out, nblocks, per_chunk](size_t i) {
+          size_t start = i * per_chunk;
+          size_t count = nblocks - start < per_chunk ? nblocks - start
+                                                     : per_chunk;
+          cipher.decrypt_blocks(in + 16 * start, out + 16 * start, count);
+        });
+  }
+
+ private:
+  // A slice of chunk indices [begin, end), packed into one word so that its
+  // owner (taking from the front) and thieves (taking from the back) agree
+  // through a single compare-and-swap.
+  struct Slice {
+    std::atomic<uint64_t> range;
+    // Keeps participants' slices on separate cache lines.
+    unsigned char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  struct Job {
+    Job(const std::function<void(size_t)>& fn, size_t chunks,
+        size_t participants)
+        : fn(fn),
+          chunks(chunks),
+          slice_count(participants),
+          slices(new Slice[participants]),
+          done(0),
+          running(0) {
+      for (size_t i = 0; i < participants; i++) {
+        uint64_t begin = chunks * i / participants;
+        uint64_t end = chunks * (i + 1) / participants;
+        slices[i].range.store(begin << 32 | end, std::memory_order_relaxed);
+      }
+    }
+
+    const std::function<void(size_t)>& fn;
+    size_t chunks;
+    size_t slice_count;
+    std::unique_ptr<Slice[]> slices;
+    std::atomic<size_t> done;
+    // Workers inside participate(); guarded by the pool's mutex.
+    size_t running;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  struct Task {
+    Job* job;
+    size_t slice;
+  };
+
+  static bool take_front(Slice& slice, size_t* chunk) {
+    uint64_t range = slice.range.load(std::memory_order_relaxed);
+    for (;;) {
+      uint64_t begin = range >> 32, end = range & 0xFFFFFFFF;
+      if (begin >= end) return false;
+      if (slice.range.compare_exchange_weak(range, (begin + 1) << 32 | end,
+                                            std::memory_order_relaxed)) {
+        *chunk = (size_t)begin;
+        return true;
+      }
+    }
+  }
+
+  static bool take_back(Slice& slice, size_t* chunk) {
+    uint64_t range = slice.range.load(std::memory_order_relaxed);
+    for (;;) {
+      uint64_t begin = range >> 32, end = range & 0xFFFFFFFF;
+      if (begin >= end) return false;
+      if (slice.range.compare_exchange_weak(range, begin << 32 | (end - 1),
+                                            std::memory_order_relaxed)) {
+        *chunk = (size_t)(end - 1);
+        return true;
+      }
+    }
+  }
+
+  // Picks the slice with the most chunks left and steals its last one.
+  static bool steal(Job& job, size_t* chunk) {
+    for (;;) {
+      size_t victim = job.slice_count;
+      uint64_t most = 0;
+      for (size_t i = 0; i < job.slice_count; i++) {
+        uint64_t range = job.slices[i].range.load(std::memory_order_relaxed);
+        uint64_t begin = range >> 32, end = range & 0xFFFFFFFF;
+        if (end > begin && end - begin > most) {
+          most = end - begin;
+          victim = i;
+        }
+      }
+      if (victim == job.slice_count) return false;
+      if (take_back(job.slices[victim], chunk)) return true;
+    }
+  }
+
+  static void participate(Job& job, size_t slice) {
+    size_t chunk;
+    while (take_front(job.slices[slice], &chunk) || steal(job, &chunk)) {
+      job.fn(chunk);
+      if (job.done.fetch_add(1, std::memory_order_acq_rel) + 1 == job.chunks) {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.finished.notify_all();
+      }
+    }
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      m_ready.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+      if (m_tasks.empty()) return;
+      Task task = m_tasks.front();
+      m_tasks.pop_front();
+      task.job->running++;
+      lock.unlock();
+      participate(*task.job, task.slice);
+      lock.lock();
+      if (--task.job->running == 0) m_idle.notify_all();
+    }
+  }
+
+  static void pin(std::thread& thread, int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+  }
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_idle;
+  std::deque<Task> m_tasks;
+  bool m_stopping;
+};
+
+#endif
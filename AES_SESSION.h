@@ -0,0 +1,369 @@
+/*
+ * AES Keystream Look-Ahead Sessions
+ *
+ * CTR keystream does not depend on the data, so for streams of small,
+ * latency-sensitive packets it can be computed before the packets arrive.
+ * AESKeystreamRing runs a worker thread that keeps a ring of keystream slots
+ * filled ahead of the reader. The ring is single-producer single-consumer
+ * and lock-free on the reader's side: slots are handed over through two
+ * atomic indices, and the worker only sleeps (on a condition variable) when
+ * the ring is full, to be woken once half of it has been used.
+ *
+ * AESCTRSession produces the same stream as AESCTR, and AESGCMSession seals
+ * numbered packets under nonces derived from one IV. Processing a packet is
+ * then an XOR against precomputed bytes (plus GHASH for GCM). When the
+ * reader outruns the worker, the missing keystream is generated inline, so
+ * results never depend on timing. stats() counts how often that happens,
+ * which is what the look-ahead should be sized by.
+ *
+ * The worker encrypts with the session's cipher concurrently with the
+ * session's own fallback; encrypt_blocks only reads the key schedule. A
+ * session is used by one thread at a time.
+ */
+
+#ifndef AES_SESSION_H_
+#define AES_SESSION_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "AES.h"
+#include "AES_CTR.h"
+#include "AES_GCM.h"
+
+class AESKeystreamRing {
+ public:
+  // Writes the keystream of slot index; runs on the worker thread.
+  typedef std::function<void(uint64_t index, uint8_t* slot)> Fill;
+
+  // Keeps up to slots slots of slot_bytes each filled ahead of the reader,
+  // once start() is called. With no slots there is no worker, and every
+  // peek() misses.
+  AESKeystreamRing(size_t slot_bytes, size_t slots, Fill fill)
+      : m_slot_bytes(slot_bytes),
+        m_slots(slots),
+        m_storage(slot_bytes * slots),
+        m_fill(fill),
+        m_produced(0),
+        m_released(0),
+        m_waiting(false),
+        m_wake_at(0),
+        m_stopping(false) {}
+
+  AESKeystreamRing(const AESKeystreamRing&) = delete;
+  AESKeystreamRing& operator=(const AESKeystreamRing&) = delete;
+
+  ~AESKeystreamRing() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping.store(true, std::memory_order_relaxed);
+    }
+    m_wake.notify_one();
+    if (m_worker.joinable()) m_worker.join();
+    AESBase::wipe(m_storage.data(), m_storage.size());
+  }
+
+  // Starts the worker, once everything the fill function reads is set up.
+  void start() {
+    if (m_slots > 0 && !m_worker.joinable()) {
+      m_worker = std::thread([this] { work(); });
+    }
+  }
+
+  size_t slot_bytes() const { return m_slot_bytes; }
+  size_t slots() const { return m_slots; }
+
+  // The keystream of slot index if the worker has produced it, otherwise
+  // nullptr. index must be at least the last value passed to release(), and
+  // the slot stays valid until release() moves past it.
+  const uint8_t* peek(uint64_t index) const {
+    if (m_produced.load(std::memory_order_acquire) <= index) return nullptr;
+    return m_storage.data() + (index % m_slots) * m_slot_bytes;
+  }
+
+  // Hands every slot before index back to the worker; index never goes
+  // down. The worker skips slots the reader has passed without using.
+  void release(uint64_t index) {
+    m_released.store(index, std::memory_order_seq_cst);
+    if (m_waiting.load(std::memory_order_seq_cst) &&
+        index >= m_wake_at.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_wake.notify_one();
+    }
+  }
+
+  // Waits until every slot ahead of the reader is filled, e.g. before the
+  // first packet of a session.
+  void wait_full() const {
+    if (m_slots == 0) return;
+    while (m_produced.load(std::memory_order_acquire) <
+           m_released.load(std::memory_order_relaxed) + m_slots) {
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  void work() {
+    uint64_t next = 0;
+    for (;;) {
+      uint64_t released = m_released.load(std::memory_order_seq_cst);
+      if (next < released) next = released;
+      if (next >= released + m_slots) {
+        // Full: sleep until the reader has freed half of the ring. Setting
+        // m_waiting before the second look at m_released pairs with
+        // release() storing before it reads m_waiting, so a wakeup cannot
+        // fall between them.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake_at.store(next - m_slots + (m_slots + 1) / 2,
+                        std::memory_order_relaxed);
+        m_waiting.store(true, std::memory_order_seq_cst);
+        while (!m_stopping.load(std::memory_order_relaxed) &&
+               m_released.load(std::memory_order_seq_cst) + m_slots <=
+                   next) {
+          m_wake.wait(lock);
+        }
+        m_waiting.store(false, std::memory_order_relaxed);
+        if (m_stopping.load(std::memory_order_relaxed)) return;
+        continue;
+      }
+      m_fill(next, m_storage.data() + (next % m_slots) * m_slot_bytes);
+      m_produced.store(next + 1, std::memory_order_release);
+      next++;
+      if (m_stopping.load(std::memory_order_relaxed)) return;
+    }
+  }
+
+  const size_t m_slot_bytes;
+  const size_t m_slots;
+  std::vector<uint8_t> m_storage;
+  Fill m_fill;
+  // Written by the worker and by the reader respectively; kept on separate
+  // cache lines so that neither side's stores slow the other's loads.
+  alignas(64) std::atomic<uint64_t> m_produced;
+  alignas(64) std::atomic<uint64_t> m_released;
+  std::atomic<bool> m_waiting;
+  std::atomic<uint64_t> m_wake_at;
+  std::atomic<bool> m_stopping;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::thread m_worker;
+};
+
+// How a session's data was served. fallback_calls counts the calls in which
+// any keystream had to be generated inline.
+struct AESSessionStats {
+  uint64_t calls = 0;
+  uint64_t bytes = 0;
+  uint64_t fallback_calls = 0;
+  uint64_t fallback_bytes = 0;
+};
+
+// CTR with the keystream computed ahead of use: the output equals AESCTR's
+// for the same cipher and counter.
+class AESCTRSession {
+ public:
+  static const size_t kSlotBlocks = AESCTR::kChunkBlocks;
+  static const size_t kSlotBytes = 16 * kSlotBlocks;
+  static const size_t kDefaultLookahead = 64 * 1024;
+
+  // The cipher is borrowed, not copied, and must outlive this object.
+  // lookahead bytes (rounded up to whole slots) are kept ready.
+  AESCTRSession(AESBase& cipher, const uint8_t counter[16],
+                size_t lookahead = kDefaultLookahead)
+      : m_cipher(cipher),
+        m_position(0),
+        m_ring(kSlotBytes, (lookahead + kSlotBytes - 1) / kSlotBytes,
+               [this](uint64_t index, uint8_t* slot) {
+                 uint8_t start[16];
+                 slot_counter(index, 0, start);
+                 AESCTR::keystream(m_cipher, start, slot, kSlotBlocks);
+               }) {
+    memcpy(m_counter, counter, 16);
+    m_ring.start();
+  }
+
+  // Encrypts or decrypts length bytes, continuing the stream.
+  void process(const uint8_t* in, uint8_t* out, size_t length) {
+    AES_STATS_SCOPE(m_cipher.key_bits(), AESOperation::kCTR, length);
+    m_stats.calls++;
+    m_stats.bytes += length;
+    bool fallback = false;
+    while (length > 0) {
+      uint64_t index = m_position / kSlotBytes;
+      size_t offset = m_position % kSlotBytes;
+      size_t count = kSlotBytes - offset < length ? kSlotBytes - offset
+                                                  : length;
+      if (offset == 0) m_ring.release(index);
+      const uint8_t* slot = m_ring.peek(index);
+      if (slot != nullptr) {
+        AESCTR::xor_bytes(in, slot + offset, out, count);
+      } else {
+        // Only the blocks this call touches.
+        size_t first = offset / 16;
+        size_t end = (offset + count + 15) / 16;
+        uint8_t start[16];
+        uint8_t keystream[kSlotBytes];
+        slot_counter(index, first, start);
+        AESCTR::keystream(m_cipher, start, keystream, end - first);
+        AESCTR::xor_bytes(in, keystream + offset % 16, out, count);
+        AESBase::wipe(keystream, 16 * (end - first));
+        m_stats.fallback_bytes += count;
+        fallback = true;
+      }
+      m_position += count;
+      in += count;
+      out += count;
+      length -= count;
+    }
+    if (fallback) m_stats.fallback_calls++;
+  }
+
+  // Waits until the whole look-ahead is filled.
+  void prime() const { m_ring.wait_full(); }
+
+  const AESSessionStats& stats() const { return m_stats; }
+
+ private:
+  // The counter of block block within slot index.
+  void slot_counter(uint64_t index, size_t block, uint8_t out[16]) const {
+    memcpy(out, m_counter, 16);
+    AESCTR::add_counter(out, index * kSlotBlocks + block);
+  }
+
+  AESBase& m_cipher;
+  uint8_t m_counter[16];
+  uint64_t m_position;
+  AESSessionStats m_stats;
+  // Last, so that the worker stops before the rest is destroyed.
+  AESKeystreamRing m_ring;
+};
+
+// AES-GCM over a sequence of packets, each with its own nonce: the 12-byte
+// IV with the packet's 64-bit sequence number XORed into its last 8 bytes,
+// as in TLS 1.3. Every slot holds E(J0) and the keystream of one packet of
+// up to max_packet bytes; longer packets are processed inline.
+class AESGCMSession {
+ public:
+  static const size_t kDefaultMaxPacket = 1500;
+  static const size_t kDefaultLookahead = 64;
+
+  // The cipher is borrowed, not copied, and must outlive this object.
+  // lookahead packets are kept ready.
+  AESGCMSession(AESBase& cipher, const uint8_t iv[12],
+                size_t max_packet = kDefaultMaxPacket,
+                size_t lookahead = kDefaultLookahead)
+      : m_cipher(cipher),
+        m_gcm(cipher),
+        m_max_packet(max_packet),
+        m_sequence(0),
+        m_ring(16 + (max_packet + 15) / 16 * 16, lookahead,
+               [this](uint64_t sequence, uint8_t* slot) {
+                 size_t nblocks = 1 + (m_max_packet + 15) / 16;
+                 uint8_t j0[16];
+                 nonce(sequence, j0);
+                 for (size_t i = 0; i < nblocks; i++) {
+                   memcpy(slot + 16 * i, j0, 12);
+                   store_be32((uint32_t)(i + 1), slot + 16 * i + 12);
+                 }
+                 m_cipher.encrypt_blocks(slot, slot, nblocks);
+               }) {
+    memcpy(m_iv, iv, 12);
+    m_ring.start();
+  }
+
+  // Seals the next packet and writes its tag_length-byte tag. Returns
+  // false, using no sequence number, if tag_length is not a valid GCM tag
+  // length, and false after using one for data past AESGCM::kMaxDataBytes.
+  bool seal(const uint8_t* aad, size_t aad_length, const uint8_t* in,
+            uint8_t* out, size_t length, uint8_t* tag, size_t tag_length) {
+    if (!AESGCM::valid_tag_length(tag_length)) return false;
+    const uint8_t* slot = next_slot(length);
+    bool sealed;
+    if (slot != nullptr) {
+      sealed = m_gcm.encrypt_precomputed(slot, slot + 16, aad, aad_length, in,
+                                         out, length, tag, tag_length);
+    } else {
+      uint8_t iv[12];
+      nonce(m_sequence, iv);
+      sealed = m_gcm.encrypt(iv, 12, aad, aad_length, in, out, length, tag,
+                             tag_length);
+    }
+    m_sequence++;
+    return sealed;
+  }
+
+  // Opens the next packet. On a tag mismatch, or a tag of an invalid
+  // length, it returns false, the caller must discard out, and the sequence
+  // still advances.
+  bool open(const uint8_t* aad, size_t aad_length, const uint8_t* in,
+            uint8_t* out, size_t length, const uint8_t* tag,
+            size_t tag_length) {
+    const uint8_t* slot = next_slot(length);
+    bool valid;
+    if (slot != nullptr) {
+      valid = m_gcm.decrypt_precomputed(slot, slot + 16, aad, aad_length, in,
+                                        out, length, tag, tag_length);
+    } else {
+      uint8_t iv[12];
+      nonce(m_sequence, iv);
+      valid = m_gcm.decrypt(iv, 12, aad, aad_length, in, out, length, tag,
+                            tag_length);
+    }
+    m_sequence++;
+    return valid;
+  }
+
+  // The sequence number of the next packet.
+  uint64_t sequence() const { return m_sequence; }
+
+  // Writes the nonce of packet sequence.
+  void nonce(uint64_t sequence, uint8_t out[12]) const {
+    memcpy(out, m_iv, 12);
+    for (int i = 11; i >= 4; i--, sequence >>= 8) out[i] ^= (uint8_t)sequence;
+  }
+
+  // Waits until the whole look-ahead is filled.
+  void prime() const { m_ring.wait_full(); }
+
+  const AESSessionStats& stats() const { return m_stats; }
+
+ private:
+  static void store_be32(uint32_t value, uint8_t* p) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+  }
+
+  // The slot of the current packet, or nullptr to process it inline.
+  const uint8_t* next_slot(size_t length) {
+    m_stats.calls++;
+    m_stats.bytes += length;
+    m_ring.release(m_sequence);
+    const uint8_t* slot =
+        length <= m_max_packet ? m_ring.peek(m_sequence) : nullptr;
+    if (slot == nullptr) {
+      m_stats.fallback_calls++;
+      m_stats.fallback_bytes += length;
+    }
+    return slot;
+  }
+
+  AESBase& m_cipher;
+  AESGCM m_gcm;
+  const size_t m_max_packet;
+  uint8_t m_iv[12];
+  uint64_t m_sequence;
+  AESSessionStats m_stats;
+  // Last, so that the worker stops before the rest is destroyed.
+  AESKeystreamRing m_ring;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * AES Instrumentation
+ *
+ * Optional counters for the cipher hot paths, compiled in only when
+ * AES_INSTRUMENT is defined to 1. Every key expansion, block call and mode
+ * call records its call count, bytes, 16-byte blocks and elapsed time per
+ * key size, block calls also record which round engine ran them, and each
+ * call's latency goes into a log2 histogram per operation.
+ *
+ * Each thread writes only to its own slot, so recording takes no lock and no
+ * atomic read-modify-write; the slot's fields are atomics only so that
+ * snapshot() can read them from another thread while they are updated. Slots
+ * are registered once per thread and reused after the thread exits, so the
+ * totals survive short-lived threads. All counters only grow.
+ *
+ * Mode calls (CTR, CBC, GCM, XTS, CMAC) include the block calls they make,
+ * which are also counted under encrypt-blocks/decrypt-blocks.
+ *
+ * Without AES_INSTRUMENT the AES_STATS_* macros expand to nothing and none
+ * of this is compiled into the cipher code.
+ */
+
+#ifndef AES_STATS_H_
+#define AES_STATS_H_
+
+#ifndef AES_INSTRUMENT
+#define AES_INSTRUMENT 0
+#endif
+
+#include <cstddef>
+#include <cstdint>
+
+enum class AESOperation {
+  kKeySetup,
+  kEncryptBlocks,
+  kDecryptBlocks,
+  kCTR,
+  kCBCEncrypt,
+  kCBCDecrypt,
+  kGCMEncrypt,
+  kGCMDecrypt,
+  kXTSEncrypt,
+  kXTSDecrypt,
+  kCMAC,
+};
+
+#if AES_INSTRUMENT
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class AESStats {
+ public:
+  static const int kOperations = 11;
+  // Key sizes 128, 192 and 256 bits.
+  static const int kKeySizes = 3;
+  // Indexed by AESBackend.
+  static const int kBackends = 3;
+  // Bucket i holds latencies in [2^i, 2^(i+1)) ns; bucket 0 also holds 0.
+  static const int kBuckets = 40;
+
+  struct Counter {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t ns;
+  };
+
+  struct Snapshot {
+    Counter operations[kKeySizes][kOperations];
+    uint64_t backend_blocks[kKeySizes][kBackends];
+    uint64_t latency[kOperations][kBuckets];
+
+    // Upper bound in ns of the bucket holding quantile q (0 to 1) of the
+    // operation's calls, or 0 if there were none.
+    uint64_t latency_quantile(AESOperation operation, double q) const {
+      const uint64_t* buckets = latency[(int)operation];
+      uint64_t total = 0;
+      for (int i = 0; i < kBuckets; i++) total += buckets[i];
+      if (total == 0) return 0;
+      uint64_t rank = (uint64_t)(q * (total - 1));
+      for (int i = 0; i < kBuckets; i++) {
+        if (rank < buckets[i]) return uint64_t(2) << i;
+        rank -= buckets[i];
+      }
+      return uint64_t(2) << (kBuckets - 1);
+    }
+  };
+
+  static const char* operation_name(AESOperation operation) {
+    static const char* const names[kOperations] = {
+        "key-setup",   "encrypt-blocks", "decrypt-blocks", "ctr",
+        "cbc-encrypt", "cbc-decrypt",    "gcm-encrypt",    "gcm-decrypt",
+        "xts-encrypt", "xts-decrypt",    "cmac"};
+    return names[(int)operation];
+  }
+
+  static int key_size_index(int key_bits) {
+    return key_bits <= 128 ? 0 : key_bits <= 192 ? 1 : 2;
+  }
+
+  static void record(int key_bits, AESOperation operation, uint64_t bytes,
+                     uint64_t ns) {
+    Slot& slot = this_thread_slot();
+    Cell& cell = slot.operations[key_size_index(key_bits)][(int)operation];
+    bump(cell.calls, 1);
+    bump(cell.bytes, bytes);
+    bump(cell.blocks, (bytes + 15) / 16);
+    bump(cell.ns, ns);
+    bump(slot.latency[(int)operation][bucket_of(ns)], 1);
+  }
+
+  static void record_backend(int key_bits, int backend, uint64_t nblocks) {
+    bump(this_thread_slot().backend_blocks[key_size_index(key_bits)][backend],
+         nblocks);
+  }
+
+  // Sums every thread's counters. Counters are read one by one while other
+  // threads may be recording, so related values can be off by the calls in
+  // flight.
+  static Snapshot snapshot() {
+    Snapshot snapshot = Snapshot();
+    Registry& registry = registry_instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const std::unique_ptr<Slot>& slot : registry.slots) {
+      for (int k = 0; k < kKeySizes; k++) {
+        for (int o = 0; o < kOperations; o++) {
+          const Cell& cell = slot->operations[k][o];
+          Counter& total = snapshot.operations[k][o];
+          total.calls += cell.calls.load(std::memory_order_relaxed);
+          total.bytes += cell.bytes.load(std::memory_order_relaxed);
+          total.blocks += cell.blocks.load(std::memory_order_relaxed);
+          total.ns += cell.ns.load(std::memory_order_relaxed);
+        }
+        for (int b = 0; b < kBackends; b++) {
+          snapshot.backend_blocks[k][b] +=
+              slot->backend_blocks[k][b].load(std::memory_order_relaxed);
+        }
+      }
+      for (int o = 0; o < kOperations; o++) {
+        for (int i = 0; i < kBuckets; i++) {
+          snapshot.latency[o][i] +=
+              slot->latency[o][i].load(std::memory_order_relaxed);
+        }
+      }
+    }
+    return snapshot;
+  }
+
+  // The snapshot in the Prometheus text exposition format.
+  static std::string export_text() {
+    static const char* const backends[kBackends] = {"ttable", "aesni",
+                                                    "bitsliced"};
+    static const int key_bits[kKeySizes] = {128, 192, 256};
+    Snapshot snapshot = AESStats::snapshot();
+    std::string text;
+    char line[160];
+    const char* const fields[4] = {"calls", "bytes", "blocks", "ns"};
+    for (int f = 0; f < 4; f++) {
+      snprintf(line, sizeof(line), "# TYPE aes_%s_total counter\n",
+               fields[f]);
+      text += line;
+      for (int k = 0; k < kKeySizes; k++) {
+        for (int o = 0; o < kOperations; o++) {
+          const Counter& counter = snapshot.operations[k][o];
+          const uint64_t values[4] = {counter.calls, counter.bytes,
+                                      counter.blocks, counter.ns};
+          snprintf(line, sizeof(line),
+                   "aes_%s_total{key_bits=\"%d\",operation=\"%s\"} %llu\n",
+                   fields[f], key_bits[k], operation_name((AESOperation)o),
+                   (unsigned long long)values[f]);
+          text += line;
+        }
+      }
+    }
+    text += "# TYPE aes_backend_blocks_total counter\n";
+    for (int k = 0; k < kKeySizes; k++) {
+      for (int b = 0; b < kBackends; b++) {
+        snprintf(line, sizeof(line),
+                 "aes_backend_blocks_total{key_bits=\"%d\",backend=\"%s\"} "
+                 "%llu\n",
+                 key_bits[k], backends[b],
+                 (unsigned long long)snapshot.backend_blocks[k][b]);
+        text += line;
+      }
+    }
+    text += "# TYPE aes_latency_ns histogram\n";
+    for (int o = 0; o < kOperations; o++) {
+      uint64_t cumulative = 0;
+      for (int i = 0; i < kBuckets; i++) {
+        cumulative += snapshot.latency[o][i];
+        snprintf(line, sizeof(line),
+                 "aes_latency_ns_bucket{operation=\"%s\",le=\"%llu\"} %llu\n",
+                 operation_name((AESOperation)o),
+                 (unsigned long long)(uint64_t(2) << i) - 1,
+                 (unsigned long long)cumulative);
+        text += line;
+      }
+      // Every recorded latency is also added to its key size's ns counter.
+      uint64_t sum = 0;
+      for (int k = 0; k < kKeySizes; k++) sum += snapshot.operations[k][o].ns;
+      snprintf(line, sizeof(line),
+               "aes_latency_ns_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n"
+               "aes_latency_ns_sum{operation=\"%s\"} %llu\n"
+               "aes_latency_ns_count{operation=\"%s\"} %llu\n",
+               operation_name((AESOperation)o), (unsigned long long)cumulative,
+               operation_name((AESOperation)o), (unsigned long long)sum,
+               operation_name((AESOperation)o),
+               (unsigned long long)cumulative);
+      text += line;
+    }
+    return text;
+  }
+
+  // Times one call from construction to destruction.
+  class Scope {
+   public:
+    Scope(int key_bits, AESOperation operation, uint64_t bytes)
+        : m_key_bits(key_bits),
+          m_operation(operation),
+          m_bytes(bytes),
+          m_start(std::chrono::steady_clock::now()) {}
+
+    ~Scope() {
+      uint64_t ns = (uint64_t)std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - m_start)
+                        .count();
+      record(m_key_bits, m_operation, m_bytes, ns);
+    }
+
+   private:
+    int m_key_bits;
+    AESOperation m_operation;
+    uint64_t m_bytes;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+ private:
+  struct Cell {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> ns{0};
+  };
+
+  struct Slot {
+    Cell operations[kKeySizes][kOperations];
+    std::atomic<uint64_t> backend_blocks[kKeySizes][kBackends] = {};
+    std::atomic<uint64_t> latency[kOperations][kBuckets] = {};
+    bool in_use = true;
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Slot>> slots;
+  };
+
+  // Releases the thread's slot for reuse when the thread exits.
+  struct Owner {
+    Slot* slot;
+    ~Owner() {
+      Registry& registry = registry_instance();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      slot->in_use = false;
+    }
+  };
+
+  // Only the owning thread writes a counter, so a plain load and store is
+  // enough.
+  static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+
+  static int bucket_of(uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < kBuckets - 1) {
+      ns >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  // Never destroyed, so threads that exit during static destruction can
+  // still release their slots.
+  static Registry& registry_instance() {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  static Slot& this_thread_slot() {
+    thread_local Owner owner{acquire_slot()};
+    return *owner.slot;
+  }
+
+  static Slot* acquire_slot() {
+    Registry& registry = registry_instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const std::unique_ptr<Slot>& slot : registry.slots) {
+      if (!slot->in_use) {
+        slot->in_use = true;
+        return slot.get();
+      }
+    }
+    registry.slots.emplace_back(new Slot());
+    return registry.slots.back().get();
+  }
+};
+
+#define AES_STATS_CONCAT_(a, b) a##b
+#define AES_STATS_NAME_(line) AES_STATS_CONCAT_(aes_stats_scope_, line)
+// Times the rest of the enclosing block as one call.
+#define AES_STATS_SCOPE(key_bits, operation, bytes) \
+  AESStats::Scope AES_STATS_NAME_(__LINE__)((key_bits), (operation), (bytes))
+#define AES_STATS_BACKEND(key_bits, backend, nblocks) \
+  AESStats::record_backend((key_bits), (int)(backend), (nblocks))
+
+#else
+
+#define AES_STATS_SCOPE(key_bits, operation, bytes)
+#define AES_STATS_BACKEND(key_bits, backend, nblocks)
+
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * AES XTS Mode
+ *
+ * XTS-AES as specified in IEEE 1619 (NIST SP 800-38E) for sector-level
+ * storage encryption, on top of two AESBase ciphers: the data key and the
+ * tweak key. Every data unit (sector) has its own tweak, the encrypted
+ * little-endian sector number, which is multiplied by alpha in GF(2^128)
+ * for each successive block. Data units that are not a multiple of 16 bytes
+ * use ciphertext stealing.
+ *
+ * Blocks within a data unit do not depend on each other once their tweaks
+ * are known, so each unit is processed in chunks: the tweaks are generated,
+ * XORed in, the whole chunk goes through one encrypt_blocks call and the
+ * tweaks are XORed in again. Multi-sector calls also encrypt the sector
+ * tweaks in batches and spread groups of whole sectors over a work-stealing
+ * thread pool.
+ */
+
+#ifndef AES_XTS_H_
+#define AES_XTS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "AES.h"
+#include "AES_POOL.h"
+
+class AESXTS {
+ public:
+  // Blocks per encrypt_blocks call within one data unit.
+  static const size_t kChunkBlocks = 32;
+  // Sector tweaks encrypted per encrypt_blocks call.
+  static const size_t kTweakBatch = 16;
+
+  // Both ciphers are borrowed, not copied, and must outlive this object.
+  // They must have been built from different keys of the same size. With
+  // threads > 1, large multi-sector calls run on up to that many threads of
+  // the shared pool (or the one given to set_pool()).
+  AESXTS(AESBase& data_cipher, AESBase& tweak_cipher, unsigned int threads = 1)
+      : m_data_cipher(data_cipher),
+        m_tweak_cipher(tweak_cipher),
+        m_threads(threads ? threads : 1),
+        m_pool(nullptr) {}
+
+  void set_threads(unsigned int threads) { m_threads = threads ? threads : 1; }
+
+  // The pool is borrowed and must outlive this object.
+  void set_pool(AESThreadPool& pool) { m_pool = &pool; }
+
+  // Encrypts or decrypts one data unit of length bytes (at least 16) under
+  // the given sector number. Returns false if the unit is too short. in and
+  // out may be the same buffer.
+  bool encrypt_sector(uint64_t sector, const uint8_t* in, uint8_t* out,
+                      size_t length) {
+    if (length < 16) return false;
+    AES_STATS_SCOPE(m_data_cipher.key_bits(), AESOperation::kXTSEncrypt,
+                    length);
+    uint8_t tweak[16];
+    sector_tweak(sector, tweak);
+    m_tweak_cipher.encrypt_blocks(tweak, tweak, 1);
+    crypt_unit(m_data_cipher, true, tweak, in, out, length);
+    return true;
+  }
+
+  bool decrypt_sector(uint64_t sector, const uint8_t* in, uint8_t* out,
+                      size_t length) {
+    if (length < 16) return false;
+    AES_STATS_SCOPE(m_data_cipher.key_bits(), AESOperation::kXTSDecrypt,
+                    length);
+    uint8_t tweak[16];
+    sector_tweak(sector, tweak);
+    m_tweak_cipher.encrypt_blocks(tweak, tweak, 1);
+    crypt_unit(m_data_cipher, false, tweak, in, out, length);
+    return true;
+  }
+
+  // Processes nsectors consecutive data units of sector_size bytes (at least
+  // 16), numbered from first_sector. Large calls are split into whole
+  // sectors on the thread pool. Returns false if sector_size is too short.
+  bool encrypt_sectors(uint64_t first_sector, const uint8_t* in, uint8_t* out,
+                       size_t sector_size, size_t nsectors) {
+    return crypt_sectors(true, first_sector, in, out, sector_size, nsectors);
+  }
+
+  bool decrypt_sectors(uint64_t first_sector, const uint8_t* in, uint8_t* out,
+                       size_t sector_size, size_t nsectors) {
+    return crypt_sectors(false, first_sector, in, out, sector_size, nsectors);
+  }
+
+  // Multiplies a tweak by alpha (x) in GF(2^128) modulo
+  // x^128 + x^7 + x^2 + x + 1, with the IEEE 1619 little-endian layout.
+  static void multiply_alpha(uint8_t tweak[16]) {
+#if defined(__SSE2__)
+    __m128i t = _mm_loadu_si128((const __m128i*)tweak);
+    _mm_storeu_si128((__m128i*)tweak, multiply_alpha(t));
+#else
+    uint64_t lo = load_le64(tweak);
+    uint64_t hi = load_le64(tweak + 8);
+    uint64_t carry = hi >> 63;
+    hi = hi << 1 | lo >> 63;
+    lo = (lo << 1) ^ ((0 - carry) & 0x87);
+    store_le64(lo, tweak);
+    store_le64(hi, tweak + 8);
+#endif
+  }
+
+ private:
+#if defined(__SSE2__)
+  // Both 64-bit halves shift at once; the bits shifted out of each half are
+  // picked up from the sign of its top dword, moving bit 63 into bit 64 and
+  // reducing bit 127 into the low byte.
+  static __m128i multiply_alpha(__m128i t) {
+    __m128i signs = _mm_srai_epi32(t, 31);
+    __m128i carries = _mm_and_si128(_mm_shuffle_epi32(signs, 0x13),
+                                    _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_slli_epi64(t, 1), carries);
+  }
+#endif
+
+  static uint64_t load_le64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = value << 8 | p[i];
+    return value;
+  }
+
+  static void store_le64(uint64_t value, uint8_t* p) {
+    for (int i = 0; i < 8; i++) {
+      p[i] = (uint8_t)value;
+      value >>= 8;
+    }
+  }
+
+  // The unencrypted tweak: the sector number as a 128-bit little-endian
+  // integer.
+  static void sector_tweak(uint64_t sector, uint8_t tweak[16]) {
+    store_le64(sector, tweak);
+    memset(tweak + 8, 0, 8);
+  }
+
+  // Writes the tweaks for the next count blocks and advances tweak past them.
+  static void next_tweaks(uint8_t tweak[16], uint8_t* tweaks, size_t count) {
+#if defined(__SSE2__)
+    __m128i t = _mm_loadu_si128((const __m128i*)tweak);
+    for (size_t i = 0; i < count; i++) {
+      _mm_storeu_si128((__m128i*)(tweaks + 16 * i), t);
+      t = multiply_alpha(t);
+    }
+    _mm_storeu_si128((__m128i*)tweak, t);
+#else
+    for (size_t i = 0; i < count; i++) {
+      memcpy(tweaks + 16 * i, tweak, 16);
+      multiply_alpha(tweak);
+    }
+#endif
+  }
+
+  // XEX on whole blocks, advancing tweak.
+  static void crypt_blocks(AESBase& cipher, bool encrypting, uint8_t tweak[16],
+                           const uint8_t* in, uint8_t* out, size_t nblocks) {
+    uint8_t tweaks[kChunkBlocks * 16];
+    while (nblocks > 0) {
+      size_t count = nblocks < kChunkBlocks ? nblocks : kChunkBlocks;
+      next_tweaks(tweak, tweaks, count);
+      for (size_t i = 0; i < count; i++) {
+        AESBase::xor_block(in + 16 * i, tweaks + 16 * i, out + 16 * i);
+      }
+      if (encrypting) {
+        cipher.encrypt_blocks(out, out, count);
+      } else {
+        cipher.decrypt_blocks(out, out, count);
+      }
+      for (size_t i = 0; i < count; i++) {
+        AESBase::xor_block(out + 16 * i, tweaks + 16 * i, out + 16 * i);
+      }
+      in += 16 * count;
+      out += 16 * count;
+      nblocks -= count;
+    }
+  }
+
+  // Processes one data unit given its encrypted tweak. A partial final
+  // block steals the tail of the previous block's output; when decrypting,
+  // the last two tweaks are used in swapped order.
+  static void crypt_unit(AESBase& cipher, bool encrypting, uint8_t tweak[16],
+                         const uint8_t* in, uint8_t* out, size_t length) {
+    size_t tail = length % 16;
+    size_t whole = length / 16 - (tail ? 1 : 0);
+    crypt_blocks(cipher, encrypting, tweak, in, out, whole);
+    if (tail == 0) return;
+
+    uint8_t next_tweak[16];
+    memcpy(next_tweak, tweak, 16);
+    multiply_alpha(next_tweak);
+    in += 16 * whole;
+    out += 16 * whole;
+
+    uint8_t block[16], last[16];
+    crypt_blocks(cipher, encrypting, encrypting ? tweak : next_tweak, in,
+                 block, 1);
+    memcpy(last, in + 16, tail);
+    memcpy(last + tail, block + tail, 16 - tail);
+    memcpy(out + 16, block, tail);
+    crypt_blocks(cipher, encrypting, encrypting ? next_tweak : tweak, last,
+                 out, 1);
+  }
+
+  // Runs sectors [first, first + nsectors) of the buffers on one thread,
+  // encrypting their tweaks kTweakBatch at a time.
+  static void crypt_range(AESBase& data_cipher, AESBase& tweak_cipher,
+                          bool encrypting, uint64_t first, const uint8_t* in,
+                          uint8_t* out, size_t sector_size, size_t nsectors) {
+    uint8_t tweaks[kTweakBatch * 16];
+    while (nsectors > 0) {
+      size_t count = nsectors < kTweakBatch ? nsectors : kTweakBatch;
+      for (size_t i = 0; i < count; i++) {
+        sector_tweak(first + i, tweaks + 16 * i);
+      }
+      tweak_cipher.encrypt_blocks(tweaks, tweaks, count);
+      for (size_t i = 0; i < count; i++) {
+        crypt_unit(data_cipher, encrypting, tweaks + 16 * i, in, out,
+                   sector_size);
+        in += sector_size;
+        out += sector_size;
+      }
+      first += count;
+      nsectors -= count;
+    }
+  }
+
+  bool crypt_sectors(bool encrypting, uint64_t first_sector, const uint8_t* in,
+                     uint8_t* out, size_t sector_size, size_t nsectors) {
+    if (sector_size < 16) return false;
+    AES_STATS_SCOPE(m_data_cipher.key_bits(),
+                    encrypting ? AESOperation::kXTSEncrypt
+                               : AESOperation::kXTSDecrypt,
+                    sector_size * nsectors);
+    size_t per_chunk = AESThreadPool::kChunkBytes / sector_size;
+    if (per_chunk == 0) per_chunk = 1;
+    if (m_threads == 1 || nsectors <= per_chunk) {
+      crypt_range(m_data_cipher, m_tweak_cipher, encrypting, first_sector, in,
+                  out, sector_size, nsectors);
+      return true;
+    }
+
+    AESBase& data_cipher = m_data_cipher;
+    AESBase& tweak_cipher = m_tweak_cipher;
+    AESThreadPool& pool = m_pool ? *m_pool : AESThreadPool::shared();
+    pool.run((nsectors + per_chunk - 1) / per_chunk, m_threads,
+             [&data_cipher, &tweak_cipher, encrypting, first_sector, in, out,
+              sector_size, nsectors, per_chunk](size_t i) {
+               size_t start = i * per_chunk;
+               size_t count = nsectors - start < per_chunk ? nsectors - start
+                                                           : per_chunk;
+               size_t offset = start * sector_size;
+               crypt_range(data_cipher, tweak_cipher, encrypting,
+                           first_sector + start, in + offset, out + offset,
+                           sector_size, count);
+             });
+    return true;
+  }
+
+  AESBase& m_data_cipher;
+  AESBase& m_tweak_cipher;
+  unsigned int m_threads;
+  AESThreadPool* m_pool;
+};
+
+#endif
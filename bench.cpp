@@ -0,0 +1,585 @@
+// AES benchmarks
+//
+// Usage:
+//   bench [--format csv|json] [--max-size BYTES] [--threads N] [--time SEC]
+//
+// Measures key-schedule setup, expanded-key cache hits and bulk throughput
+// for AES128, AES192 and AES256: ECB encrypt/decrypt through
+// encrypt_blocks/decrypt_blocks on every backend the CPU supports, and CTR,
+// CBC, GCM, XTS (4 KB sectors) and CMAC on the default backend. CMAC is also
+// measured over the buffer cut into 64-byte records, one mac() call per
+// record and through the lanes of mac_messages(). Packets of up to 4 KB
+// also go through primed CTR and GCM look-ahead sessions, and messages of up
+// to 1 MB as 64-byte CTR requests, one call each and batched by AESAsync.
+// Message sizes run from 16 bytes to 64 MB in powers of four. Parallel
+// operations are measured single-threaded and with --threads threads
+// (hardware concurrency by default).
+//
+// Every row reports GB/s, cycles/byte and the p50/p99 latency of one call.
+// Cycles come from the time-stamp counter on x86, which ticks at a constant
+// reference rate; elsewhere the column is 0.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AES.h"
+#include "AES_ASYNC.h"
+#include "AES_BATCH.h"
+#include "AES_CACHE.h"
+#include "AES_CBC.h"
+#include "AES_CMAC.h"
+#include "AES_COMPACT.h"
+#include "AES_CTR.h"
+#include "AES_DRBG.h"
+#include "AES_GCM.h"
+#include "AES_POOL.h"
+#include "AES_SESSION.h"
+#include "AES_XTS.h"
+
+#if AES_HAVE_AESNI
+#include <x86intrin.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// Data unit size for the XTS rows.
+const size_t kSectorSize = 4096;
+// Record size for the per-record CMAC rows.
+const size_t kRecordSize = 64;
+// Keys per call in the key-agile rows, one block each.
+const size_t kKeyAgilePairs = 1024;
+// Live keys in the session rows, one block each per call.
+const size_t kSessions = 1 << 16;
+// Fragment size for the scatter/gather rows, deliberately not a multiple of
+// the block size.
+const size_t kFragmentSize = 100;
+// Largest packet in the look-ahead session rows.
+const size_t kMaxPacket = 4096;
+// Request size and largest message in the asynchronous request rows.
+const size_t kRequestSize = 64;
+const size_t kMaxRequestBytes = 1 << 20;
+// Option limits: the largest message is allocated once, and every row runs
+// from 16 bytes up to it.
+const unsigned long kMinMessageBytes = 16;
+const unsigned long kMaxMessageBytes = 1ul << 30;
+const unsigned long kMaxThreads = 256;
+const double kMaxSeconds = 60;
+
+struct Result {
+  std::string operation;
+  int key_bits;
+  std::string backend;
+  unsigned int threads;
+  size_t bytes;
+  size_t calls;
+  double gb_per_s;
+  double cycles_per_byte;
+  double p50_ns;
+  double p99_ns;
+};
+
+struct Options {
+  bool json = false;
+  size_t max_size = 64 << 20;
+  unsigned int threads = 0;
+  double seconds = 0.1;
+};
+
+// Parses a decimal option value in [1, max].
+bool parse_count(const char* text, unsigned long max, unsigned long& value) {
+  if (*text == '\0') return false;
+  for (const char* p = text; *p != '\0'; p++) {
+    if (!isdigit((unsigned char)*p)) return false;
+  }
+  errno = 0;
+  value = strtoul(text, nullptr, 10);
+  return errno == 0 && value >= 1 && value <= max;
+}
+
+// Parses a time budget in seconds, in (0, kMaxSeconds].
+bool parse_seconds(const char* text, double& value) {
+  char* end;
+  errno = 0;
+  value = strtod(text, &end);
+  return end != text && *end == '\0' && errno == 0 && std::isfinite(value) &&
+         value > 0 && value <= kMaxSeconds;
+}
+
+int usage() {
+  fprintf(stderr,
+          "usage: bench [--format csv|json] [--max-size BYTES] "
+          "[--threads N] [--time SEC]\n");
+  return 2;
+}
+
+uint64_t read_cycles() {
+#if AES_HAVE_AESNI
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Calls fn once to warm up, then repeatedly until the time budget is spent
+// (at least three timed calls), and summarises the per-call latencies.
+Result measure(const Options& options, size_t bytes,
+               const std::function<void()>& fn) {
+  fn();
+  std::vector<double> latencies;
+  double total_ns = 0;
+  uint64_t total_cycles = 0;
+  while (latencies.size() < 3 || total_ns < options.seconds * 1e9) {
+    uint64_t cycles = read_cycles();
+    Clock::time_point start = Clock::now();
+    fn();
+    Clock::time_point end = Clock::now();
+    total_cycles += read_cycles() - cycles;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    latencies.push_back(ns);
+    total_ns += ns;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  Result result;
+  result.bytes = bytes;
+  result.calls = latencies.size();
+  double total_bytes = (double)bytes * latencies.size();
+  result.gb_per_s = total_bytes / total_ns;
+  result.cycles_per_byte = total_cycles / total_bytes;
+  result.p50_ns = latencies[latencies.size() / 2];
+  result.p99_ns = latencies[(latencies.size() * 99) / 100];
+  return result;
+}
+
+// Runs fn over whole blocks in pool-sized chunks on up to threads threads of
+// the shared pool.
+void run_split(unsigned int threads, uint8_t* data, size_t bytes,
+               const std::function<void(uint8_t*, size_t)>& fn) {
+  size_t nblocks = bytes / 16;
+  const size_t per_chunk = AESThreadPool::kChunkBytes / 16;
+  if (threads <= 1 || nblocks <= per_chunk) {
+    fn(data, nblocks);
+    return;
+  }
+  AESThreadPool::shared().run(
+      (nblocks + per_chunk - 1) / per_chunk, threads,
+      [&fn, data, nblocks, per_chunk](size_t i) {
+        size_t start = i * per_chunk;
+        fn(data + 16 * start, std::min(per_chunk, nblocks - start));
+      });
+}
+
+const char* backend_name(AESBackend backend) {
+  switch (backend) {
+    case AESBackend::kTTable:
+      return "ttable";
+    case AESBackend::kAESNI:
+      return "aesni";
+    case AESBackend::kBitsliced:
+      return "bitsliced";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<AESBase> make_cipher(int key_bits, const uint8_t* key) {
+  unsigned char words[8][4];
+  memcpy(words, key, key_bits / 8);
+  if (key_bits == 128) return std::unique_ptr<AESBase>(new AES128(words));
+  if (key_bits == 192) return std::unique_ptr<AESBase>(new AES192(words));
+  return std::unique_ptr<AESBase>(new AES256(words));
+}
+
+// Copies the schedule for a key that an expanded-key cache already holds.
+template <int Nk>
+Result measure_cache_hit(const Options& options, const uint8_t* key) {
+  AESKeyCache<Nk> cache(1024);
+  volatile unsigned char sink = 0;
+  return measure(options, 4 * Nk, [&] {
+    AES<Nk> engine = cache.get(key);
+    sink = sink ^ engine.decrypt_keys()[AES<Nk>::kRounds][3][3];
+  });
+}
+
+Result measure_cache_hit(const Options& options, int key_bits,
+                         const uint8_t* key) {
+  if (key_bits == 128) return measure_cache_hit<4>(options, key);
+  if (key_bits == 192) return measure_cache_hit<6>(options, key);
+  return measure_cache_hit<8>(options, key);
+}
+
+// One block under each of kKeyAgilePairs keys, through a cipher object per
+// key or through AESKeyBatch.
+template <int Nk>
+Result measure_key_agile(const Options& options, bool batch) {
+  std::vector<unsigned char> keys(4 * Nk * kKeyAgilePairs);
+  for (size_t i = 0; i < keys.size(); i++) keys[i] = (unsigned char)(i * 13);
+  std::vector<uint8_t> blocks(16 * kKeyAgilePairs);
+  std::vector<typename AESKeyBatch<Nk>::Pair> pairs(kKeyAgilePairs);
+  for (size_t i = 0; i < kKeyAgilePairs; i++) {
+    pairs[i] = {&keys[4 * Nk * i], &blocks[16 * i], &blocks[16 * i]};
+  }
+  return measure(options, blocks.size(), [&] {
+    if (batch) {
+      AESKeyBatch<Nk>::encrypt(pairs.data(), pairs.size());
+      return;
+    }
+    for (size_t i = 0; i < kKeyAgilePairs; i++) {
+      std::unique_ptr<AESBase> cipher = make_cipher(32 * Nk, &keys[4 * Nk * i]);
+      cipher->encrypt_block(&blocks[16 * i], &blocks[16 * i]);
+    }
+  });
+}
+
+Result measure_key_agile(const Options& options, int key_bits, bool batch) {
+  if (key_bits == 128) return measure_key_agile<4>(options, batch);
+  if (key_bits == 192) return measure_key_agile<6>(options, batch);
+  return measure_key_agile<8>(options, batch);
+}
+
+// ECB through compact contexts, which derive the round keys per call.
+template <int Nk>
+Result measure_compact(const Options& options, const uint8_t* key,
+                       uint8_t* data, size_t bytes, bool decrypt) {
+  AESCompactEncryptor<Nk> encryptor(key);
+  AESCompactDecryptor<Nk> decryptor(key);
+  return measure(options, bytes, [&] {
+    if (decrypt) {
+      decryptor.decrypt_blocks(data, data, bytes / 16);
+    } else {
+      encryptor.encrypt_blocks(data, data, bytes / 16);
+    }
+  });
+}
+
+Result measure_compact(const Options& options, int key_bits,
+                       const uint8_t* key, uint8_t* data, size_t bytes,
+                       bool decrypt) {
+  if (key_bits == 128) {
+    return measure_compact<4>(options, key, data, bytes, decrypt);
+  }
+  if (key_bits == 192) {
+    return measure_compact<6>(options, key, data, bytes, decrypt);
+  }
+  return measure_compact<8>(options, key, data, bytes, decrypt);
+}
+
+// One block under each of kSessions live keys, visited in a scattered
+// order, held as AES<Nk> engines or as compact encryptors.
+template <int Nk, typename Context>
+Result measure_sessions(const Options& options) {
+  std::vector<Context> contexts;
+  contexts.reserve(kSessions);
+  unsigned char key[4 * Nk];
+  for (size_t i = 0; i < kSessions; i++) {
+    for (int j = 0; j < 4 * Nk; j++) key[j] = (unsigned char)(i * 7 + j);
+    contexts.emplace_back(key);
+  }
+  uint8_t block[16] = {0};
+  return measure(options, 16 * kSessions, [&] {
+    for (size_t i = 0; i < kSessions; i++) {
+      contexts[i * 40503 % kSessions].encrypt_blocks(block, block, 1);
+    }
+  });
+}
+
+Result measure_sessions(const Options& options, int key_bits, bool compact) {
+  if (key_bits == 128) {
+    return compact ? measure_sessions<4, AESCompactEncryptor<4>>(options)
+                   : measure_sessions<4, AES<4>>(options);
+  }
+  if (key_bits == 192) {
+    return compact ? measure_sessions<6, AESCompactEncryptor<6>>(options)
+                   : measure_sessions<6, AES<6>>(options);
+  }
+  return compact ? measure_sessions<8, AESCompactEncryptor<8>>(options)
+                 : measure_sessions<8, AES<8>>(options);
+}
+
+void print(const Options& options, const Result& result, bool first) {
+  if (options.json) {
+    printf("%s\n  {\"operation\": \"%s\", \"key_bits\": %d, \"backend\": "
+           "\"%s\", \"threads\": %u, \"bytes\": %zu, \"calls\": %zu, "
+           "\"gb_per_s\": %.4f, \"cycles_per_byte\": %.3f, \"p50_ns\": %.0f, "
+           "\"p99_ns\": %.0f}",
+           first ? "[" : ",", result.operation.c_str(), result.key_bits,
+           result.backend.c_str(), result.threads, result.bytes, result.calls,
+           result.gb_per_s, result.cycles_per_byte, result.p50_ns,
+           result.p99_ns);
+  } else {
+    if (first) {
+      printf("operation,key_bits,backend,threads,bytes,calls,gb_per_s,"
+             "cycles_per_byte,p50_ns,p99_ns\n");
+    }
+    printf("%s,%d,%s,%u,%zu,%zu,%.4f,%.3f,%.0f,%.0f\n",
+           result.operation.c_str(), result.key_bits, result.backend.c_str(),
+           result.threads, result.bytes, result.calls, result.gb_per_s,
+           result.cycles_per_byte, result.p50_ns, result.p99_ns);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  options.threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    unsigned long value;
+    if (option == "--format" && i + 1 < argc) {
+      std::string format = argv[++i];
+      if (format != "csv" && format != "json") return usage();
+      options.json = format == "json";
+    } else if (option == "--max-size" && i + 1 < argc) {
+      if (!parse_count(argv[++i], kMaxMessageBytes, value) ||
+          value < kMinMessageBytes) {
+        fprintf(stderr, "--max-size must be %lu to %lu\n", kMinMessageBytes,
+                kMaxMessageBytes);
+        return usage();
+      }
+      options.max_size = value;
+    } else if (option == "--threads" && i + 1 < argc) {
+      if (!parse_count(argv[++i], kMaxThreads, value)) {
+        fprintf(stderr, "--threads must be 1 to %lu\n", kMaxThreads);
+        return usage();
+      }
+      options.threads = (unsigned int)value;
+    } else if (option == "--time" && i + 1 < argc) {
+      if (!parse_seconds(argv[++i], options.seconds)) {
+        fprintf(stderr, "--time must be above 0 and at most %g\n",
+                kMaxSeconds);
+        return usage();
+      }
+    } else {
+      return usage();
+    }
+  }
+
+  // One spare byte so the XTS tweak key can start at key + 1.
+  uint8_t key[33];
+  for (int i = 0; i < 33; i++) key[i] = (uint8_t)(i * 11 + 1);
+  uint8_t iv[16] = {0};
+  std::vector<uint8_t> buffer(options.max_size + 16);
+  for (size_t i = 0; i < buffer.size(); i++) buffer[i] = (uint8_t)i;
+
+  std::vector<unsigned int> thread_counts(1, 1);
+  if (options.threads > 1) thread_counts.push_back(options.threads);
+
+  bool first = true;
+  auto emit = [&](Result result, const std::string& operation, int key_bits,
+                  const std::string& backend, unsigned int threads) {
+    result.operation = operation;
+    result.key_bits = key_bits;
+    result.backend = backend;
+    result.threads = threads;
+    print(options, result, first);
+    first = false;
+  };
+
+  uint8_t seed[AESCTRDRBG::kSeedBytes];
+  for (size_t i = 0; i < sizeof(seed); i++) seed[i] = (uint8_t)(i * 7 + 5);
+  AESCTRDRBG drbg(seed, nullptr, 0);
+
+  const int key_sizes[] = {128, 192, 256};
+  for (int key_bits : key_sizes) {
+    std::unique_ptr<AESBase> cipher = make_cipher(key_bits, key);
+    std::unique_ptr<AESBase> tweak_cipher = make_cipher(key_bits, key + 1);
+    AESBackend default_backend_id = cipher->backend();
+    const char* default_backend = backend_name(default_backend_id);
+
+    Result setup = measure(options, key_bits / 8, [&] {
+      std::unique_ptr<AESBase> fresh = make_cipher(key_bits, key);
+    });
+    emit(setup, "key-setup", key_bits, default_backend, 1);
+    emit(measure_cache_hit(options, key_bits, key), "key-cache-hit", key_bits,
+         default_backend, 1);
+    emit(measure_key_agile(options, key_bits, false), "key-agile-objects",
+         key_bits, default_backend, 1);
+    emit(measure_key_agile(options, key_bits, true), "key-agile-batch",
+         key_bits, default_backend, 1);
+    emit(measure_sessions(options, key_bits, false), "sessions-stored",
+         key_bits, default_backend, 1);
+    emit(measure_sessions(options, key_bits, true), "sessions-compact",
+         key_bits, default_backend, 1);
+
+    for (size_t bytes = 16; bytes <= options.max_size; bytes *= 4) {
+      uint8_t* data = buffer.data();
+
+      const AESBackend backends[] = {AESBackend::kTTable, AESBackend::kAESNI,
+                                     AESBackend::kBitsliced};
+      for (AESBackend backend : backends) {
+        if (!cipher->set_backend(backend)) continue;
+        for (unsigned int threads : thread_counts) {
+          AESBase& aes = *cipher;
+          emit(measure(options, bytes,
+                       [&] {
+                         run_split(threads, data, bytes,
+                                   [&aes](uint8_t* p, size_t n) {
+                                     aes.encrypt_blocks(p, p, n);
+                                   });
+                       }),
+               "ecb-encrypt", key_bits, backend_name(backend), threads);
+          emit(measure(options, bytes,
+                       [&] {
+                         run_split(threads, data, bytes,
+                                   [&aes](uint8_t* p, size_t n) {
+                                     aes.decrypt_blocks(p, p, n);
+                                   });
+                       }),
+               "ecb-decrypt", key_bits, backend_name(backend), threads);
+        }
+      }
+      cipher->set_backend(default_backend_id);
+      emit(measure_compact(options, key_bits, key, data, bytes, false),
+           "ecb-encrypt-compact", key_bits, default_backend, 1);
+      emit(measure_compact(options, key_bits, key, data, bytes, true),
+           "ecb-decrypt-compact", key_bits, default_backend, 1);
+
+      for (unsigned int threads : thread_counts) {
+        emit(measure(options, bytes,
+                     [&] {
+                       AESCTR(*cipher, iv, threads).process(data, data, bytes);
+                     }),
+             "ctr", key_bits, default_backend, threads);
+        AESCBC cbc(*cipher, threads);
+        emit(measure(options, bytes,
+                     [&] {
+                       uint8_t chain[16] = {0};
+                       cbc.decrypt_blocks(chain, data, data, bytes / 16);
+                     }),
+             "cbc-decrypt", key_bits, default_backend, threads);
+        if (bytes >= kSectorSize) {
+          AESXTS xts(*cipher, *tweak_cipher, threads);
+          emit(measure(options, bytes,
+                       [&] {
+                         xts.encrypt_sectors(0, data, data, kSectorSize,
+                                             bytes / kSectorSize);
+                       }),
+               "xts-encrypt", key_bits, default_backend, threads);
+        }
+      }
+      AESCBC cbc(*cipher);
+      emit(measure(options, bytes,
+                   [&] {
+                     uint8_t chain[16] = {0};
+                     cbc.encrypt_blocks(chain, data, data, bytes / 16);
+                   }),
+           "cbc-encrypt", key_bits, default_backend, 1);
+      AESGCM gcm(*cipher);
+      emit(measure(options, bytes,
+                   [&] {
+                     uint8_t tag[16];
+                     gcm.encrypt(iv, 12, nullptr, 0, data, data, bytes, tag,
+                                 16);
+                   }),
+           "gcm-encrypt", key_bits, default_backend, 1);
+#if AES_HAVE_IOVEC
+      if (bytes >= kFragmentSize) {
+        std::vector<struct iovec> fragments;
+        for (size_t offset = 0; offset < bytes; offset += kFragmentSize) {
+          size_t length = std::min(kFragmentSize, bytes - offset);
+          fragments.push_back({data + offset, length});
+        }
+        const struct iovec* list = fragments.data();
+        size_t count = fragments.size();
+        emit(measure(options, bytes,
+                     [&] {
+                       AESCTR(*cipher, iv).process(list, count, list, count);
+                     }),
+             "ctr-iov", key_bits, default_backend, 1);
+        emit(measure(options, bytes,
+                     [&] {
+                       uint8_t tag[16];
+                       gcm.start(iv, 12);
+                       gcm.encrypt_update(list, count, list, count);
+                       gcm.finish(tag, 16);
+                     }),
+             "gcm-encrypt-iov", key_bits, default_backend, 1);
+      }
+#endif
+      if (bytes <= kMaxPacket) {
+        // Back-to-back packets on primed sessions; the worker refills the
+        // ring between calls.
+        AESCTRSession ctr_session(*cipher, iv);
+        ctr_session.prime();
+        emit(measure(options, bytes,
+                     [&] { ctr_session.process(data, data, bytes); }),
+             "ctr-session", key_bits, default_backend, 1);
+        AESGCMSession gcm_session(*cipher, iv, bytes);
+        gcm_session.prime();
+        emit(measure(options, bytes,
+                     [&] {
+                       uint8_t tag[16];
+                       gcm_session.seal(nullptr, 0, data, data, bytes, tag,
+                                        16);
+                     }),
+             "gcm-session", key_bits, default_backend, 1);
+      }
+      if (bytes >= kRequestSize && bytes <= kMaxRequestBytes) {
+        size_t requests = bytes / kRequestSize;
+        emit(measure(options, bytes,
+                     [&] {
+                       for (size_t i = 0; i < requests; i++) {
+                         uint8_t* p = data + i * kRequestSize;
+                         AESCTR(*cipher, iv).process(p, p, kRequestSize);
+                       }
+                     }),
+             "ctr-requests", key_bits, default_backend, 1);
+        AESAsync async(*cipher, kRequestSize);
+        emit(measure(options, bytes,
+                     [&] {
+                       AESAsyncRequest request;
+                       request.iv = iv;
+                       request.length = kRequestSize;
+                       for (size_t i = 0; i < requests; i++) {
+                         request.in = request.out = data + i * kRequestSize;
+                         async.encrypt_async(request, [](bool) {});
+                       }
+                       async.poll();
+                     }),
+             "ctr-requests-async", key_bits, default_backend, 1);
+      }
+      AESCMAC cmac(*cipher);
+      emit(measure(options, bytes,
+                   [&] {
+                     uint8_t tag[16];
+                     cmac.mac(data, bytes, tag);
+                   }),
+           "cmac", key_bits, default_backend, 1);
+      if (bytes >= kRecordSize) {
+        size_t records = bytes / kRecordSize;
+        std::vector<uint8_t> tags(16 * records);
+        std::vector<AESCMAC::Message> messages(records);
+        for (size_t i = 0; i < records; i++) {
+          messages[i] = {data + i * kRecordSize, kRecordSize,
+                         tags.data() + 16 * i};
+        }
+        emit(measure(options, bytes,
+                     [&] {
+                       for (const AESCMAC::Message& message : messages) {
+                         cmac.mac(message.in, message.length, message.tag);
+                       }
+                     }),
+             "cmac-records", key_bits, default_backend, 1);
+        emit(measure(options, bytes,
+                     [&] { cmac.mac_messages(messages.data(), records); }),
+             "cmac-records-lanes", key_bits, default_backend, 1);
+      }
+      if (key_bits == 256) {
+        // The DRBG is fixed to AES-256; calls are served from its buffer.
+        emit(measure(options, bytes, [&] { drbg.generate(data, bytes); }),
+             "drbg", key_bits, default_backend, 1);
+      }
+    }
+  }
+  if (options.json) printf("\n]\n");
+  return 0;
+}
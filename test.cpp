@@ -1,10 +1,33 @@
 // AES encryption and decryption tests
 
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "AES.h"
+#include "AES_ASYNC.h"
+#include "AES_BATCH.h"
+#include "AES_CACHE.h"
+#include "AES_CBC.h"
+#include "AES_CMAC.h"
+#include "AES_COMPACT.h"
+#include "AES_CONTAINER.h"
+#include "AES_CTR.h"
+#include "AES_DRBG.h"
+#include "AES_GCM.h"
+#include "AES_POOL.h"
+#include "AES_SESSION.h"
+#include "AES_XTS.h"
 
 void ASSERT_EQ(unsigned char cipher_text[4][4],
                unsigned char expected_cipher_text[4][4]) {
@@ -143,6 +166,1634 @@ void test_aes_256_decryption() {
   std::cout << "Test cases passed for AES256 decryption." << std::endl;
 }
 
+// Cross-checks the active engine against the byte-wise reference path, on
+// the NIST plaintext and a run of blocks derived from it.
+template <typename AES>
+void check_against_reference(AES& aes) {
+  unsigned char block[4][4] = {{0x6B, 0xC1, 0xBE, 0xE2},
+                               {0x2E, 0x40, 0x9F, 0x96},
+                               {0xE9, 0x3D, 0x7E, 0x11},
+                               {0x73, 0x93, 0x17, 0x2A}};
+  for (int i = 0; i < 64; i++) {
+    unsigned char fast[4][4], reference[4][4];
+    aes.encrypt(block, fast);
+    aes.encrypt_reference(block, reference);
+    ASSERT_EQ(fast, reference);
+    aes.decrypt(fast, reference);
+    ASSERT_EQ(reference, block);
+    aes.decrypt_reference(fast, reference);
+    ASSERT_EQ(reference, block);
+    memcpy(block, fast, 16);
+  }
+}
+
+template <typename AES>
+void check_backends_against_reference(AES& aes) {
+  aes.set_backend(AESBackend::kTTable);
+  assert(aes.backend() == AESBackend::kTTable);
+  check_against_reference(aes);
+  aes.set_backend(AESBackend::kBitsliced);
+  assert(aes.backend() == AESBackend::kBitsliced);
+  check_against_reference(aes);
+  if (aes.set_backend(AESBackend::kAESNI)) {
+    check_against_reference(aes);
+  } else {
+    assert(aes.backend() == AESBackend::kTTable);
+  }
+}
+
+void test_backends_match_reference() {
+  std::cout << "Testing round engines against reference." << std::endl;
+  unsigned char key_128[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                                 {0x28, 0xAE, 0xD2, 0xA6},
+                                 {0xAB, 0xF7, 0x15, 0x88},
+                                 {0x09, 0xCF, 0x4F, 0x3C}};
+  unsigned char key_192[6][4] = {
+      {0x8E, 0x73, 0xB0, 0xF7}, {0xDA, 0x0E, 0x64, 0x52},
+      {0xC8, 0x10, 0xF3, 0x2B}, {0x80, 0x90, 0x79, 0xE5},
+      {0x62, 0xF8, 0xEA, 0xD2}, {0x52, 0x2C, 0x6B, 0x7B}};
+  unsigned char key_256[8][4] = {
+      {0x60, 0x3D, 0xEB, 0x10}, {0x15, 0xCA, 0x71, 0xBE},
+      {0x2B, 0x73, 0xAE, 0xF0}, {0x85, 0x7D, 0x77, 0x81},
+      {0x1F, 0x35, 0x2C, 0x07}, {0x3B, 0x61, 0x08, 0xD7},
+      {0x2D, 0x98, 0x10, 0xA3}, {0x09, 0x14, 0xDF, 0xF4}};
+  AES128 aes128(key_128);
+  AES192 aes192(key_192);
+  AES256 aes256(key_256);
+  assert((aes128.backend() == AESBackend::kAESNI) == AESBase::cpu_has_aesni());
+  check_backends_against_reference(aes128);
+  check_backends_against_reference(aes192);
+  check_backends_against_reference(aes256);
+  std::cout << "Test cases passed for round engines." << std::endl;
+}
+
+void test_bitsliced_multi_block() {
+  std::cout << "Testing bitsliced engine on partial and full batches."
+            << std::endl;
+  unsigned char key[8][4] = {
+      {0x60, 0x3D, 0xEB, 0x10}, {0x15, 0xCA, 0x71, 0xBE},
+      {0x2B, 0x73, 0xAE, 0xF0}, {0x85, 0x7D, 0x77, 0x81},
+      {0x1F, 0x35, 0x2C, 0x07}, {0x3B, 0x61, 0x08, 0xD7},
+      {0x2D, 0x98, 0x10, 0xA3}, {0x09, 0x14, 0xDF, 0xF4}};
+  AES256 aes256(key);
+  BitslicedAES engine(&aes256.engine().encrypt_keys()[0][0][0], 14);
+  const int nblocks = 2 * BitslicedAES::kParallelBlocks + 3;
+  unsigned char plain_text[nblocks][4][4], cipher_text[nblocks][4][4];
+  for (int i = 0; i < nblocks * 16; i++) {
+    (&plain_text[0][0][0])[i] = (unsigned char)(i * 7 + 1);
+  }
+  engine.encrypt(&plain_text[0][0][0], &cipher_text[0][0][0], nblocks);
+  for (int block = 0; block < nblocks; block++) {
+    unsigned char expected[4][4];
+    aes256.encrypt_reference(plain_text[block], expected);
+    ASSERT_EQ(cipher_text[block], expected);
+  }
+  engine.decrypt(&cipher_text[0][0][0], &cipher_text[0][0][0], nblocks);
+  for (int block = 0; block < nblocks; block++) {
+    ASSERT_EQ(cipher_text[block], plain_text[block]);
+  }
+  std::cout << "Test cases passed for bitsliced engine." << std::endl;
+}
+
+// Checks encrypt_blocks/decrypt_blocks on every backend against per-block
+// reference calls, for a count that exercises both the interleaved groups
+// and the tail, both out of place and in place.
+template <typename AES>
+void check_blocks_against_reference(AES& aes) {
+  const int nblocks = 37;
+  uint8_t plain_text[nblocks * 16], cipher_text[nblocks * 16];
+  uint8_t expected[nblocks * 16];
+  for (int i = 0; i < nblocks * 16; i++) plain_text[i] = (uint8_t)(i * 13 + 5);
+  for (int block = 0; block < nblocks; block++) {
+    unsigned char in[4][4], out[4][4];
+    memcpy(in, plain_text + 16 * block, 16);
+    aes.encrypt_reference(in, out);
+    memcpy(expected + 16 * block, out, 16);
+  }
+  const AESBackend backends[] = {AESBackend::kTTable, AESBackend::kBitsliced,
+                                 AESBackend::kAESNI};
+  for (AESBackend backend : backends) {
+    if (!aes.set_backend(backend)) continue;
+    AESBase& base = aes;
+    base.encrypt_blocks(plain_text, cipher_text, nblocks);
+    assert(memcmp(cipher_text, expected, sizeof(expected)) == 0);
+    base.decrypt_blocks(cipher_text, cipher_text, nblocks);
+    assert(memcmp(cipher_text, plain_text, sizeof(plain_text)) == 0);
+    base.encrypt_blocks(cipher_text, cipher_text, nblocks);
+    assert(memcmp(cipher_text, expected, sizeof(expected)) == 0);
+  }
+}
+
+void test_multi_block_api() {
+  std::cout << "Testing multi-block encrypt/decrypt." << std::endl;
+  unsigned char key_128[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                                 {0x28, 0xAE, 0xD2, 0xA6},
+                                 {0xAB, 0xF7, 0x15, 0x88},
+                                 {0x09, 0xCF, 0x4F, 0x3C}};
+  unsigned char key_192[6][4] = {
+      {0x8E, 0x73, 0xB0, 0xF7}, {0xDA, 0x0E, 0x64, 0x52},
+      {0xC8, 0x10, 0xF3, 0x2B}, {0x80, 0x90, 0x79, 0xE5},
+      {0x62, 0xF8, 0xEA, 0xD2}, {0x52, 0x2C, 0x6B, 0x7B}};
+  unsigned char key_256[8][4] = {
+      {0x60, 0x3D, 0xEB, 0x10}, {0x15, 0xCA, 0x71, 0xBE},
+      {0x2B, 0x73, 0xAE, 0xF0}, {0x85, 0x7D, 0x77, 0x81},
+      {0x1F, 0x35, 0x2C, 0x07}, {0x3B, 0x61, 0x08, 0xD7},
+      {0x2D, 0x98, 0x10, 0xA3}, {0x09, 0x14, 0xDF, 0xF4}};
+  AES128 aes128(key_128);
+  AES192 aes192(key_192);
+  AES256 aes256(key_256);
+  check_blocks_against_reference(aes128);
+  check_blocks_against_reference(aes192);
+  check_blocks_against_reference(aes256);
+  std::cout << "Test cases passed for multi-block encrypt/decrypt."
+            << std::endl;
+}
+
+// Runs the flat single-block API at every offset within a word, in place
+// and out of place, against the [4][4] API.
+void check_flat_block_api(AESBase& aes) {
+  const AESBackend backends[] = {AESBackend::kTTable, AESBackend::kBitsliced,
+                                 AESBackend::kAESNI};
+  for (AESBackend backend : backends) {
+    if (!aes.set_backend(backend)) continue;
+    for (int offset = 0; offset < 8; offset++) {
+      uint8_t buffer[40], out[40];
+      for (int i = 0; i < 40; i++) buffer[i] = (uint8_t)(i * 29 + offset);
+      unsigned char block[4][4], expected[4][4];
+      memcpy(block, buffer + offset, 16);
+      aes.encrypt(block, expected);
+
+      aes.encrypt_block(buffer + offset, out + 7 - offset);
+      assert(memcmp(out + 7 - offset, expected, 16) == 0);
+      aes.encrypt_block(buffer + offset, buffer + offset);
+      assert(memcmp(buffer + offset, expected, 16) == 0);
+      aes.decrypt_block(buffer + offset, buffer + offset);
+      assert(memcmp(buffer + offset, block, 16) == 0);
+    }
+  }
+}
+
+void test_flat_block_api() {
+  std::cout << "Testing flat block API." << std::endl;
+  unsigned char key[8][4];
+  for (int i = 0; i < 32; i++) (&key[0][0])[i] = (unsigned char)(i * 5 + 3);
+  AES128 aes128(key);
+  AES192 aes192(key);
+  AES256 aes256(key);
+  check_flat_block_api(aes128);
+  check_flat_block_api(aes192);
+  check_flat_block_api(aes256);
+
+  unsigned char a[4][4], b[4][4], expected[4][4];
+  for (int i = 0; i < 16; i++) {
+    (&a[0][0])[i] = (unsigned char)(i * 3);
+    (&b[0][0])[i] = (unsigned char)(i * 7 + 1);
+    (&expected[0][0])[i] = (unsigned char)((i * 3) ^ (i * 7 + 1));
+  }
+  aes128.xor_blocks(a, b, a);
+  ASSERT_EQ(a, expected);
+  uint8_t flat[17];
+  memcpy(flat + 1, b, 16);
+  AESBase::xor_block(flat + 1, &expected[0][0], flat + 1);
+  for (int i = 0; i < 16; i++) assert(flat[1 + i] == (uint8_t)(i * 3));
+  std::cout << "Test cases passed for flat block API." << std::endl;
+}
+
+std::vector<uint8_t> from_hex(const char* hex) {
+  std::vector<uint8_t> bytes;
+  for (; hex[0] && hex[1]; hex += 2) {
+    bytes.push_back((uint8_t)std::stoi(std::string(hex, 2), nullptr, 16));
+  }
+  return bytes;
+}
+
+constexpr bool sbox_tables_match() {
+  for (int x = 0; x < 256; x++) {
+    if (AES_TABLES.sbox[x] != S_BOX[x / 16][x % 16]) return false;
+    if (AES_TABLES.inv_sbox[x] != INV_S_BOX[x / 16][x % 16]) return false;
+  }
+  return true;
+}
+static_assert(sbox_tables_match(), "generated S-boxes differ from FIPS-197");
+
+// FIPS-197 appendix A.1: the key schedule is expanded at compile time and
+// its last word is w[43] = b6630ca6.
+constexpr unsigned char FIPS_KEY_128[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE,
+                                            0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88,
+                                            0x09, 0xCF, 0x4F, 0x3C};
+constexpr AES<4> FIPS_CIPHER_128(FIPS_KEY_128);
+static_assert(FIPS_CIPHER_128.encrypt_keys()[10][3][0] == 0xB6 &&
+                  FIPS_CIPHER_128.encrypt_keys()[10][3][3] == 0xA6,
+              "compile-time key expansion");
+
+// Runs an AES<Nk> engine on the FIPS-197 appendix C example, through both
+// of its engines, and against the matching AESBase class.
+template <int Nk, typename Adapter>
+void check_template_engine(const char* expected_hex) {
+  unsigned char key[Nk][4];
+  for (int i = 0; i < 4 * Nk; i++) (&key[0][0])[i] = (unsigned char)i;
+  uint8_t plain_text[16];
+  for (int i = 0; i < 16; i++) plain_text[i] = (uint8_t)(i * 0x11);
+  std::vector<uint8_t> expected = from_hex(expected_hex);
+
+  const AES<Nk> engine(&key[0][0]);
+  uint8_t out[16];
+  engine.encrypt_blocks(plain_text, out, 1);
+  assert(memcmp(out, expected.data(), 16) == 0);
+  engine.decrypt_blocks(out, out, 1);
+  assert(memcmp(out, plain_text, 16) == 0);
+  engine.ttable_encrypt_blocks(plain_text, out, 1);
+  assert(memcmp(out, expected.data(), 16) == 0);
+  engine.ttable_decrypt_blocks(out, out, 1);
+  assert(memcmp(out, plain_text, 16) == 0);
+
+  Adapter adapter(key);
+  unsigned char block[4][4], result[4][4];
+  memcpy(block, plain_text, 16);
+  adapter.encrypt_reference(block, result);
+  assert(memcmp(result, expected.data(), 16) == 0);
+}
+
+void test_aes_template() {
+  std::cout << "Testing AES<Nk> template." << std::endl;
+  check_template_engine<4, AES128>("69c4e0d86a7b0430d8cdb78070b4c55a");
+  check_template_engine<6, AES192>("dda97ca4864cdfe06eaf70a0ec0d7191");
+  check_template_engine<8, AES256>("8ea2b7ca516745bfeafc49904b496089");
+
+  uint8_t plain_text[16] = {0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96,
+                            0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A};
+  uint8_t cipher_text[16];
+  FIPS_CIPHER_128.encrypt_blocks(plain_text, cipher_text, 1);
+  std::vector<uint8_t> expected = from_hex("3ad77bb40d7a3660a89ecaf32466ef97");
+  assert(memcmp(cipher_text, expected.data(), 16) == 0);
+  std::cout << "Test cases passed for AES<Nk> template." << std::endl;
+}
+
+// NIST SP 800-38A F.5.1 and F.5.5.
+void test_ctr_nist_vectors() {
+  std::cout << "Testing CTR mode." << std::endl;
+  unsigned char key_128[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                                 {0x28, 0xAE, 0xD2, 0xA6},
+                                 {0xAB, 0xF7, 0x15, 0x88},
+                                 {0x09, 0xCF, 0x4F, 0x3C}};
+  unsigned char key_256[8][4] = {
+      {0x60, 0x3D, 0xEB, 0x10}, {0x15, 0xCA, 0x71, 0xBE},
+      {0x2B, 0x73, 0xAE, 0xF0}, {0x85, 0x7D, 0x77, 0x81},
+      {0x1F, 0x35, 0x2C, 0x07}, {0x3B, 0x61, 0x08, 0xD7},
+      {0x2D, 0x98, 0x10, 0xA3}, {0x09, 0x14, 0xDF, 0xF4}};
+  std::vector<uint8_t> counter = from_hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+  std::vector<uint8_t> plain_text = from_hex(
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+      "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+  std::vector<uint8_t> expected_128 = from_hex(
+      "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+      "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee");
+  std::vector<uint8_t> expected_256 = from_hex(
+      "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+      "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6");
+
+  AES128 aes128(key_128);
+  AES256 aes256(key_256);
+  std::vector<uint8_t> out(plain_text.size());
+  AESCTR(aes128, counter.data()).process(plain_text.data(), out.data(),
+                                         out.size());
+  assert(out == expected_128);
+  AESCTR(aes256, counter.data()).process(plain_text.data(), out.data(),
+                                         out.size());
+  assert(out == expected_256);
+
+  // Feeding the message in odd-sized pieces gives the same stream.
+  AESCTR pieces(aes128, counter.data());
+  size_t sizes[] = {1, 15, 17, 3, 28};
+  size_t offset = 0;
+  for (size_t size : sizes) {
+    pieces.process(plain_text.data() + offset, out.data() + offset, size);
+    offset += size;
+  }
+  assert(out == expected_128);
+  std::cout << "Test cases passed for CTR mode." << std::endl;
+}
+
+void test_ctr_threads_match_single_thread() {
+  std::cout << "Testing multi-threaded CTR mode." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  // Start just below a 64-bit carry so ranges must propagate it.
+  std::vector<uint8_t> counter = from_hex("0000000000000000fffffffffffffff0");
+  std::vector<uint8_t> plain_text(1000003);
+  for (size_t i = 0; i < plain_text.size(); i++) {
+    plain_text[i] = (uint8_t)(i * 31 + 7);
+  }
+  std::vector<uint8_t> expected(plain_text.size());
+  AESCTR(aes128, counter.data()).process(plain_text.data(), expected.data(),
+                                         expected.size());
+
+  unsigned int thread_counts[] = {2, 3, 7};
+  for (unsigned int threads : thread_counts) {
+    std::vector<uint8_t> out(plain_text);
+    AESCTR ctr(aes128, counter.data(), threads);
+    ctr.process(out.data(), out.data(), 5);
+    ctr.process(out.data() + 5, out.data() + 5, out.size() - 5);
+    assert(out == expected);
+  }
+  std::cout << "Test cases passed for multi-threaded CTR mode." << std::endl;
+}
+
+void test_key_cache() {
+  std::cout << "Testing expanded-key cache." << std::endl;
+  AESKeyCache<8> cache(64, 4);
+  assert(cache.capacity() >= 64);
+  unsigned char keys[200][32];
+  for (int k = 0; k < 200; k++) {
+    for (int i = 0; i < 32; i++) keys[k][i] = (unsigned char)(k * 37 + i);
+  }
+
+  // A hot set that fits is served from the cache after the first pass.
+  for (int pass = 0; pass < 3; pass++) {
+    for (int k = 0; k < 32; k++) {
+      AES<8> cached = cache.get(keys[k]);
+      AES<8> expected(keys[k]);
+      assert(memcmp(cached.decrypt_keys(), expected.decrypt_keys(),
+                    15 * 16) == 0);
+    }
+  }
+  AESKeyCache<8>::Stats stats = cache.stats();
+  assert(stats.misses == 32 && stats.hits == 64 && stats.evictions == 0);
+  assert(stats.size == 32);
+
+  // Cycling through more keys than fit evicts, and every lookup still
+  // returns the right schedule.
+  uint8_t block[16] = {0};
+  for (int pass = 0; pass < 2; pass++) {
+    for (int k = 0; k < 200; k++) {
+      uint8_t expected[16], out[16];
+      AES<8>(keys[k]).encrypt_blocks(block, expected, 1);
+      cache.encrypt_blocks(keys[k], block, out, 1);
+      assert(memcmp(out, expected, 16) == 0);
+    }
+  }
+  stats = cache.stats();
+  assert(stats.evictions > 0 && stats.size <= cache.capacity());
+  assert(stats.hits + stats.misses == 96 + 400);
+
+  // Concurrent lookups, misses and evictions.
+  std::vector<std::thread> workers;
+  bool failed[4] = {false, false, false, false};
+  for (int t = 0; t < 4; t++) {
+    workers.emplace_back([&cache, &keys, &failed, t] {
+      for (int i = 0; i < 2000; i++) {
+        int k = (i * 7 + t * 13) % (i % 3 == 0 ? 200 : 40);
+        uint8_t in[16] = {(uint8_t)i}, out[16], back[16];
+        cache.encrypt_blocks(keys[k], in, out, 1);
+        AES256(cache.get(keys[k])).decrypt_blocks(out, back, 1);
+        if (memcmp(in, back, 16) != 0) failed[t] = true;
+      }
+    });
+  }
+  for (std::thread& worker : workers) worker.join();
+  for (bool f : failed) assert(!f);
+  std::cout << "Test cases passed for expanded-key cache." << std::endl;
+}
+
+struct GCMVector {
+  const char* key;
+  const char* iv;
+  const char* aad;
+  const char* plain_text;
+  const char* cipher_text;
+  const char* tag;
+};
+
+// Test cases 1-6 and 16 from the GCM specification (McGrew and Viega),
+// which NIST SP 800-38D refers to.
+const GCMVector GCM_VECTORS[] = {
+    {"00000000000000000000000000000000", "000000000000000000000000", "", "",
+     "", "58e2fccefa7e3061367f1d57a4e7455a"},
+    {"00000000000000000000000000000000", "000000000000000000000000", "",
+     "00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78",
+     "ab6e47d42cec13bdf53a67b21257bddf"},
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+     "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+     "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+     "4d5c2af327cd64a62cf35abd2ba6fab4"},
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+     "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+     "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+     "5bc94fbc3221a5db94fae95ae7121a47"},
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbad",
+     "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c7423"
+     "73806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+     "3612d2e79e3b0785561be14aaca2fccb"},
+    {"feffe9928665731c6d6a8f9467308308",
+     "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728"
+     "c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+     "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca7"
+     "01e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+     "619cc5aefffe0bfa462af43c1699d050"},
+    {"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+     "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+     "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+     "76fc6ece0f4e1768cddf8853bb2d551b"},
+};
+
+void check_gcm_vector(AESGCM& gcm, const GCMVector& vector) {
+  std::vector<uint8_t> iv = from_hex(vector.iv);
+  std::vector<uint8_t> aad = from_hex(vector.aad);
+  std::vector<uint8_t> plain_text = from_hex(vector.plain_text);
+  std::vector<uint8_t> cipher_text = from_hex(vector.cipher_text);
+  std::vector<uint8_t> tag = from_hex(vector.tag);
+  std::vector<uint8_t> out(plain_text.size() + 1);
+  uint8_t computed_tag[16];
+
+  gcm.encrypt(iv.data(), iv.size(), aad.data(), aad.size(),
+              plain_text.data(), out.data(), plain_text.size(), computed_tag,
+              16);
+  assert(std::equal(cipher_text.begin(), cipher_text.end(), out.begin()));
+  assert(memcmp(computed_tag, tag.data(), 16) == 0);
+
+  // Streaming in uneven pieces, decrypting in place.
+  out.assign(cipher_text.begin(), cipher_text.end());
+  gcm.start(iv.data(), iv.size());
+  for (size_t offset = 0; offset < aad.size(); offset += 7) {
+    gcm.update_aad(aad.data() + offset,
+                   std::min<size_t>(7, aad.size() - offset));
+  }
+  for (size_t offset = 0; offset < out.size(); offset += 19) {
+    size_t length = std::min<size_t>(19, out.size() - offset);
+    gcm.decrypt_update(out.data() + offset, out.data() + offset, length);
+  }
+  assert(out == plain_text);
+  bool valid = gcm.verify(tag.data(), 16);
+  assert(valid);
+
+  // Truncated tags of the lengths SP 800-38D allows; others are refused
+  // without writing or reading past the tag.
+  for (size_t tag_length = 0; tag_length <= 32; tag_length++) {
+    bool allowed = AESGCM::valid_tag_length(tag_length);
+    assert(allowed == ((tag_length >= 12 && tag_length <= 16) ||
+                       tag_length == 4 || tag_length == 8));
+    std::vector<uint8_t> short_tag(tag_length + 1, 0xAA);
+    assert(gcm.encrypt(iv.data(), iv.size(), aad.data(), aad.size(),
+                       plain_text.data(), out.data(), plain_text.size(),
+                       short_tag.data(), tag_length) == allowed);
+    if (allowed) {
+      assert(memcmp(short_tag.data(), tag.data(), tag_length) == 0);
+    } else {
+      for (uint8_t byte : short_tag) assert(byte == 0xAA);
+    }
+    assert(short_tag[tag_length] == 0xAA);
+    short_tag.resize(tag_length + 16);
+    memcpy(short_tag.data(), tag.data(), 16);
+    assert(gcm.decrypt(iv.data(), iv.size(), aad.data(), aad.size(),
+                       cipher_text.data(), out.data(), cipher_text.size(),
+                       short_tag.data(), tag_length) == allowed);
+  }
+
+  tag[0] ^= 1;
+  valid = gcm.decrypt(iv.data(), iv.size(), aad.data(), aad.size(),
+                      cipher_text.data(), out.data(), cipher_text.size(),
+                      tag.data(), 16);
+  assert(!valid);
+}
+
+void test_gcm_nist_vectors() {
+  std::cout << "Testing GCM mode." << std::endl;
+  for (const GCMVector& vector : GCM_VECTORS) {
+    std::vector<uint8_t> key = from_hex(vector.key);
+    unsigned char key_128[4][4], key_256[8][4];
+    AESBase* cipher;
+    if (key.size() == 16) {
+      memcpy(key_128, key.data(), 16);
+      cipher = new AES128(key_128);
+    } else {
+      memcpy(key_256, key.data(), 32);
+      cipher = new AES256(key_256);
+    }
+    AESGCM gcm(*cipher);
+    gcm.set_ghash_backend(GHASHBackend::kTable);
+    check_gcm_vector(gcm, vector);
+    if (gcm.set_ghash_backend(GHASHBackend::kPCLMUL)) {
+      check_gcm_vector(gcm, vector);
+    }
+    delete cipher;
+  }
+
+  // Messages SP 800-38D does not allow fail instead of producing a tag.
+  unsigned char key[4][4] = {{0}};
+  AES128 aes128(key);
+  AESGCM gcm(aes128);
+  uint8_t iv[12] = {0}, data[32] = {0}, tag[16], expected[16];
+  assert(gcm.encrypt(iv, 12, data, 16, data, data, 32, expected, 16));
+  // An empty IV.
+  assert(!gcm.start(iv, 0));
+  assert(!gcm.encrypt_update(data, data, 16));
+  assert(!gcm.finish(tag, 16));
+  assert(!gcm.encrypt(iv, 0, nullptr, 0, data, data, 16, tag, 16));
+  // AAD after data.
+  assert(gcm.start(iv, 12));
+  assert(gcm.encrypt_update(data, data, 16));
+  assert(!gcm.update_aad(data, 16));
+  assert(!gcm.finish(tag, 16));
+  // Data past 2^36 - 32 bytes, which would wrap the counter to J0; the
+  // refused update reads and writes nothing.
+  assert(gcm.start(iv, 12));
+  assert(!gcm.encrypt_update(data, data, AESGCM::kMaxDataBytes + 1));
+  assert(!gcm.finish(tag, 16));
+  assert(gcm.start(iv, 12));
+  assert(gcm.encrypt_update(data, data, 16));
+  assert(!gcm.encrypt_update(data, data, AESGCM::kMaxDataBytes - 15));
+  assert(!gcm.verify(tag, 16));
+  // The next message starts clean.
+  memset(data, 0, sizeof(data));
+  assert(gcm.encrypt(iv, 12, data, 16, data, data, 32, tag, 16));
+  assert(memcmp(tag, expected, 16) == 0);
+  std::cout << "Test cases passed for GCM mode." << std::endl;
+}
+
+// NIST SP 800-38A F.2.1 and F.2.5.
+void test_cbc_nist_vectors() {
+  std::cout << "Testing CBC mode." << std::endl;
+  unsigned char key_128[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                                 {0x28, 0xAE, 0xD2, 0xA6},
+                                 {0xAB, 0xF7, 0x15, 0x88},
+                                 {0x09, 0xCF, 0x4F, 0x3C}};
+  unsigned char key_256[8][4] = {
+      {0x60, 0x3D, 0xEB, 0x10}, {0x15, 0xCA, 0x71, 0xBE},
+      {0x2B, 0x73, 0xAE, 0xF0}, {0x85, 0x7D, 0x77, 0x81},
+      {0x1F, 0x35, 0x2C, 0x07}, {0x3B, 0x61, 0x08, 0xD7},
+      {0x2D, 0x98, 0x10, 0xA3}, {0x09, 0x14, 0xDF, 0xF4}};
+  std::vector<uint8_t> iv = from_hex("000102030405060708090a0b0c0d0e0f");
+  std::vector<uint8_t> plain_text = from_hex(
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+      "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+  std::vector<uint8_t> expected_128 = from_hex(
+      "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+      "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7");
+  std::vector<uint8_t> expected_256 = from_hex(
+      "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+      "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b");
+
+  AES128 aes128(key_128);
+  AES256 aes256(key_256);
+  std::vector<uint8_t> out(plain_text.size());
+  std::vector<uint8_t> chain(iv);
+  AESCBC(aes128).encrypt_blocks(chain.data(), plain_text.data(), out.data(),
+                                4);
+  assert(out == expected_128);
+  assert(std::equal(chain.begin(), chain.end(), out.end() - 16));
+  chain = iv;
+  AESCBC(aes256).encrypt_blocks(chain.data(), plain_text.data(), out.data(),
+                                4);
+  assert(out == expected_256);
+  chain = iv;
+  AESCBC(aes256).decrypt_blocks(chain.data(), out.data(), out.data(), 4);
+  assert(out == plain_text);
+  std::cout << "Test cases passed for CBC mode." << std::endl;
+}
+
+void test_cbc_padding_threads_and_lanes() {
+  std::cout << "Testing CBC padding, threads and lanes." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  std::vector<uint8_t> iv = from_hex("000102030405060708090a0b0c0d0e0f");
+  std::vector<uint8_t> plain_text(300007);
+  for (size_t i = 0; i < plain_text.size(); i++) {
+    plain_text[i] = (uint8_t)(i * 17 + 3);
+  }
+
+  AESCBC cbc(aes128);
+  std::vector<uint8_t> cipher_text(AESCBC::padded_length(plain_text.size()));
+  size_t cipher_length = cbc.encrypt(iv.data(), plain_text.data(),
+                                     plain_text.size(), cipher_text.data());
+  assert(cipher_length == cipher_text.size());
+
+  unsigned int thread_counts[] = {1, 3};
+  for (unsigned int threads : thread_counts) {
+    std::vector<uint8_t> out(cipher_text);
+    size_t plain_length;
+    cbc.set_threads(threads);
+    bool valid = cbc.decrypt(iv.data(), out.data(), out.size(), out.data(),
+                             &plain_length);
+    assert(valid && plain_length == plain_text.size());
+    assert(std::equal(plain_text.begin(), plain_text.end(), out.begin()));
+  }
+
+  // Corrupting the final block breaks the padding.
+  cipher_text[cipher_text.size() - 17] ^= 0x01;
+  std::vector<uint8_t> out(cipher_text.size());
+  size_t plain_length;
+  bool valid = cbc.decrypt(iv.data(), cipher_text.data(), cipher_text.size(),
+                           out.data(), &plain_length);
+  assert(!valid && plain_length == 0);
+
+  // Messages of many lengths, more of them than lanes, must match one-by-one
+  // encryption.
+  const size_t count = 21;
+  std::vector<std::vector<uint8_t>> outputs(count);
+  std::vector<AESCBC::Message> messages(count);
+  for (size_t i = 0; i < count; i++) {
+    size_t length = (i * 37) % 200;
+    outputs[i].resize(AESCBC::padded_length(length));
+    messages[i] = {iv.data(), plain_text.data() + i, length,
+                   outputs[i].data()};
+  }
+  cbc.encrypt_messages(messages.data(), count);
+  for (size_t i = 0; i < count; i++) {
+    std::vector<uint8_t> expected(outputs[i].size());
+    cbc.encrypt(iv.data(), messages[i].in, messages[i].length,
+                expected.data());
+    assert(outputs[i] == expected);
+  }
+  std::cout << "Test cases passed for CBC padding, threads and lanes."
+            << std::endl;
+}
+
+// IEEE 1619 vectors 1 and 2, ciphertext stealing and multi-sector calls.
+void test_xts() {
+  std::cout << "Testing XTS mode." << std::endl;
+  unsigned char zero_key[4][4] = {{0}};
+  AES128 zero(zero_key);
+  std::vector<uint8_t> plain_text(32, 0);
+  std::vector<uint8_t> out(32);
+  AESXTS(zero, zero).encrypt_sector(0, plain_text.data(), out.data(), 32);
+  assert(out == from_hex("917cf69ebd68b2ec9b9fe9a3eadda692"
+                         "cd43d2f59598ed858c02c2652fbf922e"));
+
+  unsigned char key_1[4][4], key_2[4][4];
+  memset(key_1, 0x11, 16);
+  memset(key_2, 0x22, 16);
+  AES128 data_cipher(key_1);
+  AES128 tweak_cipher(key_2);
+  AESXTS xts(data_cipher, tweak_cipher);
+  plain_text.assign(32, 0x44);
+  xts.encrypt_sector(0x3333333333ull, plain_text.data(), out.data(), 32);
+  assert(out == from_hex("c454185e6a16936e39334038acef838b"
+                         "fb186fff7480adc4289382ecd6d394f0"));
+  xts.decrypt_sector(0x3333333333ull, out.data(), out.data(), 32);
+  assert(out == plain_text);
+  assert(!xts.encrypt_sector(0, plain_text.data(), out.data(), 15));
+
+  // Doubling carries bit 63 into bit 64 and reduces bit 127.
+  uint8_t tweak[16] = {0};
+  tweak[7] = 0x80;
+  tweak[15] = 0x80;
+  AESXTS::multiply_alpha(tweak);
+  uint8_t doubled[16] = {0x87, 0, 0, 0, 0, 0, 0, 0, 0x01};
+  assert(memcmp(tweak, doubled, 16) == 0);
+
+  // A partial last block steals from the block before it: its ciphertext is
+  // the head of what that block encrypts to on its own, and whole blocks
+  // before the pair are unaffected.
+  plain_text.resize(80);
+  for (size_t i = 0; i < plain_text.size(); i++) {
+    plain_text[i] = (uint8_t)(i * 7 + 1);
+  }
+  std::vector<uint8_t> whole(64);
+  xts.encrypt_sector(9, plain_text.data(), whole.data(), 64);
+  for (size_t length = 65; length < 80; length++) {
+    std::vector<uint8_t> stolen(length);
+    xts.encrypt_sector(9, plain_text.data(), stolen.data(), length);
+    assert(std::equal(whole.begin(), whole.begin() + 48, stolen.begin()));
+    assert(std::equal(stolen.begin() + 64, stolen.end(),
+                      whole.begin() + 48));
+    xts.decrypt_sector(9, stolen.data(), stolen.data(), length);
+    assert(std::equal(stolen.begin(), stolen.end(), plain_text.begin()));
+  }
+
+  // Multi-sector calls match sector-by-sector ones for any thread count.
+  const size_t sector_size = 4100;
+  const size_t nsectors = 100;
+  plain_text.resize(sector_size * nsectors);
+  for (size_t i = 0; i < plain_text.size(); i++) {
+    plain_text[i] = (uint8_t)(i * 13 + 5);
+  }
+  std::vector<uint8_t> expected(plain_text.size());
+  for (size_t i = 0; i < nsectors; i++) {
+    xts.encrypt_sector(1000 + i, plain_text.data() + i * sector_size,
+                       expected.data() + i * sector_size, sector_size);
+  }
+  unsigned int thread_counts[] = {1, 3};
+  for (unsigned int threads : thread_counts) {
+    xts.set_threads(threads);
+    out = plain_text;
+    xts.encrypt_sectors(1000, out.data(), out.data(), sector_size, nsectors);
+    assert(out == expected);
+    xts.decrypt_sectors(1000, out.data(), out.data(), sector_size, nsectors);
+    assert(out == plain_text);
+  }
+  std::cout << "Test cases passed for XTS mode." << std::endl;
+}
+
+// RFC 4493 section 4 examples, and lanes matching one-by-one MACs.
+void test_cmac() {
+  std::cout << "Testing CMAC." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  AESCMAC cmac(aes128);
+  std::vector<uint8_t> message = from_hex(
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+      "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+  const size_t lengths[] = {0, 16, 40, 64};
+  const char* expected[] = {"bb1d6929e95937287fa37d129b756746",
+                            "070a16b46b4d4144f79bdd9dd04a287c",
+                            "dfa66747de9ae63030ca32611497c827",
+                            "51f0bebf7e3b9d92fc49741779363cfe"};
+  for (int i = 0; i < 4; i++) {
+    std::vector<uint8_t> tag(16);
+    cmac.mac(message.data(), lengths[i], tag.data());
+    assert(tag == from_hex(expected[i]));
+    assert(cmac.verify(message.data(), lengths[i], tag.data(), 16));
+    assert(cmac.verify(message.data(), lengths[i], tag.data(), 8));
+    tag[15] ^= 1;
+    assert(!cmac.verify(message.data(), lengths[i], tag.data(), 16));
+  }
+
+  // More messages than lanes, of lengths around block boundaries.
+  std::vector<uint8_t> data(4096);
+  for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 7 + 3);
+  const size_t count = 37;
+  std::vector<uint8_t> tags(16 * count);
+  std::vector<AESCMAC::Message> messages(count);
+  for (size_t i = 0; i < count; i++) {
+    size_t length = (i * 23) % 100;
+    messages[i] = {data.data() + 3 * i, length, tags.data() + 16 * i};
+  }
+  cmac.mac_messages(messages.data(), count);
+  for (size_t i = 0; i < count; i++) {
+    uint8_t tag[16];
+    cmac.mac(messages[i].in, messages[i].length, tag);
+    assert(memcmp(tag, tags.data() + 16 * i, 16) == 0);
+  }
+  std::cout << "Test cases passed for CMAC." << std::endl;
+}
+
+// A deterministic entropy source for the DRBG tests: 0, 1, 2, ... across
+// calls.
+uint8_t g_test_entropy_next = 0;
+void test_entropy(uint8_t* out, size_t length) {
+  for (size_t i = 0; i < length; i++) out[i] = g_test_entropy_next++;
+}
+
+void test_drbg() {
+  std::cout << "Testing CTR_DRBG." << std::endl;
+  uint8_t entropy[AESCTRDRBG::kSeedBytes];
+  for (size_t i = 0; i < sizeof(entropy); i++) entropy[i] = (uint8_t)i;
+
+  // Computed with an independent CTR_DRBG model over OpenSSL's AES-256-ECB.
+  AESCTRDRBG drbg(entropy, nullptr, 0);
+  std::vector<uint8_t> out(64);
+  drbg.generate_request(out.data(), 64, nullptr, 0);
+  assert(out == from_hex("061550234d158c5ec95595fe04ef7a25"
+                         "767f2e24cc2bc479d09d86dc9abcfde7"
+                         "056a8c266f9ef97ed08541dbd2e1ffa1"
+                         "9810f5392d076276ef41277c3ab6e94a"));
+  out.resize(32);
+  drbg.generate_request(out.data(), 32, nullptr, 0);
+  assert(out == from_hex("04562ad35e8ecafaafda16981cdaa147"
+                         "606beea62801342af13c8b5535f72f94"));
+
+  // Buffered output is the stream of full-size requests, however it is cut.
+  const size_t request = AESCTRDRBG::kBufferBytes;
+  const size_t total = 3 * request + 100;
+  std::vector<uint8_t> requests(total);
+  AESCTRDRBG unbuffered(entropy, nullptr, 0);
+  for (size_t done = 0; done < total; done += request) {
+    size_t count = std::min(total - done, request);
+    unbuffered.generate_request(requests.data() + done, count, nullptr, 0);
+  }
+  std::vector<uint8_t> buffered(total);
+  AESCTRDRBG chunked(entropy, nullptr, 0);
+  for (size_t done = 0, step = 1; done < total; step = step * 3 % 1000 + 1) {
+    size_t count = std::min(total - done, step);
+    chunked.generate(buffered.data() + done, count);
+    done += count;
+  }
+  assert(buffered == requests);
+
+  // Personalization, additional input and reseeding all change the stream.
+  uint8_t first[16], second[16];
+  AESCTRDRBG plain(entropy, nullptr, 0);
+  plain.generate(first, 16);
+  const uint8_t label[] = "test";
+  AESCTRDRBG personalized(entropy, label, 4);
+  personalized.generate(second, 16);
+  assert(memcmp(first, second, 16) != 0);
+  AESCTRDRBG additional(entropy, nullptr, 0);
+  additional.generate_request(second, 16, label, 4);
+  assert(memcmp(first, second, 16) != 0);
+  AESCTRDRBG reseeded(entropy, nullptr, 0);
+  reseeded.reseed(entropy);
+  reseeded.generate(second, 16);
+  assert(memcmp(first, second, 16) != 0);
+
+  // Personalization and additional input over kSeedBytes are rejected, not
+  // cut short.
+  uint8_t long_input[AESCTRDRBG::kSeedBytes + 1] = {0};
+  bool thrown = false;
+  try {
+    AESCTRDRBG too_long(entropy, long_input, sizeof(long_input));
+  } catch (const std::length_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  memset(second, 0xAA, 16);
+  assert(!additional.generate_request(second, 16, long_input,
+                                      sizeof(long_input)));
+  for (uint8_t byte : second) assert(byte == 0xAA);
+  assert(!additional.reseed(entropy, long_input, sizeof(long_input)));
+  assert(additional.generate_request(second, 16, long_input,
+                                     AESCTRDRBG::kSeedBytes));
+  assert(additional.reseed(entropy, long_input, AESCTRDRBG::kSeedBytes));
+
+  // With prediction resistance every call reseeds from the source, so two
+  // generators fed the same entropy agree and one without it differs.
+  g_test_entropy_next = 0;
+  AESCTRDRBG resistant(nullptr, 0, test_entropy);
+  resistant.set_prediction_resistance(true);
+  resistant.generate(first, 16);
+  assert(g_test_entropy_next == 2 * AESCTRDRBG::kSeedBytes);
+  g_test_entropy_next = 0;
+  AESCTRDRBG manual(nullptr, 0, test_entropy);
+  manual.reseed();
+  manual.generate_request(second, 16, nullptr, 0);
+  assert(memcmp(first, second, 16) == 0);
+
+  // A reseed interval of one request reseeds on every refill.
+  g_test_entropy_next = 0;
+  AESCTRDRBG interval(nullptr, 0, test_entropy);
+  interval.set_reseed_interval(1);
+  std::vector<uint8_t> skip(AESCTRDRBG::kBufferBytes + 1);
+  interval.generate(skip.data(), skip.size());
+  assert(g_test_entropy_next == 2 * AESCTRDRBG::kSeedBytes);
+
+  // Each thread has its own generator.
+  uint64_t values[2];
+  for (int t = 0; t < 2; t++) {
+    std::thread thread([&values, t] {
+      values[t] = AESCTRDRBG::thread_instance().next<uint64_t>();
+    });
+    thread.join();
+  }
+  assert(values[0] != values[1]);
+  std::cout << "Test cases passed for CTR_DRBG." << std::endl;
+}
+
+// Runs every batch size up to a few lane groups, in place, with the
+// FIPS-197 appendix C example in one lane and pseudorandom keys in the rest.
+template <int Nk>
+void check_key_batch(const char* expected_hex) {
+  typedef typename AESKeyBatch<Nk>::Pair Pair;
+  const size_t kKeyBytes = 4 * Nk;
+  std::vector<uint8_t> expected = from_hex(expected_hex);
+  for (size_t count = 0; count <= 3 * AESKeyBatch<Nk>::kLanes + 1; count++) {
+    std::vector<unsigned char> keys(kKeyBytes * count);
+    std::vector<uint8_t> plain(16 * count), data(16 * count);
+    for (size_t i = 0; i < keys.size(); i++) keys[i] = (uint8_t)(i * 29 + 7);
+    for (size_t i = 0; i < plain.size(); i++) plain[i] = (uint8_t)(i * 13);
+    size_t fips = count / 2;
+    if (count > 0) {
+      for (size_t i = 0; i < kKeyBytes; i++) keys[kKeyBytes * fips + i] = i;
+      for (int i = 0; i < 16; i++) plain[16 * fips + i] = (uint8_t)(i * 0x11);
+    }
+    data = plain;
+    std::vector<Pair> pairs(count);
+    for (size_t i = 0; i < count; i++) {
+      pairs[i] = {&keys[kKeyBytes * i], &data[16 * i], &data[16 * i]};
+    }
+
+    AESKeyBatch<Nk>::encrypt(pairs.data(), count);
+    for (size_t i = 0; i < count; i++) {
+      uint8_t out[16];
+      AES<Nk>(&keys[kKeyBytes * i]).encrypt_blocks(&plain[16 * i], out, 1);
+      assert(memcmp(out, &data[16 * i], 16) == 0);
+    }
+    if (count > 0) {
+      assert(memcmp(&data[16 * fips], expected.data(), 16) == 0);
+    }
+    AESKeyBatch<Nk>::decrypt(pairs.data(), count);
+    assert(data == plain);
+  }
+}
+
+void test_key_batch() {
+  std::cout << "Testing key-agile batches." << std::endl;
+  check_key_batch<4>("69c4e0d86a7b0430d8cdb78070b4c55a");
+  check_key_batch<6>("dda97ca4864cdfe06eaf70a0ec0d7191");
+  check_key_batch<8>("8ea2b7ca516745bfeafc49904b496089");
+  std::cout << "Test cases passed for key-agile batches." << std::endl;
+}
+
+// Checks the FIPS-197 appendix C example, then every block count up to a
+// few AES-NI groups against AES<Nk> on both engines.
+template <int Nk>
+void check_compact(const char* expected_hex) {
+  static_assert(sizeof(AESCompactEncryptor<Nk>) == 4 * Nk, "context size");
+  static_assert(sizeof(AESCompactDecryptor<Nk>) == 4 * Nk, "context size");
+  unsigned char key[4 * Nk];
+  for (int i = 0; i < 4 * Nk; i++) key[i] = (unsigned char)i;
+  uint8_t plain[16];
+  for (int i = 0; i < 16; i++) plain[i] = (uint8_t)(i * 0x11);
+  AESCompactEncryptor<Nk> encryptor(key);
+  AESCompactDecryptor<Nk> decryptor(key);
+  uint8_t block[16];
+  encryptor.encrypt_block(plain, block);
+  assert(memcmp(block, from_hex(expected_hex).data(), 16) == 0);
+  decryptor.decrypt_block(block, block);
+  assert(memcmp(block, plain, 16) == 0);
+
+  for (int i = 0; i < 4 * Nk; i++) key[i] = (unsigned char)(i * 47 + 3);
+  AES<Nk> engine(key);
+  AESCompactEncryptor<Nk> other_encryptor(key);
+  AESCompactDecryptor<Nk> other_decryptor(key);
+  for (size_t count = 0; count <= 25; count++) {
+    std::vector<uint8_t> data(16 * count), expected(16 * count), out(data);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 31);
+    engine.encrypt_blocks(data.data(), expected.data(), count);
+    other_encryptor.encrypt_blocks(data.data(), out.data(), count);
+    assert(out == expected);
+    other_encryptor.ttable_encrypt_blocks(data.data(), out.data(), count);
+    assert(out == expected);
+    engine.decrypt_blocks(data.data(), expected.data(), count);
+    other_decryptor.decrypt_blocks(data.data(), out.data(), count);
+    assert(out == expected);
+    other_decryptor.ttable_decrypt_blocks(data.data(), out.data(), count);
+    assert(out == expected);
+    // In place.
+    other_encryptor.encrypt_blocks(data.data(), data.data(), count);
+    other_decryptor.decrypt_blocks(data.data(), data.data(), count);
+    for (size_t i = 0; i < data.size(); i++) {
+      assert(data[i] == (uint8_t)(i * 31));
+    }
+  }
+}
+
+void test_compact() {
+  std::cout << "Testing compact key contexts." << std::endl;
+  check_compact<4>("69c4e0d86a7b0430d8cdb78070b4c55a");
+  check_compact<6>("dda97ca4864cdfe06eaf70a0ec0d7191");
+  check_compact<8>("8ea2b7ca516745bfeafc49904b496089");
+  std::cout << "Test cases passed for compact key contexts." << std::endl;
+}
+
+void test_container() {
+  std::cout << "Testing seekable container." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  char path[] = "/tmp/aes_container_test_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  const size_t chunk_size = 4096;
+  std::vector<uint8_t> data(10 * chunk_size + 123);
+  for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(i * 7 + i / 300);
+  AESThreadPool pool(3);
+  for (int tagged = 0; tagged < 2; tagged++) {
+    AESContainerWriter writer(aes128, tagged != 0, chunk_size);
+    assert(writer.open(path));
+    for (size_t done = 0, step = 1; done < data.size();
+         step = step * 5 % 7919) {
+      size_t count = std::min(data.size() - done, step);
+      assert(writer.write(data.data() + done, count));
+      done += count;
+    }
+    assert(writer.close());
+
+    // Ranges within one chunk, across boundaries and over the whole file,
+    // serially and on a pool.
+    AESContainerReader reader(aes128);
+    assert(reader.open(path));
+    assert(reader.size() == data.size());
+    for (unsigned int threads = 1; threads <= 4; threads += 3) {
+      reader.set_threads(threads);
+      reader.set_pool(pool);
+      const size_t lengths[] = {0, 1, 15, 17, 4096, 9000, data.size()};
+      for (size_t length : lengths) {
+        for (uint64_t offset = 0; offset + length <= data.size();
+             offset += 997) {
+          std::vector<uint8_t> out(length);
+          assert(reader.read(offset, out.data(), length));
+          assert(std::equal(out.begin(), out.end(), data.begin() + offset));
+        }
+      }
+    }
+    uint8_t byte;
+    assert(!reader.read(data.size(), &byte, 1));
+    reader.close();
+
+    // A flipped ciphertext bit fails its chunk if tagged and flips the same
+    // plaintext bit if not; other chunks still read.
+    fd = open(path, O_RDWR);
+    uint64_t position = AESContainer::kHeaderBytes +
+                        3 * (chunk_size + (tagged ? 16 : 0)) + 5;
+    assert(pread(fd, &byte, 1, (off_t)position) == 1);
+    byte ^= 1;
+    assert(pwrite(fd, &byte, 1, (off_t)position) == 1);
+    close(fd);
+    assert(reader.open(path));
+    uint8_t out[16];
+    assert(reader.read(3 * chunk_size, out, 16) != (tagged != 0));
+    if (!tagged) assert(out[5] == (data[3 * chunk_size + 5] ^ 1));
+    assert(reader.read(2 * chunk_size, out, 16));
+    assert(memcmp(out, &data[2 * chunk_size], 16) == 0);
+    reader.close();
+  }
+
+  // A tagged file cut at a chunk boundary, with its length patched to
+  // match, no longer opens; neither does one under another key.
+  AESContainerWriter writer(aes128, true, chunk_size);
+  assert(writer.open(path));
+  assert(writer.write(data.data(), data.size()));
+  assert(writer.close());
+  AESContainerReader reader(aes128);
+  assert(reader.open(path));
+  reader.close();
+  unsigned char other_key[4][4] = {{1}};
+  AES128 other(other_key);
+  AESContainerReader wrong_key(other);
+  assert(!wrong_key.open(path));
+  fd = open(path, O_RDWR);
+  uint8_t encoded[AESContainer::kHeaderBytes];
+  assert(pread(fd, encoded, sizeof(encoded), 0) == (ssize_t)sizeof(encoded));
+  AESContainer::Header header;
+  assert(AESContainer::decode_header(encoded, &header));
+  header.length = 4 * chunk_size;
+  AESContainer::encode_header(header, encoded);
+  assert(pwrite(fd, encoded, sizeof(encoded), 0) == (ssize_t)sizeof(encoded));
+  assert(ftruncate(fd, (off_t)AESContainer::file_size(header)) == 0);
+  close(fd);
+  assert(!reader.open(path));
+
+  // A length that would wrap the expected file size around to the header
+  // alone is rejected before any chunk is touched.
+  header.flags = AESContainer::kTagged;
+  header.chunk_size = 0xFFFFFFF0;
+  header.length = 0 - (uint64_t(1) << 36);
+  AESContainer::encode_header(header, encoded);
+  assert(!AESContainer::decode_header(encoded, &header));
+  fd = open(path, O_RDWR | O_TRUNC);
+  assert(pwrite(fd, encoded, sizeof(encoded), 0) == (ssize_t)sizeof(encoded));
+  close(fd);
+  assert(!reader.open(path));
+
+  // Chunk sizes outside the 32-bit header field are refused, not wrapped.
+  AESContainerWriter empty_chunks(aes128, true, 0);
+  assert(!empty_chunks.open(path));
+  if (sizeof(size_t) > 4) {
+    AESContainerWriter wide_chunks(aes128, true,
+                                   (size_t)((uint64_t(1) << 32) + 1));
+    assert(!wide_chunks.open(path));
+  }
+  unlink(path);
+  std::cout << "Test cases passed for seekable container." << std::endl;
+}
+
+// Cuts buffer into fragments of the given lengths, cycling through them,
+// with an empty fragment after every third.
+std::vector<struct iovec> fragment(uint8_t* buffer, size_t length,
+                                   const std::vector<size_t>& sizes) {
+  std::vector<struct iovec> fragments;
+  for (size_t done = 0, i = 0; done < length; i++) {
+    size_t size = std::min(sizes[i % sizes.size()], length - done);
+    fragments.push_back({buffer + done, size});
+    if (i % 3 == 2) fragments.push_back({buffer + done + size, 0});
+    done += size;
+  }
+  return fragments;
+}
+
+void test_iovec() {
+  std::cout << "Testing scatter/gather CTR and GCM." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  uint8_t iv[16] = {0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7,
+                    0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF};
+  const size_t length = 3 * AESThreadPool::kChunkBytes + 1001;
+  std::vector<uint8_t> plain(length);
+  for (size_t i = 0; i < length; i++) plain[i] = (uint8_t)(i * 31 + 7);
+  std::vector<uint8_t> aad(100);
+  for (size_t i = 0; i < aad.size(); i++) aad[i] = (uint8_t)i;
+
+  std::vector<uint8_t> ctr_expected(length), gcm_expected(length);
+  AESCTR(aes128, iv).process(plain.data(), ctr_expected.data(), length);
+  uint8_t tag_expected[16];
+  AESGCM gcm(aes128);
+  gcm.encrypt(iv, 12, aad.data(), aad.size(), plain.data(),
+              gcm_expected.data(), length, tag_expected, 16);
+
+  // Input and output split at unrelated points, including big fragments
+  // that take the threaded path, and the same list used in place.
+  const std::vector<size_t> splits[] = {
+      {1}, {7, 16, 33}, {4096}, {100, 3, 70000}, {2 * 65536 + 5, 15}};
+  for (const std::vector<size_t>& in_sizes : splits) {
+    for (const std::vector<size_t>& out_sizes : splits) {
+      std::vector<uint8_t> source = plain, out(length);
+      std::vector<struct iovec> in_list =
+          fragment(source.data(), length, in_sizes);
+      std::vector<struct iovec> out_list =
+          fragment(out.data(), length, out_sizes);
+      AESCTR ctr(aes128, iv, 3);
+      assert(ctr.process(in_list.data(), in_list.size(), out_list.data(),
+                         out_list.size()) == length);
+      assert(out == ctr_expected);
+
+      std::vector<struct iovec> aad_list =
+          fragment(aad.data(), aad.size(), in_sizes);
+      gcm.start(iv, 12);
+      gcm.update_aad(aad_list.data(), aad_list.size());
+      assert(gcm.encrypt_update(in_list.data(), in_list.size(),
+                                out_list.data(), out_list.size()) == length);
+      uint8_t tag[16];
+      gcm.finish(tag, 16);
+      assert(out == gcm_expected);
+      assert(memcmp(tag, tag_expected, 16) == 0);
+
+      gcm.start(iv, 12);
+      gcm.update_aad(aad.data(), aad.size());
+      assert(gcm.decrypt_update(out_list.data(), out_list.size(),
+                                out_list.data(), out_list.size()) == length);
+      assert(gcm.verify(tag_expected, 16));
+      assert(out == plain);
+    }
+  }
+
+  // Only the shorter list's bytes are processed.
+  std::vector<uint8_t> out(length);
+  struct iovec in_list[1] = {{plain.data(), 40}};
+  struct iovec out_list[2] = {{out.data(), 20}, {out.data() + 20, 30}};
+  AESCTR ctr(aes128, iv);
+  assert(ctr.process(in_list, 1, out_list, 2) == 40);
+  assert(memcmp(out.data(), ctr_expected.data(), 40) == 0);
+  std::cout << "Test cases passed for scatter/gather CTR and GCM."
+            << std::endl;
+}
+
+void test_session() {
+  std::cout << "Testing keystream look-ahead sessions." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  // The low counter bytes wrap into the high half within the stream.
+  uint8_t counter[16] = {0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7,
+                         0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0};
+  const size_t length = 20000;
+  std::vector<uint8_t> plain(length), expected(length);
+  for (size_t i = 0; i < length; i++) plain[i] = (uint8_t)(i * 13 + 5);
+  AESCTR(aes128, counter).process(plain.data(), expected.data(), length);
+
+  // Any look-ahead (none, less than a packet, the default) and packet sizes
+  // crossing slots give AESCTR's stream.
+  const size_t sizes[] = {1, 15, 16, 17, 100, 1024, 1500, 3000};
+  const size_t lookaheads[] = {0, 1000, AESCTRSession::kDefaultLookahead};
+  for (size_t lookahead : lookaheads) {
+    for (int primed = 0; primed < 2; primed++) {
+      AESCTRSession session(aes128, counter, lookahead);
+      if (primed) session.prime();
+      std::vector<uint8_t> out(length);
+      size_t done = 0, calls = 0;
+      for (size_t i = 0; done < length; i++, calls++) {
+        size_t size = std::min(sizes[i % 8], length - done);
+        session.process(plain.data() + done, out.data() + done, size);
+        done += size;
+      }
+      assert(out == expected);
+      assert(session.stats().calls == calls);
+      assert(session.stats().bytes == length);
+      if (lookahead == 0) {
+        assert(session.stats().fallback_calls == calls);
+        assert(session.stats().fallback_bytes == length);
+      }
+    }
+  }
+
+  // Once primed, the whole look-ahead is served from the ring.
+  {
+    AESCTRSession session(aes128, counter, 16384);
+    session.prime();
+    std::vector<uint8_t> out(length);
+    for (size_t done = 0; done < 16384; done += 512) {
+      session.process(plain.data() + done, out.data() + done, 512);
+    }
+    assert(session.stats().fallback_calls == 0);
+    assert(memcmp(out.data(), expected.data(), 16384) == 0);
+  }
+
+  // GCM packets match AESGCM under the per-packet nonce, whether served
+  // from the ring, past its end, or too long for a slot.
+  uint8_t iv[12] = {0xCA, 0xFE, 0xBA, 0xBE, 0xFA, 0xCE,
+                    0xDB, 0xAD, 0xDE, 0xCA, 0xF8, 0x88};
+  uint8_t aad[20];
+  for (int i = 0; i < 20; i++) aad[i] = (uint8_t)(i * 7);
+  AESGCM gcm(aes128);
+  AESGCMSession sender(aes128, iv, 1500, 8);
+  AESGCMSession receiver(aes128, iv, 1500, 0);
+  sender.prime();
+  uint8_t nonce[12];
+  sender.nonce(0x0102, nonce);
+  assert(memcmp(nonce, iv, 8) == 0);
+  assert(nonce[10] == (0xF8 ^ 0x01) && nonce[11] == (0x88 ^ 0x02));
+  const size_t packets[] = {0, 1, 16, 100, 1499, 1500, 1501, 4000,
+                            37, 1500, 64, 64, 9, 1024};
+  for (size_t size : packets) {
+    uint64_t sequence = sender.sequence();
+    std::vector<uint8_t> sealed(size), opened(size), reference(size);
+    uint8_t tag[16], reference_tag[16];
+    sender.seal(aad, sizeof(aad), plain.data(), sealed.data(), size, tag, 16);
+    sender.nonce(sequence, nonce);
+    gcm.encrypt(nonce, 12, aad, sizeof(aad), plain.data(), reference.data(),
+                size, reference_tag, 16);
+    assert(sealed == reference);
+    assert(memcmp(tag, reference_tag, 16) == 0);
+
+    assert(receiver.open(aad, sizeof(aad), sealed.data(), opened.data(), size,
+                         tag, 16));
+    assert(size == 0 || memcmp(opened.data(), plain.data(), size) == 0);
+  }
+  assert(sender.stats().calls == 14);
+  // The primed look-ahead covers the first 8, but not the two long ones.
+  assert(sender.stats().fallback_calls >= 2);
+  assert(receiver.stats().fallback_calls == 14);
+
+  // Tampering fails, and the sequence still moves on.
+  AESGCMSession session(aes128, iv, 1500, 4);
+  session.prime();
+  uint8_t sealed[100], opened[100], tag[16];
+  session.seal(aad, sizeof(aad), plain.data(), sealed, 100, tag, 12);
+  AESGCMSession peer(aes128, iv, 1500, 4);
+  peer.prime();
+  sealed[50] ^= 1;
+  assert(!peer.open(aad, sizeof(aad), sealed, opened, 100, tag, 12));
+  assert(peer.sequence() == 1);
+  // In place, with a partial last block.
+  session.seal(aad, sizeof(aad), plain.data(), sealed, 100, tag, 12);
+  assert(peer.stats().fallback_calls == 0);
+  assert(peer.open(aad, sizeof(aad), sealed, sealed, 100, tag, 12));
+  assert(peer.stats().fallback_calls == 0);
+  assert(memcmp(sealed, plain.data(), 100) == 0);
+  assert(!session.seal(aad, sizeof(aad), plain.data(), sealed, 100, tag, 32));
+  assert(session.sequence() == 2);
+  std::cout << "Test cases passed for keystream look-ahead sessions."
+            << std::endl;
+}
+
+#if AES_HAVE_COROUTINES
+// A coroutine that starts at once and is never awaited itself.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return DetachedTask(); }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::abort(); }
+  };
+};
+
+DetachedTask seal_and_open(AESAsync& async, AESAsyncRequest request,
+                           uint8_t* opened, int* result) {
+  bool sealed = co_await async.encrypt_async(request);
+  request.in = request.out;
+  request.out = opened;
+  bool ok = co_await async.decrypt_async(request);
+  *result = sealed && ok ? 1 : 0;
+}
+#endif
+
+void test_async() {
+  std::cout << "Testing asynchronous requests." << std::endl;
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  AESGCM gcm(aes128);
+  const size_t length = 3 * AESThreadPool::kChunkBytes + 1001;
+  std::vector<uint8_t> plain(length);
+  for (size_t i = 0; i < length; i++) plain[i] = (uint8_t)(i * 17 + 3);
+  uint8_t aad[24];
+  for (int i = 0; i < 24; i++) aad[i] = (uint8_t)(i * 5);
+
+  // Inline and large requests of both modes, queued together. Each uses
+  // its own IV, and the GCM ones are opened again afterwards.
+  const size_t sizes[] = {0, 1, 16, 100, 1500, 4096, 70000, length};
+  const int count = 16;
+  std::vector<std::vector<uint8_t>> outs(count), opened(count);
+  std::vector<std::vector<uint8_t>> ivs(count, std::vector<uint8_t>(16));
+  std::vector<std::vector<uint8_t>> tags(count, std::vector<uint8_t>(16));
+  std::vector<AESAsyncRequest> requests(count);
+  int wakeups = 0;
+  std::mutex wakeup_mutex;
+  AESAsync async(aes128, 4096, 2);
+  async.set_wakeup([&] {
+    std::lock_guard<std::mutex> lock(wakeup_mutex);
+    wakeups++;
+  });
+  int called = 0;
+  for (int i = 0; i < count; i++) {
+    size_t size = sizes[i % 8];
+    for (int j = 0; j < 16; j++) ivs[i][j] = (uint8_t)(i * 16 + j);
+    outs[i].resize(size);
+    AESAsyncRequest& request = requests[i];
+    request.mode = i < 8 ? AESAsyncMode::kCTR : AESAsyncMode::kGCM;
+    request.iv = ivs[i].data();
+    request.in = plain.data();
+    request.out = outs[i].data();
+    request.length = size;
+    request.aad = aad;
+    request.aad_length = i % 3 == 0 ? 0 : sizeof(aad);
+    request.tag = tags[i].data();
+    request.tag_length = 16;
+    async.encrypt_async(request, [&called](bool ok) {
+      assert(ok);
+      called++;
+    });
+  }
+  // Nothing calls back before poll(), and the inline ones run in one pass.
+  assert(called == 0);
+  assert(async.pending() == (size_t)count);
+  assert(async.stats().inline_requests == 12);
+  assert(async.stats().offloaded_requests == 4);
+  async.drain();
+  assert(called == count);
+  assert(async.pending() == 0);
+  assert(async.stats().batches == 1);
+  // The wakeup follows each hand-back, so the last may still be running.
+  for (;;) {
+    std::lock_guard<std::mutex> lock(wakeup_mutex);
+    assert(wakeups <= 4);
+    if (wakeups == 4) break;
+  }
+  for (int i = 0; i < count; i++) {
+    const AESAsyncRequest& request = requests[i];
+    std::vector<uint8_t> expected(request.length);
+    if (request.mode == AESAsyncMode::kCTR) {
+      AESCTR(aes128, request.iv)
+          .process(plain.data(), expected.data(), request.length);
+    } else {
+      uint8_t tag[16];
+      gcm.encrypt(request.iv, 12, aad, request.aad_length, plain.data(),
+                  expected.data(), request.length, tag, 16);
+      assert(memcmp(tag, tags[i].data(), 16) == 0);
+    }
+    assert(outs[i] == expected);
+  }
+
+  // Opening, with the ciphertext of every other request tampered with.
+  called = 0;
+  for (int i = 8; i < count; i++) {
+    AESAsyncRequest request = requests[i];
+    bool tampered = i % 2 == 1 && request.length > 0;
+    if (tampered) outs[i][request.length / 2] ^= 0x80;
+    opened[i].resize(request.length);
+    request.in = outs[i].data();
+    request.out = opened[i].data();
+    async.decrypt_async(request, [&called, &opened, &plain, i, tampered,
+                                  request](bool ok) {
+      assert(ok == !tampered);
+      if (ok) {
+        assert(request.length == 0 ||
+               memcmp(opened[i].data(), plain.data(), request.length) == 0);
+      }
+      called++;
+    });
+  }
+  async.drain();
+  assert(called == 8);
+
+  // An invalid tag length fails the request, inline or offloaded.
+  for (size_t size : {(size_t)100, length}) {
+    AESAsyncRequest request = requests[8];
+    std::vector<uint8_t> long_tag(32), sealed(size);
+    request.length = size;
+    request.out = sealed.data();
+    request.tag = long_tag.data();
+    request.tag_length = 32;
+    bool result = true;
+    async.encrypt_async(request, [&result](bool ok) { result = ok; });
+    async.drain();
+    assert(!result);
+  }
+
+  // Requests that callbacks submit wait for the next poll(), and polling
+  // from a callback does nothing.
+  AESAsync small(aes128, 1 << 20);
+  std::vector<uint8_t> out(length);
+  AESAsyncRequest request;
+  request.iv = ivs[0].data();
+  request.in = plain.data();
+  request.out = out.data();
+  request.length = 60000;
+  called = 0;
+  small.encrypt_async(request, [&](bool) {
+    called++;
+    assert(small.poll() == 0);
+    AESAsyncRequest next = request;
+    next.out = out.data() + 60000;
+    small.encrypt_async(next, [&called](bool) { called++; });
+  });
+  small.encrypt_async(request, [&called](bool) { called++; });
+  assert(small.stats().batches == 0);
+  assert(small.poll() == 2);
+  assert(called == 2);
+  assert(small.pending() == 1);
+  small.drain();
+  assert(called == 3);
+  assert(small.stats().batches == 2);
+  assert(small.stats().offloaded_requests == 0);
+  std::vector<uint8_t> expected(60000);
+  AESCTR(aes128, ivs[0].data())
+      .process(plain.data(), expected.data(), 60000);
+  assert(memcmp(out.data(), expected.data(), 60000) == 0);
+  assert(memcmp(out.data() + 60000, expected.data(), 60000) == 0);
+
+#if AES_HAVE_COROUTINES
+  for (size_t size : {(size_t)100, length}) {
+    AESAsyncRequest sealed = requests[8];
+    std::vector<uint8_t> ciphertext(size), decrypted(size);
+    sealed.in = plain.data();
+    sealed.out = ciphertext.data();
+    sealed.length = size;
+    int result = -1;
+    seal_and_open(async, sealed, decrypted.data(), &result);
+    async.drain();
+    assert(result == 1);
+    assert(memcmp(decrypted.data(), plain.data(), size) == 0);
+  }
+#endif
+  std::cout << "Test cases passed for asynchronous requests." << std::endl;
+}
+
+void test_thread_pool() {
+  std::cout << "Testing work-stealing thread pool." << std::endl;
+  AESThreadPool pool(3, std::vector<int>(1, 0));
+  assert(pool.workers() == 3);
+
+  // Every chunk runs exactly once, on no more threads than allowed, also
+  // while several callers share the pool.
+  const size_t chunks = 1000;
+  std::vector<std::thread> callers;
+  bool failed[3] = {false, false, false};
+  for (int c = 0; c < 3; c++) {
+    callers.emplace_back([&pool, &failed, c] {
+      for (unsigned int parallelism = 1; parallelism <= 5; parallelism++) {
+        std::vector<std::atomic<int>> calls(chunks);
+        for (std::atomic<int>& count : calls) count = 0;
+        std::mutex mutex;
+        std::vector<std::thread::id> seen;
+        pool.run(chunks, parallelism, [&](size_t i) {
+          calls[i]++;
+          std::lock_guard<std::mutex> lock(mutex);
+          if (std::find(seen.begin(), seen.end(),
+                        std::this_thread::get_id()) == seen.end()) {
+            seen.push_back(std::this_thread::get_id());
+          }
+        });
+        for (std::atomic<int>& count : calls) {
+          if (count != 1) failed[c] = true;
+        }
+        if (seen.size() > parallelism) failed[c] = true;
+      }
+    });
+  }
+  for (std::thread& caller : callers) caller.join();
+  for (bool f : failed) assert(!f);
+
+  // ECB, CTR, CBC and XTS on the pool match single-threaded results.
+  unsigned char key[4][4] = {{0x2B, 0x7E, 0x15, 0x16},
+                             {0x28, 0xAE, 0xD2, 0xA6},
+                             {0xAB, 0xF7, 0x15, 0x88},
+                             {0x09, 0xCF, 0x4F, 0x3C}};
+  AES128 aes128(key);
+  std::vector<uint8_t> plain_text(16 * 40000);
+  for (size_t i = 0; i < plain_text.size(); i++) {
+    plain_text[i] = (uint8_t)(i * 29 + 11);
+  }
+  std::vector<uint8_t> expected(plain_text.size());
+  std::vector<uint8_t> out(plain_text);
+  aes128.encrypt_blocks(plain_text.data(), expected.data(), 40000);
+  pool.encrypt_blocks(aes128, out.data(), out.data(), 40000);
+  assert(out == expected);
+  pool.decrypt_blocks(aes128, out.data(), out.data(), 40000, 2);
+  assert(out == plain_text);
+
+  std::vector<uint8_t> iv = from_hex("000102030405060708090a0b0c0d0e0f");
+  AESCTR(aes128, iv.data()).process(plain_text.data(), expected.data(),
+                                    expected.size());
+  AESCTR ctr(aes128, iv.data(), 4);
+  ctr.set_pool(pool);
+  ctr.process(plain_text.data(), out.data(), out.size());
+  assert(out == expected);
+
+  std::vector<uint8_t> chain(iv);
+  AESCBC cbc(aes128);
+  cbc.encrypt_blocks(chain.data(), plain_text.data(), expected.data(), 40000);
+  cbc.set_threads(4);
+  cbc.set_pool(pool);
+  chain = iv;
+  out = expected;
+  cbc.decrypt_blocks(chain.data(), out.data(), out.data(), 40000);
+  assert(out == plain_text);
+
+  const size_t count = 50;
+  std::vector<std::vector<uint8_t>> outputs(count);
+  std::vector<AESCBC::Message> messages(count);
+  for (size_t i = 0; i < count; i++) {
+    size_t length = (i * 53) % 300;
+    outputs[i].resize(AESCBC::padded_length(length));
+    messages[i] = {iv.data(), plain_text.data() + i, length,
+                   outputs[i].data()};
+  }
+  cbc.encrypt_messages(messages.data(), count);
+  for (size_t i = 0; i < count; i++) {
+    std::vector<uint8_t> single(outputs[i].size());
+    cbc.encrypt(iv.data(), messages[i].in, messages[i].length, single.data());
+    assert(outputs[i] == single);
+  }
+
+  unsigned char tweak_key[4][4] = {{0}};
+  AES128 tweak_cipher(tweak_key);
+  AESXTS xts(aes128, tweak_cipher);
+  xts.encrypt_sectors(7, plain_text.data(), expected.data(), 512, 1250);
+  xts.set_threads(4);
+  xts.set_pool(pool);
+  xts.encrypt_sectors(7, plain_text.data(), out.data(), 512, 1250);
+  assert(out == expected);
+  std::cout << "Test cases passed for work-stealing thread pool."
+            << std::endl;
+}
+
+// Only checks anything when built with -DAES_INSTRUMENT=1.
+void test_instrumentation() {
+#if AES_INSTRUMENT
+  std::cout << "Testing instrumentation." << std::endl;
+  AESStats::Snapshot before = AESStats::snapshot();
+  unsigned char key[6][4] = {{0}};
+  AES192 aes192(key);
+  aes192.set_backend(AESBackend::kTTable);
+  std::vector<uint8_t> data(16 * 100);
+  aes192.encrypt_blocks(data.data(), data.data(), 100);
+  uint8_t iv[16] = {0};
+  std::thread worker([&aes192, &data, &iv] {
+    AESCTR(aes192, iv).process(data.data(), data.data(), 1000);
+  });
+  worker.join();
+  AESStats::Snapshot after = AESStats::snapshot();
+
+  const int k = 1;  // 192-bit keys
+  int setup = (int)AESOperation::kKeySetup;
+  int ecb = (int)AESOperation::kEncryptBlocks;
+  int ctr = (int)AESOperation::kCTR;
+  assert(after.operations[k][setup].calls ==
+         before.operations[k][setup].calls + 1);
+  // The CTR call ran its keystream through encrypt_blocks as well.
+  assert(after.operations[k][ecb].blocks >=
+         before.operations[k][ecb].blocks + 100 + 63);
+  assert(after.operations[k][ctr].calls == before.operations[k][ctr].calls + 1);
+  assert(after.operations[k][ctr].bytes ==
+         before.operations[k][ctr].bytes + 1000);
+  assert(after.backend_blocks[k][(int)AESBackend::kTTable] >=
+         before.backend_blocks[k][(int)AESBackend::kTTable] + 100 + 63);
+  assert(after.latency_quantile(AESOperation::kCTR, 0.5) > 0);
+  std::string text = AESStats::export_text();
+  assert(text.find("aes_calls_total{key_bits=\"192\",operation=\"ctr\"}") !=
+         std::string::npos);
+  // The latency histogram carries the _sum a Prometheus histogram needs.
+  assert(text.find("aes_latency_ns_sum{operation=\"ctr\"}") !=
+         std::string::npos);
+  std::cout << "Test cases passed for instrumentation." << std::endl;
+#endif
+}
+
 int main() {
   test_aes_128_encryption();
   test_aes_128_decryption();
@@ -150,5 +1801,27 @@ int main() {
   test_aes_192_decrypion();
   test_aes_256_encryption();
   test_aes_256_decryption();
+  test_backends_match_reference();
+  test_bitsliced_multi_block();
+  test_multi_block_api();
+  test_flat_block_api();
+  test_aes_template();
+  test_ctr_nist_vectors();
+  test_ctr_threads_match_single_thread();
+  test_key_cache();
+  test_gcm_nist_vectors();
+  test_cbc_nist_vectors();
+  test_cbc_padding_threads_and_lanes();
+  test_xts();
+  test_cmac();
+  test_drbg();
+  test_key_batch();
+  test_compact();
+  test_container();
+  test_iovec();
+  test_session();
+  test_async();
+  test_thread_pool();
+  test_instrumentation();
   return 0;
 }